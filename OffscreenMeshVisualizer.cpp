@@ -4,6 +4,97 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/euler_angles.hpp>
 
+#include <cstring>
+#include <map>
+
+namespace {
+  // Deliberately never deleted unless the thread releases it, see
+  // OffscreenRenderContext::ReleaseCurrentThread
+  thread_local OffscreenRenderContext* current_thread_context = nullptr;
+
+  QSurfaceFormat OffscreenSurfaceFormat() {
+    QSurfaceFormat format;
+    format.setMajorVersion(3);
+    format.setMinorVersion(3);
+    return format;
+  }
+}
+
+OffscreenRenderContext::OffscreenRenderContext(QOffscreenSurface* shared_surface)
+  : surface(shared_surface) {
+  if(surface == nullptr) {
+    own_surface = CreateSurface();
+    surface = own_surface.get();
+  }
+
+  context.setFormat(OffscreenSurfaceFormat());
+  if (!context.create())
+    qFatal("Cannot create the requested OpenGL context!");
+}
+
+unique_ptr<QOffscreenSurface> OffscreenRenderContext::CreateSurface() {
+  unique_ptr<QOffscreenSurface> surface(new QOffscreenSurface());
+  surface->setFormat(OffscreenSurfaceFormat());
+  surface->create();
+  return surface;
+}
+
+OffscreenRenderContext& OffscreenRenderContext::ForCurrentThread(QOffscreenSurface* surface) {
+  if(current_thread_context == nullptr) {
+    current_thread_context = new OffscreenRenderContext(surface);
+  }
+  current_thread_context->context.makeCurrent(current_thread_context->surface);
+  return *current_thread_context;
+}
+
+void OffscreenRenderContext::ReleaseCurrentThread() {
+  if(current_thread_context == nullptr) return;
+  // The framebuffers need the context to be current when they are deleted
+  current_thread_context->context.makeCurrent(current_thread_context->surface);
+  current_thread_context->framebuffers.clear();
+  current_thread_context->mesh_buffers.Clear();
+  current_thread_context->context.doneCurrent();
+  delete current_thread_context;
+  current_thread_context = nullptr;
+}
+
+QOpenGLFramebufferObject* OffscreenRenderContext::Framebuffer(int width, int height,
+                                                              bool multi_sampled) {
+  // Disable sampling to avoid blending along edges
+  const int samples = multi_sampled ? 16 : 0;
+  auto key = make_tuple(width, height, samples);
+  for(auto it = framebuffers.begin(); it != framebuffers.end(); ++it) {
+    if(it->first == key) {
+      framebuffers.splice(framebuffers.begin(), framebuffers, it);
+      return framebuffers.front().second.get();
+    }
+  }
+
+  QOpenGLFramebufferObjectFormat fboFormat;
+  fboFormat.setSamples(samples);
+  fboFormat.setAttachment(QOpenGLFramebufferObject::Depth);
+  framebuffers.emplace_front(key, unique_ptr<QOpenGLFramebufferObject>(
+    new QOpenGLFramebufferObject(QSize(width, height), fboFormat)));
+  if(framebuffers.size() > kMaxFramebuffers) framebuffers.pop_back();
+  return framebuffers.front().second.get();
+}
+
+shared_ptr<const json> OffscreenMeshVisualizer::LoadSettings(const string& filename) {
+  static mutex settings_mutex;
+  static map<string, shared_ptr<const json>> settings_cache;
+
+  lock_guard<mutex> lock(settings_mutex);
+  auto& settings = settings_cache[filename];
+  if(!settings) {
+    cout << "Loading rendering settings " << filename << endl;
+    auto parsed = make_shared<json>();
+    ifstream fin(filename);
+    fin >> *parsed;
+    settings = parsed;
+  }
+  return settings;
+}
+
 void OffscreenMeshVisualizer::SetupViewing(const MVPMode& mvp_mode) const {
   switch(mvp_mode) {
     case OrthoNormalExtended: {
@@ -75,9 +166,6 @@ void OffscreenMeshVisualizer::SetupViewing(const MVPMode& mvp_mode) const {
 void OffscreenMeshVisualizer::CreateTexture() const {
   cout << "Creating opengl texture ..." << endl;
 #if 1
-  if( image_tex >= 0 )
-    glDeleteTextures(1, &image_tex);
-
   glEnable(GL_TEXTURE_2D);
   glGenTextures(1, &image_tex);
   glBindTexture(GL_TEXTURE_2D, image_tex);
@@ -96,9 +184,10 @@ void OffscreenMeshVisualizer::CreateTexture() const {
 void OffscreenMeshVisualizer::EnableLighting() const
 {
   enabled_lights.clear();
+  const json& settings = *rendering_settings;
 
   // Setup material
-  auto& mat_specular_json = rendering_settings["material"]["specular"];
+  auto& mat_specular_json = settings["material"]["specular"];
   GLfloat mat_specular[] = {
     mat_specular_json[0],
     mat_specular_json[1],
@@ -106,7 +195,7 @@ void OffscreenMeshVisualizer::EnableLighting() const
     mat_specular_json[3]
   };
 
-  auto& mat_diffuse_json = rendering_settings["material"]["diffuse"];
+  auto& mat_diffuse_json = settings["material"]["diffuse"];
   GLfloat mat_diffuse[] = {
     mat_diffuse_json[0],
     mat_diffuse_json[1],
@@ -114,7 +203,7 @@ void OffscreenMeshVisualizer::EnableLighting() const
     mat_diffuse_json[3]
   };
 
-  auto& mat_shininess_json = rendering_settings["material"]["shininess"];
+  auto& mat_shininess_json = settings["material"]["shininess"];
   GLfloat mat_shininess[] = {mat_shininess_json};
 
   glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
@@ -122,7 +211,7 @@ void OffscreenMeshVisualizer::EnableLighting() const
   glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
 
   // Setup Lights
-  auto setup_light = [&](json light_json) {
+  auto setup_light = [&](const json& light_json) {
     auto light_i = GL_LIGHT0 + enabled_lights.size();
 
     GLfloat light_position[] = {
@@ -158,8 +247,8 @@ void OffscreenMeshVisualizer::EnableLighting() const
     enabled_lights.push_back(light_i);
   };
 
-  for(json::const_iterator it = rendering_settings["lights"].cbegin();
-      it != rendering_settings["lights"].cend();
+  for(json::const_iterator it = settings["lights"].cbegin();
+      it != settings["lights"].cend();
       ++it)
   {
     setup_light(*it);
@@ -177,33 +266,10 @@ void OffscreenMeshVisualizer::DisableLighting() const
   glDisable(GL_LIGHTING);
 }
 
-pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_sampled) const {
-  boost::timer::auto_cpu_timer t("render time = %w seconds.\n");
-  QSurfaceFormat format;
-  format.setMajorVersion(3);
-  format.setMinorVersion(3);
-
-  QOffscreenSurface surface;
-  surface.setFormat(format);
-  surface.create();
-
-  QOpenGLContext context;
-  context.setFormat(format);
-  if (!context.create())
-    qFatal("Cannot create the requested OpenGL context!");
-  context.makeCurrent(&surface);
-
-  const QRect drawRect(0, 0, width, height);
-  const QSize drawRectSize = drawRect.size();
-
-  QOpenGLFramebufferObjectFormat fboFormat;
-  // Disable sampling to avoid blending along edges
-  if(multi_sampled) fboFormat.setSamples(16);
-  else fboFormat.setSamples(0);
-  fboFormat.setAttachment(QOpenGLFramebufferObject::Depth);
-
-  QOpenGLFramebufferObject fbo(drawRectSize, fboFormat);
-  fbo.bind();
+void OffscreenMeshVisualizer::Draw(OffscreenRenderContext& context) const {
+  // The context outlives this render, start from the default state and
+  // leave it that way for the next one
+  glPushAttrib(GL_ALL_ATTRIB_BITS);
 
   if(!image.isNull()) CreateTexture();
 
@@ -223,42 +289,21 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   glEnable(GL_DEPTH_TEST);
 
-  if(faces_to_render.empty()) {
-    faces_to_render.resize(mesh.NumFaces());
-    for(int face_i = 0; face_i < mesh.NumFaces(); ++face_i) {
-      faces_to_render[face_i] = face_i;
-    }
-  }
+  // Custom normals only apply to MeshAndImage
+  MeshBuffers& buffers = context.Buffers();
+  if(render_mode == MeshAndImage) buffers.Update(mesh, normals);
+  else buffers.Update(mesh);
+  buffers.SetFaces(faces_to_render);
 
   switch(render_mode) {
     case Texture: {
       SetupViewing(mode);
       //PhGUtils::message("rendering texture.");
-      for(int face_i : faces_to_render) {
-        auto normal_i = mesh.normal(face_i);
-        auto f = mesh.face_texture(face_i);
-        auto t0 = mesh.texture_coords(f[0]), t1 = mesh.texture_coords(f[1]), t2 = mesh.texture_coords(f[2]);
-        unsigned char r, g, b;
-        ColorEncoding::encode_index(face_i, r, g, b);
-        int tmp_idx;
-        assert(ColorEncoding::decode_index(r, g, b, tmp_idx) == face_i);
-        glBegin(GL_TRIANGLES);
-
 #if DEBUG_GEN
-        glColor4f(1, 0, 0, 1);
-        glVertex2f(t0[0], t0[1]);
-        glColor4f(0, 1, 0, 1);
-        glVertex2f(t1[0], t1[1]);
-        glColor4f(0, 0, 1, 1);
-        glVertex2f(t2[0], t2[1]);
+      buffers.Draw(MeshBuffers::TexCoordAsPosition | MeshBuffers::BarycentricColor);
 #else
-        glColor4ub(r, g, b, 255);
-        glVertex2f(t0[0], t0[1]);
-        glVertex2f(t1[0], t1[1]);
-        glVertex2f(t2[0], t2[1]);
+      buffers.Draw(MeshBuffers::TexCoordAsPosition | MeshBuffers::IndexColor);
 #endif
-        glEnd();
-      }
       //PhGUtils::message("done.");
       break;
     }
@@ -267,22 +312,7 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
       //PhGUtils::message("rendering texture.");
 
       glShadeModel(GL_SMOOTH);
-
-      for(int face_i : faces_to_render) {
-        auto f = mesh.face(face_i);
-        auto v0 = mesh.vertex(f[0]), v1 = mesh.vertex(f[1]), v2 = mesh.vertex(f[2]);
-
-        glBegin(GL_TRIANGLES);
-
-        glColor4f(1, 0, 0, 1);
-        glVertex3f(v0[0], v0[1], v0[2]);
-        glColor4f(0, 1, 0, 1);
-        glVertex3f(v1[0], v1[1], v1[2]);
-        glColor4f(0, 0, 1, 1);
-        glVertex3f(v2[0], v2[1], v2[2]);
-
-        glEnd();
-      }
+      buffers.Draw(MeshBuffers::Position | MeshBuffers::BarycentricColor);
       //PhGUtils::message("done.");
       break;
     }
@@ -292,39 +322,13 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
       if(lighting_enabled) EnableLighting();
 
       //PhGUtils::message("rendering mesh.");
-      for(int face_i : faces_to_render) {
-        auto f = mesh.face(face_i);
-        auto v0 = mesh.vertex(f[0]), v1 = mesh.vertex(f[1]), v2 = mesh.vertex(f[2]);
-        unsigned char r, g, b;
-        ColorEncoding::encode_index(face_i, r, g, b);
-        int tmp_idx;
-        assert(ColorEncoding::decode_index(r, g, b, tmp_idx) == face_i);
-
-        if(index_encoded)
-          glShadeModel(GL_FLAT);
-        else
-          glShadeModel(GL_SMOOTH);
-
-        glBegin(GL_TRIANGLES);
-
-        if(!index_encoded) {
-          auto n = mesh.normal(face_i);
-          glNormal3f(n[0], n[1], n[2]);
-        }
-
-        if(index_encoded)
-          glColor4ub(r, g, b, 255);
-        else
-          glColor4ub(100, 100, 100, 200);
-
-        //glColor3f(1, 0, 0);
-        glVertex3f(v0[0], v0[1], v0[2]);
-        //glColor3f(0, 1, 0);
-        glVertex3f(v1[0], v1[1], v1[2]);
-        //glColor3f(0, 0, 1);
-        glVertex3f(v2[0], v2[1], v2[2]);
-
-        glEnd();
+      if(index_encoded) {
+        glShadeModel(GL_FLAT);
+        buffers.Draw(MeshBuffers::Position | MeshBuffers::IndexColor);
+      } else {
+        glShadeModel(GL_SMOOTH);
+        glColor4ub(100, 100, 100, 200);
+        buffers.Draw(MeshBuffers::Position | MeshBuffers::FaceNormal);
       }
       //PhGUtils::message("done.");
       break;
@@ -362,10 +366,11 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
       }
 
       bool has_texture = false;
+      GLuint mesh_tex = 0;
       if ( !texture.isNull() ) {
         glEnable(GL_TEXTURE_2D);
-        glGenTextures(1, &image_tex);
-        glBindTexture(GL_TEXTURE_2D, image_tex);
+        glGenTextures(1, &mesh_tex);
+        glBindTexture(GL_TEXTURE_2D, mesh_tex);
         // TODO need to address the RGBA/BGRA issue of the input texuture
         // HACK Changed to BGRA for blendshape_driver
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture.width(), texture.height(), 0, GL_BGRA,
@@ -399,133 +404,58 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
       glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
 #endif
 
-      bool use_customized_normals = !normals.empty();
+      // The custom normals, if any, are in the buffers already
       bool use_ao = !ao.empty();
       cout << "using ao: " << (use_ao?"yes":"no") << endl;
-      auto set_material_with_ao = [&](float ao_value) {
-        auto& mat_diffuse_json = rendering_settings["material"]["diffuse"];
-        GLfloat mat_diffuse[] = {
-          float(mat_diffuse_json[0]) * pow(ao_value, static_cast<double>(rendering_settings["ao_power"])),
-          float(mat_diffuse_json[1]) * pow(ao_value, static_cast<double>(rendering_settings["ao_power"])),
-          float(mat_diffuse_json[2]) * pow(ao_value, static_cast<double>(rendering_settings["ao_power"])),
-          float(mat_diffuse_json[3])
-        };
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
-      };
-
-      for(int face_i : faces_to_render) {
-        auto normal_i = mesh.normal(face_i);
-        auto f = mesh.face(face_i);
-        auto v0 = mesh.vertex(f[0]), v1 = mesh.vertex(f[1]), v2 = mesh.vertex(f[2]);
-
-        Vector3d n0, n1, n2;
-        if(use_customized_normals) {
-          n0 = Vector3d(normals[f[0]*3], normals[f[0]*3+1], normals[f[0]*3+2]); n0.normalize();
-          n1 = Vector3d(normals[f[1]*3], normals[f[1]*3+1], normals[f[1]*3+2]); n1.normalize();
-          n2 = Vector3d(normals[f[2]*3], normals[f[2]*3+1], normals[f[2]*3+2]); n2.normalize();
-        } else {
-          n0 = mesh.vertex_normal(f[0]);
-          n1 = mesh.vertex_normal(f[1]);
-          n2 = mesh.vertex_normal(f[2]);
+      int attributes = MeshBuffers::Position | MeshBuffers::VertexNormal;
+      if(has_texture) attributes |= MeshBuffers::TexCoord;
+      if(use_ao) {
+        // The ambient occlusion scales the diffuse material per vertex, which
+        // the color array provides through the color material
+        const json& settings = *rendering_settings;
+        auto& mat_diffuse_json = settings["material"]["diffuse"];
+        const double ao_power = settings["ao_power"];
+        vector<float> colors(mesh.NumVertices() * 4);
+        for(int i=0;i<mesh.NumVertices();++i) {
+          const float ao_scale = pow(ao[i], ao_power);
+          for(int j=0;j<3;++j) colors[i*4+j] = float(mat_diffuse_json[j]) * ao_scale;
+          colors[i*4+3] = float(mat_diffuse_json[3]);
         }
+        buffers.SetColors(mesh, colors);
+        attributes |= MeshBuffers::CustomColor;
 
-        if(has_texture) {
-          auto tf = mesh.face_texture(face_i);
-          auto t0 = mesh.texture_coords(tf[0]), t1 = mesh.texture_coords(tf[1]), t2 = mesh.texture_coords(tf[2]);
-
-          glShadeModel(GL_SMOOTH);
-
-          glBegin(GL_TRIANGLES);
-
-          if(use_ao) set_material_with_ao( ao[f[0]] );
-          //GLfloat face_color_0[] = {(n0[0]+1.0)*0.5, (n0[1]+1.0)*0.5, (n0[2]+1.0)*0.5, static_cast<float>(face_alpha)};
-          //glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, face_color_0);
-          glNormal3dv(n0.data());glTexCoord2f(t0[0], 1.0-t0[1]);glVertex3f(v0[0], v0[1], v0[2]);
-
-          if(use_ao) set_material_with_ao( ao[f[1]] );
-          //GLfloat face_color_1[] = {(n1[0]+1.0)*0.5, (n1[1]+1.0)*0.5, (n1[2]+1.0)*0.5, static_cast<float>(face_alpha)};
-          //glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, face_color_1);
-          glNormal3dv(n1.data());glTexCoord2f(t1[0], 1.0-t1[1]);glVertex3f(v1[0], v1[1], v1[2]);
-
-          if(use_ao) set_material_with_ao( ao[f[2]] );
-          //GLfloat face_color_2[] = {(n2[0]+1.0)*0.5, (n2[1]+1.0)*0.5, (n2[2]+1.0)*0.5, static_cast<float>(face_alpha)};
-          //glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, face_color_2);
-          glNormal3dv(n2.data());glTexCoord2f(t2[0], 1.0-t2[1]);glVertex3f(v2[0], v2[1], v2[2]);
-          glEnd();
-        } else {
-          glShadeModel(GL_SMOOTH);
-
-          glBegin(GL_TRIANGLES);
-
-          if(use_ao) set_material_with_ao( ao[f[0]] );
-          //GLfloat face_color_0[] = {(n0[0]+1.0)*0.5, (n0[1]+1.0)*0.5, (n0[2]+1.0)*0.5, static_cast<float>(face_alpha)};
-          //glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, face_color_0);
-          glNormal3dv(n0.data());glVertex3f(v0[0], v0[1], v0[2]);
-
-          if(use_ao) set_material_with_ao( ao[f[1]] );
-          //GLfloat face_color_1[] = {(n1[0]+1.0)*0.5, (n1[1]+1.0)*0.5, (n1[2]+1.0)*0.5, static_cast<float>(face_alpha)};
-          //glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, face_color_1);
-          glNormal3dv(n1.data());glVertex3f(v1[0], v1[1], v1[2]);
-
-          if(use_ao) set_material_with_ao( ao[f[2]] );
-          //GLfloat face_color_2[] = {(n2[0]+1.0)*0.5, (n2[1]+1.0)*0.5, (n2[2]+1.0)*0.5, static_cast<float>(face_alpha)};
-          //glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, face_color_2);
-          glNormal3dv(n2.data());glVertex3f(v2[0], v2[1], v2[2]);
-          glEnd();
-        }
+        glEnable(GL_COLOR_MATERIAL);
+        glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
       }
+
+      glShadeModel(GL_SMOOTH);
+      buffers.Draw(attributes);
+      if(use_ao) glDisable(GL_COLOR_MATERIAL);
+
       glDisable(GL_CULL_FACE);
       if(has_texture) {
         glDisable(GL_TEXTURE_2D);
+        glDeleteTextures(1, &mesh_tex);
       }
       break;
     }
     case Normal: {
       //PhGUtils::message("rendering normals.");
       SetupViewing(mode);
-      for(int face_i : faces_to_render) {
-        auto normal_i = mesh.normal(face_i);
-        auto f = mesh.face(face_i);
-        auto v0 = mesh.vertex(f[0]), v1 = mesh.vertex(f[1]), v2 = mesh.vertex(f[2]);
-        auto n = mesh.normal(face_i);
-
-        // process the normal vectors
-        glm::dmat4 Mnormal = glm::transpose(glm::inverse(Mview));
-
-        Vector3d n00 = mesh.vertex_normal(f[0]);
-        Vector3d n10 = mesh.vertex_normal(f[1]);
-        Vector3d n20 = mesh.vertex_normal(f[2]);
-
-        glm::dvec4 n0(n00[0], n00[1], n00[2], 1);
-        glm::dvec4 n1(n10[0], n10[1], n10[2], 1);
-        glm::dvec4 n2(n20[0], n20[1], n20[2], 1);
-
-        n0 = Mnormal * n0;
-        n1 = Mnormal * n1;
-        n2 = Mnormal * n2;
-
-        Vector3d nv0(n0.x, n0.y, n0.z); nv0.normalize();
-        Vector3d nv1(n1.x, n1.y, n1.z); nv1.normalize();
-        Vector3d nv2(n2.x, n2.y, n2.z); nv2.normalize();
-
-        nv0 = Vector3d(nv0[0] + 1.0, nv0[1] + 1.0, nv0[2] + 1.0) * 0.5;
-        nv1 = Vector3d(nv1[0] + 1.0, nv1[1] + 1.0, nv1[2] + 1.0) * 0.5;
-        nv2 = Vector3d(nv2[0] + 1.0, nv2[1] + 1.0, nv2[2] + 1.0) * 0.5;
-
-        glShadeModel(GL_SMOOTH);
-
-        glBegin(GL_TRIANGLES);
-
-        glNormal3f(n[0], n[1], n[2]);
-        glColor3f(nv0[0], nv0[1], nv0[2]);
-        glVertex3f(v0[0], v0[1], v0[2]);
-        glColor3f(nv1[0], nv1[1], nv1[2]);
-        glVertex3f(v1[0], v1[1], v1[2]);
-        glColor3f(nv2[0], nv2[1], nv2[2]);
-        glVertex3f(v2[0], v2[1], v2[2]);
-
-        glEnd();
+      // Normals in view space, mapped to colors
+      glm::dmat4 Mnormal = glm::transpose(glm::inverse(Mview));
+      vector<float> colors(mesh.NumVertices() * 4);
+      for(int i=0;i<mesh.NumVertices();++i) {
+        Vector3d n0 = mesh.vertex_normal(i);
+        glm::dvec4 n = Mnormal * glm::dvec4(n0[0], n0[1], n0[2], 1);
+        Vector3d nv(n.x, n.y, n.z); nv.normalize();
+        for(int j=0;j<3;++j) colors[i*4+j] = (nv[j] + 1.0) * 0.5;
+        colors[i*4+3] = 1.0;
       }
+      buffers.SetColors(mesh, colors);
+
+      glShadeModel(GL_SMOOTH);
+      buffers.Draw(MeshBuffers::Position | MeshBuffers::CustomColor);
       //PhGUtils::message("done.");
       break;
     }
@@ -537,11 +467,12 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
 
       glEnable(GL_TEXTURE);
 
-      GLuint image_tex;
-      // generate texture
+      // The mesh texture, image_tex holds the background image and is only
+      // deleted at the end of Draw
+      GLuint mesh_tex = 0;
       glEnable(GL_TEXTURE_2D);
-      glGenTextures(1, &image_tex);
-      glBindTexture(GL_TEXTURE_2D, image_tex);
+      glGenTextures(1, &mesh_tex);
+      glBindTexture(GL_TEXTURE_2D, mesh_tex);
       // TODO need to address the RGBA/BGRA issue of the input texuture
       // HACK Changed to BGRA for blendshape_driver
       glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture.width(), texture.height(), 0, GL_BGRA,
@@ -551,35 +482,33 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
 
       glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
 
-      for(int face_i : faces_to_render) {
-        auto normal_i = mesh.normal(face_i);
-        auto f = mesh.face(face_i);
-        auto v0 = mesh.vertex(f[0]), v1 = mesh.vertex(f[1]), v2 = mesh.vertex(f[2]);
-
-        //auto n = mesh.normal(face_i);
-        auto n0 = mesh.vertex_normal(f[0]);
-        auto n1 = mesh.vertex_normal(f[1]);
-        auto n2 = mesh.vertex_normal(f[2]);
-
-        auto tf = mesh.face_texture(face_i);
-        auto t0 = mesh.texture_coords(tf[0]), t1 = mesh.texture_coords(tf[1]), t2 = mesh.texture_coords(tf[2]);
-
-        glShadeModel(GL_SMOOTH);
-
-        glBegin(GL_TRIANGLES);
-
-        glNormal3f(n0[0], n0[1], n0[2]);glTexCoord2f(t0[0], 1.0-t0[1]); glVertex3f(v0[0], v0[1], v0[2]);
-        glNormal3f(n1[0], n1[1], n1[2]);glTexCoord2f(t1[0], 1.0-t1[1]); glVertex3f(v1[0], v1[1], v1[2]);
-        glNormal3f(n2[0], n2[1], n2[2]);glTexCoord2f(t2[0], 1.0-t2[1]); glVertex3f(v2[0], v2[1], v2[2]);
-
-        glEnd();
-      }
+      glShadeModel(GL_SMOOTH);
+      buffers.Draw(MeshBuffers::Position | MeshBuffers::VertexNormal | MeshBuffers::TexCoord);
       if(lighting_enabled) DisableLighting();
+      glDeleteTextures(1, &mesh_tex);
       //PhGUtils::message("done.");
       break;
     }
   }
 
+  DisableLighting();
+
+  if(!image.isNull()) {
+    glDeleteTextures(1, &image_tex);
+    image_tex = 0;
+  }
+  glPopAttrib();
+}
+
+pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_sampled) const {
+  boost::timer::auto_cpu_timer t("render time = %w seconds.\n");
+
+  auto& context = OffscreenRenderContext::ForCurrentThread();
+  QOpenGLFramebufferObject& fbo = *context.Framebuffer(width, height, multi_sampled);
+  fbo.bind();
+
+  Draw(context);
+
   // get the depth buffer
   /*
   auto dump_buffer = [](const string filename, int w, int h, const char* ptr, size_t sz) {
@@ -599,7 +528,6 @@ pair<QImage, vector<float>> OffscreenMeshVisualizer::RenderWithDepth(bool multi_
   glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, &(depth_buffer[0]));
 
   //dump_buffer("depth.bin", width, height, (const char*)depth_buffer.data(), sizeof(float));
-  DisableLighting();
 
   // get the bitmap and save it as an image
   QImage img = fbo.toImage();
@@ -612,3 +540,141 @@ QImage OffscreenMeshVisualizer::Render(bool multi_sampled) const {
   auto res = RenderWithDepth(multi_sampled);
   return res.first;
 }
+
+OffscreenRenderQueue::OffscreenRenderQueue()
+  : surface(OffscreenRenderContext::CreateSurface()), stopped(false),
+    worker(&OffscreenRenderQueue::RenderLoop, this) {}
+
+OffscreenRenderQueue::~OffscreenRenderQueue() {
+  {
+    lock_guard<mutex> lock(mtx);
+    stopped = true;
+  }
+  cv.notify_all();
+  worker.join();
+}
+
+future<OffscreenRenderQueue::RenderResult> OffscreenRenderQueue::Submit(
+  OffscreenMeshVisualizer visualizer, bool multi_sampled) {
+  Job job;
+  job.visualizer = make_shared<OffscreenMeshVisualizer>(move(visualizer));
+  job.multi_sampled = multi_sampled;
+  future<RenderResult> result = job.result.get_future();
+  {
+    lock_guard<mutex> lock(mtx);
+    jobs.push_back(move(job));
+  }
+  cv.notify_one();
+  return result;
+}
+
+void OffscreenRenderQueue::RenderLoop() {
+  // Only the context is created on this thread, the surface comes from the
+  // thread that constructed the queue
+  auto& context = OffscreenRenderContext::ForCurrentThread(surface.get());
+  Readback readbacks[2];
+  int current = 0;
+
+  unique_lock<mutex> lock(mtx);
+  while(true) {
+    Readback& previous = readbacks[1 - current];
+    if(jobs.empty() && previous.pending) {
+      // Nothing to overlap the transfer with
+      lock.unlock();
+      FinishReadback(previous);
+      lock.lock();
+      continue;
+    }
+
+    cv.wait(lock, [this]{ return stopped || !jobs.empty(); });
+    if(jobs.empty()) break;
+
+    Job job = move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+
+    StartReadback(context, job, readbacks[current]);
+    if(previous.pending) FinishReadback(previous);
+    current = 1 - current;
+
+    lock.lock();
+  }
+  lock.unlock();
+
+  // The buffers belong to the context of this thread
+  for(auto& readback : readbacks) {
+    readback.color_buffer.destroy();
+    readback.depth_buffer.destroy();
+  }
+  OffscreenRenderContext::ReleaseCurrentThread();
+}
+
+void OffscreenRenderQueue::StartReadback(OffscreenRenderContext& context, Job& job,
+                                         Readback& readback) {
+  const OffscreenMeshVisualizer& visualizer = *job.visualizer;
+  const int width = visualizer.width, height = visualizer.height;
+
+  QOpenGLFramebufferObject* fbo = context.Framebuffer(width, height, job.multi_sampled);
+  fbo->bind();
+  visualizer.Draw(context);
+
+  // Multisampled framebuffers can not be read, resolve them first
+  if(job.multi_sampled) {
+    QOpenGLFramebufferObject* resolved = context.Framebuffer(width, height, false);
+    QOpenGLFramebufferObject::blitFramebuffer(resolved, fbo,
+                                              GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    fbo = resolved;
+    fbo->bind();
+  }
+
+  const int num_bytes = width * height * 4;
+  for(auto buffer : {&readback.color_buffer, &readback.depth_buffer}) {
+    if(!buffer->isCreated()) {
+      buffer->create();
+      buffer->setUsagePattern(QOpenGLBuffer::StreamRead);
+    }
+    buffer->bind();
+    if(buffer->size() != num_bytes) buffer->allocate(num_bytes);
+    buffer->release();
+  }
+
+  // Only queues the transfers, the buffers are mapped in FinishReadback
+  readback.color_buffer.bind();
+  glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+  readback.color_buffer.release();
+  readback.depth_buffer.bind();
+  glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+  readback.depth_buffer.release();
+
+  fbo->release();
+
+  readback.width = width;
+  readback.height = height;
+  readback.result = move(job.result);
+  readback.pending = true;
+}
+
+void OffscreenRenderQueue::FinishReadback(Readback& readback) {
+  const int width = readback.width, height = readback.height;
+
+  // Same format as QOpenGLFramebufferObject::toImage, GL rows start at the
+  // bottom
+  QImage img(width, height, QImage::Format_ARGB32_Premultiplied);
+  readback.color_buffer.bind();
+  auto color = static_cast<const unsigned char*>(readback.color_buffer.map(QOpenGLBuffer::ReadOnly));
+  for(int y=0;y<height;++y) {
+    memcpy(img.scanLine(height - 1 - y), color + y * width * 4, width * 4);
+  }
+  readback.color_buffer.unmap();
+  readback.color_buffer.release();
+
+  vector<float> depth(width * height);
+  readback.depth_buffer.bind();
+  auto depth_data = static_cast<const float*>(readback.depth_buffer.map(QOpenGLBuffer::ReadOnly));
+  copy(depth_data, depth_data + width * height, depth.begin());
+  readback.depth_buffer.unmap();
+  readback.depth_buffer.release();
+
+  readback.pending = false;
+  readback.result.set_value(make_pair(img, depth));
+}
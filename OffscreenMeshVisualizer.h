@@ -5,6 +5,7 @@
 //#include "Utils/utility.hpp"
 
 #include "basicmesh.h"
+#include "meshbuffers.h"
 #include "parameters.h"
 
 #include <QDir>
@@ -17,6 +18,15 @@
 #include "nlohmann/json.hpp"
 using json = nlohmann::json;
 
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
 namespace ColorEncoding {
   inline void encode_index(int idx, unsigned char& r, unsigned char& g, unsigned char& b) {
     r = static_cast<unsigned char>(idx & 0xff); idx >>= 8;
@@ -30,6 +40,52 @@ namespace ColorEncoding {
   }
 }
 
+// OpenGL context of the calling thread for offscreen rendering, created on
+// first use and kept for the lifetime of the thread, together with a few
+// framebuffer objects reused for renders of the same size and the vertex
+// buffers of the last mesh. Creating a context and an FBO costs far more than
+// drawing a mesh, so repeated renders only pay for the draw and the readback.
+class OffscreenRenderContext {
+public:
+  // Context of the calling thread, made current. The context is created on
+  // the calling thread, but Qt requires an offscreen surface to be created
+  // and destroyed on the GUI thread on some platforms. Worker threads pass a
+  // surface from CreateSurface, which must outlive the context. Without one
+  // the context creates its own surface on the calling thread.
+  static OffscreenRenderContext& ForCurrentThread(QOffscreenSurface* surface = nullptr);
+
+  // Surface in the format of the contexts, call on the GUI thread
+  static unique_ptr<QOffscreenSurface> CreateSurface();
+
+  // Destroys the context of the calling thread, if any. Contexts that are
+  // never released are left to the OS at exit: a context must not be
+  // destroyed from another thread or after the application object is gone.
+  static void ReleaseCurrentThread();
+
+  // Framebuffer with a depth attachment, reused for the same size and sample
+  // count
+  QOpenGLFramebufferObject* Framebuffer(int width, int height, bool multi_sampled);
+
+  // Buffers of the last rendered mesh, only the geometry is uploaded again if
+  // the next mesh has the same faces
+  MeshBuffers& Buffers() { return mesh_buffers; }
+
+private:
+  explicit OffscreenRenderContext(QOffscreenSurface* shared_surface);
+
+  static const int kMaxFramebuffers = 4;
+
+  // Only set if the context created its own surface
+  unique_ptr<QOffscreenSurface> own_surface;
+  QOffscreenSurface* surface;
+  QOpenGLContext context;
+
+  // Most recently used first
+  list<pair<tuple<int, int, int>, unique_ptr<QOpenGLFramebufferObject>>> framebuffers;
+
+  MeshBuffers mesh_buffers;
+};
+
 class OffscreenMeshVisualizer {
 public:
   enum MVPMode {
@@ -47,20 +103,15 @@ public:
     TexturedMesh
   };
   OffscreenMeshVisualizer(int width, int height)
-   : width(width), height(height), index_encoded(true), lighting_enabled(false) {
+   : width(width), height(height), index_encoded(true), lighting_enabled(false),
+     image_tex(0) {
     // Load rendering settings
-    {
-      const string home_directory = QDir::homePath().toStdString();
-      cout << "Home dir: " << home_directory << endl;
-
-      ifstream fin(home_directory + "/Data/Settings/blendshape_vis_ao.json");
-      fin >> rendering_settings;
-    }
+    const string home_directory = QDir::homePath().toStdString();
+    rendering_settings = LoadSettings(home_directory + "/Data/Settings/blendshape_vis_ao.json");
   }
 
   void LoadRenderingSettings(const string& filename) {
-    ifstream fin(filename);
-    fin >> rendering_settings;
+    rendering_settings = LoadSettings(filename);
   }
 
   void BindMesh(const BasicMesh& in_mesh) {
@@ -106,6 +157,14 @@ public:
   pair<QImage, vector<float>> RenderWithDepth(bool multi_sampled=false) const;
 
 protected:
+  friend class OffscreenRenderQueue;
+
+  // Parsed once per file and shared by all visualizers
+  static shared_ptr<const json> LoadSettings(const string& filename);
+
+  // Draws into the bound framebuffer of the context
+  void Draw(OffscreenRenderContext& context) const;
+
   void SetupViewing(const MVPMode&) const;
   void CreateTexture() const;
   void EnableLighting() const;
@@ -131,9 +190,66 @@ private:
   QImage texture;
   mutable glm::dmat4 Mview;
 
-  json rendering_settings;
+  shared_ptr<const json> rendering_settings;
   mutable vector<GLuint> enabled_lights;
 };
 
+// Renders on a thread of its own and reads the results back through two
+// alternating pairs of pixel buffer objects. The readback of a view is only
+// mapped after the next view has been submitted to the GPU, so the transfer
+// overlaps the next draw instead of stalling on it, and the caller processes
+// finished views while the queue renders the following ones.
+//
+// The results are the same as RenderWithDepth. Views are rendered in the
+// order they are submitted, pending views are still rendered on destruction.
+// Construct and destroy the queue on the GUI thread: it owns the surface the
+// worker renders to, only the context lives on the worker thread.
+class OffscreenRenderQueue {
+public:
+  typedef pair<QImage, vector<float>> RenderResult;
+
+  OffscreenRenderQueue();
+  ~OffscreenRenderQueue();
+
+  OffscreenRenderQueue(const OffscreenRenderQueue&) = delete;
+  OffscreenRenderQueue& operator=(const OffscreenRenderQueue&) = delete;
+
+  // The queue keeps its own copy of the visualizer, move it in to avoid
+  // copying the mesh
+  future<RenderResult> Submit(OffscreenMeshVisualizer visualizer,
+                              bool multi_sampled=false);
+
+private:
+  struct Job {
+    shared_ptr<OffscreenMeshVisualizer> visualizer;
+    bool multi_sampled;
+    promise<RenderResult> result;
+  };
+
+  struct Readback {
+    Readback() : color_buffer(QOpenGLBuffer::PixelPackBuffer),
+                 depth_buffer(QOpenGLBuffer::PixelPackBuffer),
+                 width(0), height(0), pending(false) {}
+
+    QOpenGLBuffer color_buffer, depth_buffer;
+    int width, height;
+    bool pending;
+    promise<RenderResult> result;
+  };
+
+  void RenderLoop();
+  void StartReadback(OffscreenRenderContext& context, Job& job, Readback& readback);
+  void FinishReadback(Readback& readback);
+
+  // Created before the worker starts and destroyed after it is joined
+  unique_ptr<QOffscreenSurface> surface;
+
+  deque<Job> jobs;
+  bool stopped;
+  mutex mtx;
+  condition_variable cv;
+  thread worker;
+};
+
 
 #endif //FACESHAPEFROMSHADING_OFFSCREENMESHVISUALIZER_H
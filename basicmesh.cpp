@@ -1,8 +1,14 @@
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <mutex>
+#include <numeric>
 #include "omp.h"
 #include "basicmesh.h"
-#include "Geometry/MeshLoader.h"
+#include "subdivisionoperator.h"
 
+#include "boost/filesystem/operations.hpp"
+#include <sys/stat.h>
 #include "boost/timer/timer.hpp"
 
 /// @brief Load a mesh from an OBJ file
@@ -14,102 +20,331 @@ BasicMesh::BasicMesh(const string &filename)
   ComputeNormals();
 }
 
+namespace {
+  // Layout of a .bmesh file: the header, then the vertices, the texture
+  // coordinates, the faces and the texture faces, each in the column major
+  // order of the Eigen matrices. Every array starts at a fixed offset, so the
+  // file can be read or mapped straight into the matrices.
+  struct BinaryMeshHeader {
+    char magic[4];
+    int32_t version;
+    int64_t source_size, source_mtime;   // mtime in nanoseconds
+    int32_t num_verts, num_texcoords, num_faces, reserved;
+  };
+  const char kBinaryMeshMagic[4] = {'B', 'M', 'S', 'H'};
+  const int32_t kBinaryMeshVersion = 2;
+
+  // Parsing helpers, none of them reads past the end of the line
+  inline const char* SkipBlanks(const char* p, const char* end) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) ++p;
+    return p;
+  }
+
+  inline const char* SkipToken(const char* p, const char* end) {
+    while(p < end && *p != ' ' && *p != '\t' && *p != '\r') ++p;
+    return p;
+  }
+
+  inline bool ParseDouble(const char*& p, const char* end, double& val) {
+    p = SkipBlanks(p, end);
+    if(p == end) return false;
+    char* next;
+    val = strtod(p, &next);
+    if(next == p || next > end) return false;
+    p = next;
+    return true;
+  }
+
+  // Resolves a 1-based or a negative relative OBJ index to a 0-based one
+  inline int ResolveIndex(long idx, int count) {
+    return idx > 0 ? idx - 1 : count + idx;
+  }
+}
+
 bool BasicMesh::LoadOBJMesh(const string& filename) {
   cout << "loading " << filename << endl;
-  PhGUtils::OBJLoader loader;
-  if(!loader.load(filename)) {
+
+  // The cache key, the modification time with nanosecond resolution catches
+  // edits within the same second
+  struct stat source_stat;
+  if(stat(filename.c_str(), &source_stat) != 0) {
     cerr << "Failed to load mesh file " << filename << endl;
     return false;
   }
+  const int64_t source_size = source_stat.st_size;
+  const int64_t source_mtime = static_cast<int64_t>(source_stat.st_mtim.tv_sec) * 1000000000 +
+                               source_stat.st_mtim.tv_nsec;
 
-  // initialize the basic mesh
-  auto V = loader.getVerts();
+  vert_face_map.clear();
+  vert_face_offsets.clear();
 
-  int nverts = V.size();
-  verts.resize(nverts, 3);
-  for (int i = 0; i < nverts; ++i) {
-    verts(i, 0) = V[i].x;
-    verts(i, 1) = V[i].y;
-    verts(i, 2) = V[i].z;
+  const string binary_filename = filename + ".bmesh";
+  if(!LoadBinaryMesh(binary_filename, source_size, source_mtime)) {
+    if(!ParseOBJ(filename)) {
+      cerr << "Failed to load mesh file " << filename << endl;
+      return false;
+    }
+    WriteBinaryMesh(binary_filename, source_size, source_mtime);
   }
 
-  auto T = loader.getTexcoords();
-  bool has_texcoords = T.size() > 0;
-  texcoords.resize(T.size(), 2);
-  for(int i=0;i<T.size();++i) {
-    texcoords(i, 0) = T[i].x;
-    texcoords(i, 1) = T[i].y;
+  cout << filename << " loaded." << endl;
+  cout << NumFaces() << " faces." << endl;
+  cout << NumVertices() << " vertices." << endl;
+  return true;
+}
+
+bool BasicMesh::ParseOBJ(const string& filename) {
+  string content;
+  {
+    ifstream fin(filename, ios::binary);
+    if(!fin) return false;
+    fin.seekg(0, ios::end);
+    content.resize(fin.tellg());
+    fin.seekg(0, ios::beg);
+    fin.read(&content[0], content.size());
+    if(!fin) return false;
   }
 
-  int nfaces = 0;
-  auto F = loader.getFaces();
-  for (int i = 0; i < F.size(); ++i) {
-    nfaces += F[i].v.size()-2;
+  // Split the file into chunks of whole lines, one per thread
+  const char* data = content.data();
+  const size_t size = content.size();
+  const int num_chunks = max(1, min(omp_get_max_threads(), static_cast<int>(size / 65536) + 1));
+  vector<size_t> chunk_begin(num_chunks + 1, size);
+  chunk_begin[0] = 0;
+  for(int k=1;k<num_chunks;++k) {
+    const char* p = static_cast<const char*>(memchr(data + size * k / num_chunks, '\n',
+                                                    size - size * k / num_chunks));
+    chunk_begin[k] = p ? max(chunk_begin[k-1], static_cast<size_t>(p - data) + 1) : size;
   }
 
-  faces.resize(nfaces, 3);
-  face_tex_index.resize(nfaces, 3);
-  vert_face_map.clear();
-  // triangulate the mesh
-  for (int i = 0, faceidx = 0; i < F.size(); ++i) {
-    for (int j = 1; j < F[i].v.size()-1; ++j, ++faceidx) {
-      faces.row(faceidx) = Vector3i(F[i].v[0], F[i].v[j], F[i].v[j+1]);
-      if(has_texcoords) {
-        face_tex_index.row(faceidx) = Vector3i(F[i].t[0], F[i].t[j], F[i].t[j+1]);
+  // Calls f(type, begin, end) for every v, vt and f line of chunk k
+  auto for_each_line = [&](int k, function<void(char, const char*, const char*)> f) {
+    const char* p = data + chunk_begin[k];
+    const char* chunk_end = data + chunk_begin[k+1];
+    while(p < chunk_end) {
+      const char* line_end = static_cast<const char*>(memchr(p, '\n', chunk_end - p));
+      if(!line_end) line_end = chunk_end;
+      const char* q = SkipBlanks(p, line_end);
+      if(line_end - q > 1 && q[0] == 'v' && (q[1] == ' ' || q[1] == '\t')) {
+        f('v', q + 2, line_end);
+      } else if(line_end - q > 2 && q[0] == 'v' && q[1] == 't' && (q[2] == ' ' || q[2] == '\t')) {
+        f('t', q + 3, line_end);
+      } else if(line_end - q > 1 && q[0] == 'f' && (q[1] == ' ' || q[1] == '\t')) {
+        f('f', q + 2, line_end);
       }
+      p = line_end + 1;
     }
+  };
+
+  // First pass counts the elements of every chunk, so that the second pass
+  // can write them in place and resolve relative indices
+  vector<int> num_verts(num_chunks + 1, 0), num_texcoords(num_chunks + 1, 0);
+  vector<int> num_faces(num_chunks + 1, 0);
+  #pragma omp parallel for num_threads(num_chunks)
+  for(int k=0;k<num_chunks;++k) {
+    for_each_line(k, [&](char type, const char* p, const char* end) {
+      if(type == 'v') ++num_verts[k+1];
+      else if(type == 't') ++num_texcoords[k+1];
+      else {
+        int num_corners = 0;
+        for(p = SkipBlanks(p, end); p < end; p = SkipBlanks(SkipToken(p, end), end)) ++num_corners;
+        num_faces[k+1] += max(0, num_corners - 2);
+      }
+    });
+  }
+  partial_sum(num_verts.begin(), num_verts.end(), num_verts.begin());
+  partial_sum(num_texcoords.begin(), num_texcoords.end(), num_texcoords.begin());
+  partial_sum(num_faces.begin(), num_faces.end(), num_faces.begin());
+
+  const bool has_texcoords = num_texcoords[num_chunks] > 0;
+  verts.resize(num_verts[num_chunks], 3);
+  texcoords.resize(num_texcoords[num_chunks], 2);
+  faces.resize(num_faces[num_chunks], 3);
+  face_tex_index.setZero(num_faces[num_chunks], 3);
+
+  vector<char> chunk_valid(num_chunks, 1);
+  #pragma omp parallel for num_threads(num_chunks)
+  for(int k=0;k<num_chunks;++k) {
+    int vi = num_verts[k], ti = num_texcoords[k], fi = num_faces[k];
+    vector<int> v, t;
+    for_each_line(k, [&](char type, const char* p, const char* end) {
+      if(type == 'v') {
+        for(int j=0;j<3;++j) {
+          double val = 0;
+          if(!ParseDouble(p, end, val)) chunk_valid[k] = 0;
+          verts(vi, j) = val;
+        }
+        ++vi;
+      } else if(type == 't') {
+        for(int j=0;j<2;++j) {
+          double val = 0;
+          if(!ParseDouble(p, end, val)) chunk_valid[k] = 0;
+          texcoords(ti, j) = val;
+        }
+        ++ti;
+      } else {
+        // Corners are v, v/vt, v//vn or v/vt/vn
+        v.clear();
+        t.clear();
+        for(p = SkipBlanks(p, end); p < end; p = SkipBlanks(SkipToken(p, end), end)) {
+          char* next;
+          v.push_back(ResolveIndex(strtol(p, &next, 10), vi));
+          t.push_back(0);
+          if(next < end && *next == '/' && next + 1 < end && next[1] != '/') {
+            t.back() = ResolveIndex(strtol(next + 1, &next, 10), ti);
+          }
+        }
+        for(size_t j=1;j+1<v.size();++j, ++fi) {
+          faces.row(fi) = Vector3i(v[0], v[j], v[j+1]);
+          if(has_texcoords) face_tex_index.row(fi) = Vector3i(t[0], t[j], t[j+1]);
+        }
+      }
+    });
   }
 
-  cout << filename << " loaded." << endl;
-  cout << nfaces << " faces." << endl;
-  cout << nverts << " vertices." << endl;
+  if(find(chunk_valid.begin(), chunk_valid.end(), 0) != chunk_valid.end()) return false;
+  return HasValidIndices();
+}
+
+bool BasicMesh::HasValidIndices() const {
+  if(NumFaces() == 0) return true;
+  if(faces.minCoeff() < 0 || faces.maxCoeff() >= NumVertices()) return false;
+  return NumTextureCoords() == 0 ||
+         (face_tex_index.minCoeff() >= 0 && face_tex_index.maxCoeff() < NumTextureCoords());
+}
+
+bool BasicMesh::LoadBinaryMesh(const string& filename, int64_t source_size, int64_t source_mtime) {
+  ifstream fin(filename, ios::binary);
+  if(!fin) return false;
+
+  BinaryMeshHeader header;
+  fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if(!fin || memcmp(header.magic, kBinaryMeshMagic, 4) != 0 ||
+     header.version != kBinaryMeshVersion ||
+     header.source_size != source_size || header.source_mtime != source_mtime) {
+    return false;
+  }
+
+  // The counts must account for the whole file before anything is allocated
+  fin.seekg(0, ios::end);
+  const int64_t file_size = fin.tellg();
+  fin.seekg(sizeof(header), ios::beg);
+  const int64_t num_doubles = static_cast<int64_t>(header.num_verts) * 3 +
+                              static_cast<int64_t>(header.num_texcoords) * 2;
+  const int64_t num_ints = static_cast<int64_t>(header.num_faces) * 6;
+  const int64_t expected_size = static_cast<int64_t>(sizeof(header)) +
+                                num_doubles * static_cast<int64_t>(sizeof(double)) +
+                                num_ints * static_cast<int64_t>(sizeof(int));
+  if(header.num_verts < 0 || header.num_texcoords < 0 || header.num_faces < 0 ||
+     expected_size != file_size) {
+    cerr << "Corrupt binary mesh " << filename << ", parsing the OBJ file again." << endl;
+    return false;
+  }
+
+  verts.resize(header.num_verts, 3);
+  texcoords.resize(header.num_texcoords, 2);
+  faces.resize(header.num_faces, 3);
+  face_tex_index.resize(header.num_faces, 3);
+  fin.read(reinterpret_cast<char*>(verts.data()), verts.size() * sizeof(double));
+  fin.read(reinterpret_cast<char*>(texcoords.data()), texcoords.size() * sizeof(double));
+  fin.read(reinterpret_cast<char*>(faces.data()), faces.size() * sizeof(int));
+  fin.read(reinterpret_cast<char*>(face_tex_index.data()), face_tex_index.size() * sizeof(int));
+  if(!fin || !HasValidIndices()) {
+    cerr << "Corrupt binary mesh " << filename << ", parsing the OBJ file again." << endl;
+    return false;
+  }
   return true;
 }
 
-void BasicMesh::ComputeNormals() {
-  boost::timer::auto_cpu_timer timer("[BasicMesh] Normals computation time = %w seconds.\n");
+void BasicMesh::WriteBinaryMesh(const string& filename, int64_t source_size, int64_t source_mtime) const {
+  namespace fs = boost::filesystem;
+
+  BinaryMeshHeader header;
+  memcpy(header.magic, kBinaryMeshMagic, 4);
+  header.version = kBinaryMeshVersion;
+  header.source_size = source_size;
+  header.source_mtime = source_mtime;
+  header.num_verts = NumVertices();
+  header.num_texcoords = NumTextureCoords();
+  header.num_faces = NumFaces();
+  header.reserved = 0;
+
+  // Written under a unique name and renamed, so concurrent loads of the same
+  // mesh never see a partial file
+  boost::system::error_code ec;
+  const fs::path tmp_path = fs::unique_path(filename + ".%%%%-%%%%.tmp", ec);
+  if(ec) return;
+  {
+    ofstream fout(tmp_path.string(), ios::binary);
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fout.write(reinterpret_cast<const char*>(verts.data()), verts.size() * sizeof(double));
+    fout.write(reinterpret_cast<const char*>(texcoords.data()), texcoords.size() * sizeof(double));
+    fout.write(reinterpret_cast<const char*>(faces.data()), faces.size() * sizeof(int));
+    fout.write(reinterpret_cast<const char*>(face_tex_index.data()), face_tex_index.size() * sizeof(int));
+    if(!fout) {
+      cerr << "Failed to write binary mesh " << filename << endl;
+      fout.close();
+      fs::remove(tmp_path, ec);
+      return;
+    }
+  }
+  fs::rename(tmp_path, filename, ec);
+  if(ec) fs::remove(tmp_path, ec);
+}
 
-  norms.resize(faces.rows(), 3);
-  vertex_norms.resize(verts.size(), 3);
-  vertex_norms.setZero();
-  vector<double> area_sum(verts.size(), 0.0);
+void BasicMesh::BuildVertexFaceAdjacency() {
+  const int num_verts = NumVertices(), num_faces = NumFaces();
 
-  omp_lock_t writelock;
+  // Counting sort of the face corners by vertex, the faces of a vertex end up
+  // in ascending order
+  vert_face_offsets.assign(num_verts + 1, 0);
+  for(int i=0;i<num_faces;++i) {
+    for(int j=0;j<3;++j) ++vert_face_offsets[faces(i, j) + 1];
+  }
+  partial_sum(vert_face_offsets.begin(), vert_face_offsets.end(), vert_face_offsets.begin());
 
-  omp_init_lock(&writelock);
+  vert_face_indices.resize(num_faces * 3);
+  vector<int> next(vert_face_offsets.begin(), vert_face_offsets.end() - 1);
+  for(int i=0;i<num_faces;++i) {
+    for(int j=0;j<3;++j) vert_face_indices[next[faces(i, j)]++] = i;
+  }
+}
+
+void BasicMesh::ComputeNormals() {
+  const int num_verts = NumVertices(), num_faces = NumFaces();
+  if(static_cast<int>(vert_face_offsets.size()) != num_verts + 1) BuildVertexFaceAdjacency();
+
+  // The cross product of the edges has twice the face area as its length
+  Matrix<double, Dynamic, 3, RowMajor> face_norms(num_faces, 3);
+  vector<double> face_areas(num_faces);
+  norms.resize(num_faces, 3);
 #pragma omp parallel for
-  for(int i=0;i<faces.rows();++i) {
-    auto vidx0 = faces(i, 0);
-    auto vidx1 = faces(i, 1);
-    auto vidx2 = faces(i, 2);
-
-    auto v0 = Vector3d(verts.row(vidx0));
-    auto v1 = Vector3d(verts.row(vidx1));
-    auto v2 = Vector3d(verts.row(vidx2));
-
-    auto v0v1 = v1 - v0;
-    auto v0v2 = v2 - v0;
-    auto n = v0v1.cross(v0v2);
-    double area = n.norm();
-
-    omp_set_lock(&writelock);
-    vertex_norms.row(vidx0) += n;
-    vertex_norms.row(vidx1) += n;
-    vertex_norms.row(vidx2) += n;
-
-    area_sum[vidx0] += area;
-    area_sum[vidx1] += area;
-    area_sum[vidx2] += area;
-    omp_unset_lock(&writelock);
+  for(int i=0;i<num_faces;++i) {
+    Vector3d v0 = verts.row(faces(i, 0));
+    Vector3d v1 = verts.row(faces(i, 1));
+    Vector3d v2 = verts.row(faces(i, 2));
+
+    Vector3d n = (v1 - v0).cross(v2 - v0);
+    face_norms.row(i) = n;
+    face_areas[i] = n.norm();
 
     n.normalize();
     norms.row(i) = n;
   }
-  omp_destroy_lock(&writelock);
 
+  // Area weighted average of the incident face normals, gathered per vertex
+  // so that no two threads write the same row
+  vertex_norms.resize(num_verts, 3);
 #pragma omp parallel for
-  for(int i=0;i<vertex_norms.rows();++i) {
-    vertex_norms.row(i) /= area_sum[i];
+  for(int i=0;i<num_verts;++i) {
+    Vector3d n = Vector3d::Zero();
+    double area_sum = 0.0;
+    for(int k=vert_face_offsets[i];k<vert_face_offsets[i+1];++k) {
+      const int face_i = vert_face_indices[k];
+      n += face_norms.row(face_i).transpose();
+      area_sum += face_areas[face_i];
+    }
+    vertex_norms.row(i) = n / area_sum;
   }
 }
 
@@ -180,207 +415,9 @@ void BasicMesh::Subdivide() {
   //   [old vertices]
   //   [new vertices]
   //   [faces]
-
-  // For each edge, compute its center point
-  struct edge_t {
-    edge_t() {}
-    edge_t(int s, int t) : s(s), t(t) {}
-    edge_t(const edge_t& e) : s(e.s), t(e.t) {}
-    bool operator<(const edge_t& other) const {
-      if(s < other.s) return true;
-      else if( s > other.s ) return false;
-      else return t < other.t;
-    }
-    int s, t;
-  };
-
-  struct face_edge_t {
-    face_edge_t() {}
-    face_edge_t(int fidx, edge_t e) : fidx(fidx), e(e) {}
-    bool operator<(const face_edge_t& other) const {
-      if(fidx < other.fidx) return true;
-      else if(fidx > other.fidx) return false;
-      return e < other.e;
-    }
-    int fidx;
-    edge_t e;
-  };
-
-  const int num_faces = NumFaces();
-
-  map<edge_t, Vector3d> midpoints;
-
-  // iterate over all edges
-  for (HalfEdgeMesh::EdgeIter e=hemesh.edges_begin(); e!=hemesh.edges_end(); ++e) {
-    auto heh = hemesh.halfedge_handle(e, 0);
-    auto hefh = hemesh.halfedge_handle(e, 1);
-
-    auto v0h = hemesh.to_vertex_handle(heh);
-    auto v1h = hemesh.to_vertex_handle(hefh);
-
-    int v0idx = vhandles_map[v0h];
-    int v1idx = vhandles_map[v1h];
-
-    auto v0 = verts.row(v0idx);
-    auto v1 = verts.row(v1idx);
-
-    if(hemesh.is_boundary(*e)) {
-      // simply compute the mid point
-      midpoints.insert(make_pair(edge_t(v0idx, v1idx),
-                                 0.5 * (v0 + v1)));
-    } else {
-      // use [1/8, 3/8, 3/8, 1/8] weights
-      auto v2h = hemesh.to_vertex_handle(hemesh.next_halfedge_handle(heh));
-      auto v3h = hemesh.to_vertex_handle(hemesh.next_halfedge_handle(hefh));
-
-      int v2idx = vhandles_map[v2h];
-      int v3idx = vhandles_map[v3h];
-
-      auto v2 = verts.row(v2idx);
-      auto v3 = verts.row(v3idx);
-
-      midpoints.insert(make_pair(edge_t(v0idx, v1idx), (v0 * 3 + v1 * 3 + v2 + v3) / 8.0));
-    }
-  }
-
-  // Now create a new set of vertices and faces
-  const int num_verts = NumVertices() + midpoints.size();
-  MatrixX3d new_verts(num_verts, 3);
-
-  // Smooth these points
-  for(int i=0;i<NumVertices();++i) {
-    auto vh = vhandles[i];
-    if(hemesh.is_boundary(vh)) {
-      // use [1/8, 6/8, 1/8] weights
-      auto heh = hemesh.halfedge_handle(vh);
-      if(heh.is_valid()) {
-        assert(hemesh.is_boundary(hemesh.edge_handle(heh)));
-
-        auto prev_heh = hemesh.prev_halfedge_handle(heh);
-
-        auto to_vh = hemesh.to_vertex_handle(heh);
-        auto from_vh = hemesh.from_vertex_handle(prev_heh);
-
-        Vector3d p = 6 * verts.row(i);
-        p += verts.row(vhandles_map[to_vh]);
-        p += verts.row(vhandles_map[from_vh]);
-        p /= 8.0;
-        new_verts.row(i) = p;
-      }
-    } else {
-      // loop through the neighbors and count them
-      int valence = 0;
-      Vector3d p(0, 0, 0);
-      for(auto vvit = hemesh.vv_iter(vh); vvit.is_valid(); ++vvit) {
-        ++valence;
-        p += verts.row(vhandles_map[*vvit]);
-      }
-      const double PI = 3.1415926535897;
-      const double wa = (0.375 + 0.25 * cos(2.0 * PI / valence));
-      const double w = (0.625 - wa * wa);
-      p *= (w / valence);
-      p += verts.row(i) * (1 - w);
-      new_verts.row(i) = p;
-    }
-  }
-
-  // Add the midpoints
-  map<edge_t, int> midpoints_indices;
-  int new_idx = NumVertices();
-  for(auto p : midpoints) {
-    midpoints_indices.insert(make_pair(p.first, new_idx));
-    midpoints_indices.insert(make_pair(edge_t(p.first.t, p.first.s), new_idx));
-
-    new_verts.row(new_idx) = p.second;
-    ++new_idx;
-  }
-
-  // Process the texture coordinates
-  map<face_edge_t, Vector2d> midpoints_texcoords;
-
-  for(int fidx=0;fidx<NumFaces();++fidx){
-    int j[] = {1, 2, 0};
-    for(int i=0;i<3;++i) {
-      int v0idx = faces(fidx, i);
-      int v1idx = faces(fidx, j[i]);
-
-      // if v0 = f[index_of(v0)], the tv0 = tf[index_of(v0)]
-      int tv0idx = face_tex_index(fidx, i);
-      // if v1 = f[index_of(v1)], the tv1 = tf[index_of(v1)]
-      int tv1idx = face_tex_index(fidx, j[i]);
-
-      auto t0 = texcoords.row(tv0idx);
-      auto t1 = texcoords.row(tv1idx);
-
-      // the texture coordinates is always the mid point
-      midpoints_texcoords.insert(make_pair(face_edge_t(fidx, edge_t(v0idx, v1idx)),
-                                           0.5 * (t0 + t1)));
-    }
-  }
-
-  const int num_texcoords = texcoords.rows() + midpoints_texcoords.size();
-  MatrixX2d new_texcoords(num_texcoords, 2);
-
-  // Just copy the existing texture coordinates
-  new_texcoords.topRows(texcoords.rows()) = texcoords;
-
-  // Tex-coords for the mid points
-  map<face_edge_t, int> midpoints_texcoords_indices;
-  int new_texcoords_idx = texcoords.rows();
-  for(auto p : midpoints_texcoords) {
-    //cout << p.first.fidx << ": " << p.first.e.s << "->" << p.first.e.t << endl;
-    //getchar();
-    midpoints_texcoords_indices.insert(make_pair(p.first,
-                                                 new_texcoords_idx));
-    midpoints_texcoords_indices.insert(make_pair(face_edge_t(p.first.fidx, edge_t(p.first.e.t, p.first.e.s)),
-                                                 new_texcoords_idx));
-
-    new_texcoords.row(new_texcoords_idx) = p.second;
-    ++new_texcoords_idx;
-  }
-
-  MatrixX3i new_faces(num_faces*4, 3);
-  MatrixX3i new_face_tex_index(num_faces*4, 3);
-  for(int i=0;i<num_faces;++i) {
-    // vertex indices of the original triangle
-    auto vidx0 = faces(i, 0);
-    auto vidx1 = faces(i, 1);
-    auto vidx2 = faces(i, 2);
-
-    // texture coordinates indices of the original triangle
-    auto tvidx0 = face_tex_index(i, 0);
-    auto tvidx1 = face_tex_index(i, 1);
-    auto tvidx2 = face_tex_index(i, 2);
-
-    // indices of the mid points
-    int nvidx01 = midpoints_indices[edge_t(vidx0, vidx1)];
-    int nvidx12 = midpoints_indices[edge_t(vidx1, vidx2)];
-    int nvidx20 = midpoints_indices[edge_t(vidx2, vidx0)];
-
-    // indices of the texture coordinates of the mid points
-    int tnvidx01 = midpoints_texcoords_indices.at(face_edge_t(i, edge_t(vidx0, vidx1)));
-    int tnvidx12 = midpoints_texcoords_indices.at(face_edge_t(i, edge_t(vidx1, vidx2)));
-    int tnvidx20 = midpoints_texcoords_indices.at(face_edge_t(i, edge_t(vidx2, vidx0)));
-
-    // add the 4 new faces
-    new_faces.row(i*4+0) = Vector3i(vidx0, nvidx01, nvidx20);
-    new_faces.row(i*4+1) = Vector3i(nvidx20, nvidx01, nvidx12);
-    new_faces.row(i*4+2) = Vector3i(nvidx20, nvidx12, vidx2);
-    new_faces.row(i*4+3) = Vector3i(nvidx01, vidx1, nvidx12);
-
-    new_face_tex_index.row(i*4+0) = Vector3i(tvidx0, tnvidx01, tnvidx20);
-    new_face_tex_index.row(i*4+1) = Vector3i(tnvidx20, tnvidx01, tnvidx12);
-    new_face_tex_index.row(i*4+2) = Vector3i(tnvidx20, tnvidx12, tvidx2);
-    new_face_tex_index.row(i*4+3) = Vector3i(tnvidx01, tvidx1, tnvidx12);
-  }
-
-  verts = new_verts;
-  faces = new_faces;
-  texcoords = new_texcoords;
-  face_tex_index = new_face_tex_index;
-
-  // Update the normals after subdivision
-  ComputeNormals();
+  // Face i is replaced by faces 4i to 4i+3. The operator is built once per
+  // topology, see SubdivisionOperator::BuildLevel.
+  SubdivisionOperator::ForMesh(*this)->Apply(*this);
 }
 
 void BasicMesh::Write(const string &filename) const {
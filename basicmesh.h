@@ -22,6 +22,8 @@ using namespace Eigen;
 class BasicMesh
 {
 public:
+  friend class SubdivisionOperator;
+
   BasicMesh() {}
   BasicMesh(const string& filename);
 
@@ -56,6 +58,7 @@ public:
 
   int NumVertices() const { return static_cast<int>(verts.rows()); }
   int NumFaces() const { return static_cast<int>(faces.rows()); }
+  int NumTextureCoords() const { return static_cast<int>(texcoords.rows()); }
 
   bool LoadOBJMesh(const string &filename);
   void ComputeNormals();
@@ -164,7 +167,26 @@ public:
   void BuildHalfEdgeMesh();
 
 private:
+  // Parses the OBJ file in parallel, polygons are triangulated as fans
+  bool ParseOBJ(const string& filename);
+
+  // All face and texture face indices are in range
+  bool HasValidIndices() const;
+
+  // Binary copy of a parsed OBJ file, valid as long as the size and the
+  // modification time (in nanoseconds) of the OBJ file match the ones it was
+  // written for. Counts that do not match the file size or indices out of
+  // range reject the copy.
+  bool LoadBinaryMesh(const string& filename, int64_t source_size, int64_t source_mtime);
+  void WriteBinaryMesh(const string& filename, int64_t source_size, int64_t source_mtime) const;
+
+  // Faces incident to every vertex in CSR layout, the faces of vertex i are
+  // vert_face_indices[vert_face_offsets[i]] to [vert_face_offsets[i+1] - 1].
+  // Rebuilt by ComputeNormals when cleared.
+  void BuildVertexFaceAdjacency();
+
   unordered_map<int, int> vert_face_map;
+  vector<int> vert_face_offsets, vert_face_indices;
 
   MatrixX3d verts;
   MatrixX3i faces, face_tex_index;
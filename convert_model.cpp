@@ -0,0 +1,72 @@
+#include <QDir>
+
+#include "multilinearmodel.h"
+#include "modelcontainer.hpp"
+
+#include "boost/program_options.hpp"
+
+// Packs the legacy core tensor, U matrices and prior files into one
+// ModelContainer file, which MultilinearModel and MultilinearModelPrior load
+// directly.
+int main(int argc, char *argv[]) {
+  namespace po = boost::program_options;
+
+  const string home_directory = QDir::homePath().toStdString();
+  cout << "Home dir: " << home_directory << endl;
+
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "Print help messages")
+    ("model_file", po::value<string>()->default_value(home_directory + "/Data/Multilinear/blendshape_core.tensor"), "Multilinear model file")
+    ("id_prior_file", po::value<string>()->default_value(home_directory + "/Data/Multilinear/blendshape_u_0_aug.tensor"), "Identity prior file")
+    ("exp_prior_file", po::value<string>()->default_value(home_directory + "/Data/Multilinear/blendshape_u_1_aug.tensor"), "Expression prior file")
+    ("id_u_file", po::value<string>(), "Identity mode U matrix file (optional)")
+    ("exp_u_file", po::value<string>(), "Expression mode U matrix file (optional)")
+    ("output_file", po::value<string>()->default_value(home_directory + "/Data/Multilinear/blendshape_model.mlmc"), "Output container file")
+    ("float32", "Store the core tensor in single precision");
+
+  po::variables_map vm;
+
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if(vm.count("help")) {
+      cout << desc << endl;
+      return 1;
+    }
+    po::notify(vm);
+  } catch(po::error& e) {
+    cerr << "Error: " << e.what() << endl;
+    cerr << desc << endl;
+    return 1;
+  }
+
+  ModelContainerWriter writer;
+
+  Tensor3 core;
+  if(!core.Read(vm["model_file"].as<string>())) return 1;
+  writer.AddTensor("core", core, vm.count("float32") ? MappedTensor3::Float32 : MappedTensor3::Float64);
+
+  if(vm.count("id_u_file")) {
+    Tensor2 u;
+    if(!u.Read(vm["id_u_file"].as<string>())) return 1;
+    writer.AddMatrix("u_id", u.GetData());
+  }
+  if(vm.count("exp_u_file")) {
+    Tensor2 u;
+    if(!u.Read(vm["exp_u_file"].as<string>())) return 1;
+    writer.AddMatrix("u_exp", u.GetData());
+  }
+
+  MultilinearModelPrior prior;
+  prior.load(vm["id_prior_file"].as<string>(), vm["exp_prior_file"].as<string>());
+  prior.save(writer);
+
+  const string output_filename = vm["output_file"].as<string>();
+  if(!writer.Write(output_filename)) return 1;
+
+  // Read the container back so a broken conversion is caught here
+  ModelContainer container;
+  if(!container.Open(output_filename, true)) return 1;
+
+  return 0;
+}
@@ -858,6 +858,8 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
   CameraParameters cam_params;
 };
 
+#include "stackedcostfunctions.h"
+
 struct PriorCostFunction {
   PriorCostFunction(const VectorXd &prior_vec, const MatrixXd &inv_cov_mat,
                     double weight)
@@ -725,33 +725,24 @@ struct ExpressionCostFunction_analytic : public ceres::CostFunction {
   CameraParameters cam_params;
 };
 
+// Landmark cost of the FACS weights of a blendshape model. The landmark is
+// base + deltas * w, with base its position in the neutral blendshape and the
+// columns of deltas its offsets in the other blendshapes, i.e. three rows of
+// the delta matrix of the reconstructor.
 struct ExpressionCostFunction_FACS {
-  ExpressionCostFunction_FACS(const MatrixX3d &points_in,
+  ExpressionCostFunction_FACS(const Vector3d &base,
+                              const Matrix<double, 3, Dynamic> &deltas,
                               const Constraint2D &constraint,
-                              int params_length,
                               const glm::dmat4 &Mview,
                               const glm::dmat4 &Rmat,
-                              const MatrixXd &Uexp,
                               const CameraParameters &cam_params)
-    : points_in(points_in), constraint(constraint), params_length(params_length),
-      Mview(Mview), Rmat(Rmat), Uexp(Uexp), cam_params(cam_params) { }
+    : base(base), deltas(deltas), constraint(constraint),
+      Mview(Mview), Rmat(Rmat), cam_params(cam_params) { }
 
   bool operator()(const double *const *wexp, double *residual) const {
-#if 0
-    VectorXd wexp_vec = Map<const VectorXd>(wexp[0], params_length).eval();
-#else
-    VectorXd wexp_vec(params_length);
-    wexp_vec.bottomRows(params_length-1) = Map<const VectorXd>(wexp[0], params_length - 1).eval();
-    wexp_vec[0] = 1.0 - wexp_vec.bottomRows(params_length-1).sum();
-#endif
-    VectorXd weights = (wexp_vec.transpose() * Uexp).eval();
-
-    // Apply the weight vector to the model
     // Apply the weight vector to the model
-    Vector3d tm(0, 0, 0);
-    for(int j=0;j<params_length;++j) {
-      tm += points_in.row(j) * wexp_vec[j];
-    }
+    Vector3d tm = base;
+    tm.noalias() += deltas * Map<const VectorXd>(wexp[0], deltas.cols());
 
     // Project the point to image plane
     glm::dvec3 p(tm[0], tm[1], tm[2]);
@@ -762,100 +753,32 @@ struct ExpressionCostFunction_FACS {
     return true;
   }
 
-  MatrixX3d points_in;
+  Vector3d base;
+  Matrix<double, 3, Dynamic> deltas;
   Constraint2D constraint;
-  int params_length;
   glm::dmat4 Mview, Rmat;
-  const MatrixXd &Uexp;
   CameraParameters cam_params;
 };
 
 struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
-  ExpressionCostFunction_FACS_analytic(const MatrixX3d &points_in,
+  ExpressionCostFunction_FACS_analytic(const Vector3d &base,
+                                       const Matrix<double, 3, Dynamic> &deltas,
                                        const Constraint2D &constraint,
-                                       int params_length,
                                        const glm::dmat4 &Mview,
                                        const glm::dmat4 &Rmat,
-                                       const MatrixXd &Uexp,
                                        const CameraParameters &cam_params)
-    : points_in(points_in), constraint(constraint), params_length(params_length),
-      Mview(Mview), Rmat(Rmat), Uexp(Uexp), cam_params(cam_params) {
+    : base(base), deltas(deltas), constraint(constraint),
+      Mview(Mview), Rmat(Rmat), cam_params(cam_params) {
     mutable_parameter_block_sizes()->clear();
-    mutable_parameter_block_sizes()->push_back(params_length - 1);
+    mutable_parameter_block_sizes()->push_back(deltas.cols());
     set_num_residuals(1);
-
-    //cout << "points_in: " << points_in.rows() << " x " << points_in.cols() << endl;
-  }
-
-  // TODO update the reference function
-  #if 0
-  VectorXd jacobian_ref(double const *const *wexp) const {
-    VectorXd J_ref(params_length-1);
-    const double epsilon = 1e-12;
-    for (int i = 1; i < params_length; ++i) {
-      #if 0
-          VectorXd wexp_vec = Map<const VectorXd>(wexp[0], params_length).eval();
-      #else
-          VectorXd wexp_vec(params_length);
-          wexp_vec.bottomRows(params_length-1) = Map<const VectorXd>(wexp[0], params_length - 1).eval();
-          wexp_vec[0] = 1.0 - wexp_vec.bottomRows(params_length-1).sum();
-      #endif
-
-      VectorXd wexp_vec_m = wexp_vec, wexp_vec_p = wexp_vec;
-      wexp_vec_m[i] -= epsilon * 0.5;
-      wexp_vec_p[i] += epsilon * 0.5;
-
-      double residual_p, residual_m;
-
-      {
-        model.UpdateTMWithTM0((wexp_vec_p.transpose() * Uexp).eval());
-        auto tm = model.GetTM();
-        glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
-                                    Mview,
-                                    cam_params);
-        residual_p =
-          l2_norm(glm::dvec2(q.x, q.y), constraint.data) * constraint.weight;
-      }
-
-      {
-        model.UpdateTMWithTM0((wexp_vec_m.transpose() * Uexp).eval());
-        auto tm = model.GetTM();
-        glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
-                                    Mview,
-                                    cam_params);
-        residual_m =
-          l2_norm(glm::dvec2(q.x, q.y), constraint.data) * constraint.weight;
-      }
-
-      J_ref[i-1] = (residual_p - residual_m) / epsilon;
-    }
-    return J_ref;
   }
-  #endif
 
   bool Evaluate(const double *const *wexp, double *residuals,
                 double **jacobians) const {
-    //cout << "before: " << points_in.rows() << " x " << points_in.cols() << endl;
-#if 0
-    VectorXd wexp_vec = Map<const VectorXd>(wexp[0], params_length).eval();
-#else
-    VectorXd wexp_vec(params_length);
-    wexp_vec.bottomRows(params_length-1) = Map<const VectorXd>(wexp[0], params_length - 1).eval();
-    wexp_vec[0] = 1.0 - wexp_vec.bottomRows(params_length-1).sum();
-#endif
-
-    VectorXd weights = (wexp_vec.transpose() * Uexp).eval();
-
-    //cout << "wexp_vec: " << wexp_vec.transpose().eval() << endl;
-    //cout << "points_in: " << points_in.eval() << endl;
-    //cout << points_in.rows() << " x " << points_in.cols() << endl;
-
     // Apply the weight vector to the model
-    Vector3d tm(0, 0, 0);
-    for(int j=0;j<params_length;++j) {
-      tm += points_in.row(j) * wexp_vec[j];
-    }
-    //cout << tm << endl;
+    Vector3d tm = base;
+    tm.noalias() += deltas * Map<const VectorXd>(wexp[0], deltas.cols());
 
     // Project the point to image plane
     glm::dvec3 p(tm[0], tm[1], tm[2]);
@@ -866,7 +789,7 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
 
     if (jacobians != NULL) {
       assert(jacobians[0] != NULL);
-      // J = Jh * R * tm1^T
+      // J = Jh * R * deltas
 
       Vector2d fvec;
       fvec[0] = q.x - constraint.data.x;
@@ -877,13 +800,12 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
       glm::dvec4 P = Mview * glm::dvec4(tm[0], tm[1], tm[2], 1.0);
       const double x0 = P.x, y0 = P.y, z0 = P.z;
 
-      const double sx = cam_params.image_size.x;
       const double sy = cam_params.image_size.y;
       const double f = cam_params.focal_length;
 
       const double inv_z0 = 1.0 / z0;
       const double common_factor = 0.5 * sy * f * inv_z0;
-      MatrixXd Jh(2, 3);
+      Matrix<double, 2, 3> Jh;
       Jh(0, 0) = -common_factor;
       Jh(0, 1) = 0;
       Jh(0, 2) = common_factor * x0 * inv_z0;
@@ -902,31 +824,108 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
       R(2, 1) = Rmat[1][2];
       R(2, 2) = Rmat[2][2];
 
-      MatrixXd D = MatrixXd::Zero(params_length, params_length-1);
-      for(int i=0;i<params_length-1;++i) {
-        D(0, i) = -1.0;
-        D(i+1, i) = 1.0;
-      }
+      Map<RowVectorXd>(jacobians[0], deltas.cols()) =
+        (constraint.weight * scale_factor * fvec.transpose() * Jh * R) * deltas;
+    }
+
+    return true;
+  }
+
+  Vector3d base;
+  Matrix<double, 3, Dynamic> deltas;
+  Constraint2D constraint;
+  glm::dmat4 Mview, Rmat;
+  CameraParameters cam_params;
+};
+
+// Analytic version of the joint head pose and FACS expression landmark cost.
+// Parameter blocks are the 6 pose parameters (euler angles YXZ, translation)
+// and the 46 free FACS weights, the residual is the 2D offset of the landmark
+// as in LandmarksCostFunction_2D_analytic.
+struct ExpressionPoseCostFunction_2D_analytic : public ceres::SizedCostFunction<2, 6, 46> {
+  ExpressionPoseCostFunction_2D_analytic(const MultilinearModel &model,
+                                         const Constraint2D &constraint,
+                                         const CameraParameters &cam_params,
+                                         const MatrixXd &Uexp,
+                                         double weight)
+    : constraint(constraint), cam_params(cam_params),
+      weight(weight * constraint.weight) {
+    Matrix<double, 3, Dynamic> A =
+      model.GetTM0().GetData().transpose() * Uexp.transpose();
+    p0 = A.col(0);
+    B = A.rightCols(A.cols() - 1).colwise() - A.col(0);
+  }
 
-      // tm0 is a ndims_exp x 3 matrix, where each row is x, y, z
-      auto tm0 = points_in;
-      auto J = (scale_factor * fvec.transpose() * Jh * R * tm0.transpose() *
-                Uexp.transpose() * D).eval();
+  virtual bool Evaluate(double const *const *params,
+                        double *residuals,
+                        double **jacobians) const {
+    const double *pose_params = params[0];
+    Vector3d p = p0;
+    p.noalias() += B * Map<const Matrix<double, 46, 1>>(params[1]);
+
+    auto Ry = glm::eulerAngleY(pose_params[0]);
+    auto Rx = glm::eulerAngleX(pose_params[1]);
+    auto Rz = glm::eulerAngleZ(pose_params[2]);
+    glm::dmat4 Rmat = Ry * Rx * Rz;
+    glm::dmat4 Tmat = glm::translate(glm::dmat4(1.0),
+                                     glm::dvec3(pose_params[3],
+                                                pose_params[4],
+                                                pose_params[5]));
+    glm::dmat4 Mview = Tmat * Rmat;
+
+    glm::dvec3 q = ProjectPoint(glm::dvec3(p[0], p[1], p[2]), Mview, cam_params);
+    residuals[0] = (q.x - constraint.data.x) * weight;
+    residuals[1] = (q.y - constraint.data.y) * weight;
+
+    if (jacobians != NULL) {
+      glm::dvec4 p4(p[0], p[1], p[2], 1.0);
+      glm::dvec4 P = Mview * p4;
+      const double inv_z0 = 1.0 / P.z;
+      const double common_factor =
+        0.5 * cam_params.image_size.y * cam_params.focal_length * inv_z0 * weight;
+      Matrix<double, 2, 3> Jh;
+      Jh << -common_factor, 0, common_factor * P.x * inv_z0,
+            0, -common_factor, common_factor * P.y * inv_z0;
 
-      for (int i = 0; i < params_length - 1; ++i) jacobians[0][i] = J(0, i);
+      if (jacobians[0] != NULL) {
+        glm::dvec4 dP[3] = {
+          glm::dEulerAngleY(pose_params[0]) * Rx * Rz * p4,
+          Ry * glm::dEulerAngleX(pose_params[1]) * Rz * p4,
+          Ry * Rx * glm::dEulerAngleZ(pose_params[2]) * p4
+        };
+        for (int i = 0; i < 3; ++i) {
+          Vector2d J_i = Jh * Vector3d(dP[i].x, dP[i].y, dP[i].z);
+          jacobians[0][i] = J_i[0];
+          jacobians[0][6 + i] = J_i[1];
+        }
+        for (int i = 0; i < 3; ++i) {
+          jacobians[0][3 + i] = Jh(0, i);
+          jacobians[0][9 + i] = Jh(1, i);
+        }
+      }
+
+      if (jacobians[1] != NULL) {
+        Matrix3d R;
+        for (int i = 0; i < 3; ++i) {
+          for (int j = 0; j < 3; ++j) R(i, j) = Rmat[j][i];
+        }
+        Map<Matrix<double, 2, 46, RowMajor>> J(jacobians[1]);
+        J.noalias() = (Jh * R) * B;
+      }
     }
 
     return true;
   }
 
-  MatrixX3d points_in;
+  Vector3d p0;
+  Matrix<double, 3, 46> B;
   Constraint2D constraint;
-  int params_length;
-  glm::dmat4 Mview, Rmat;
-  const MatrixXd &Uexp;
   CameraParameters cam_params;
+  double weight;
 };
 
+#include "stackedcostfunctions.h"
+
 struct PriorCostFunction {
   PriorCostFunction(const VectorXd &prior_vec, const MatrixXd &inv_cov_mat,
                     double weight)
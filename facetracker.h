@@ -0,0 +1,218 @@
+#ifndef MULTILINEARRECONSTRUCTION_FACETRACKER_H
+#define MULTILINEARRECONSTRUCTION_FACETRACKER_H
+
+// ExpressionPoseCostFunction_2D_analytic only exists in costfunctions_exp.h,
+// which shares its include guard with costfunctions.h
+#include "costfunctions_exp.h"
+#include "multilinearmodel.h"
+#include "parameters.h"
+
+#include <unordered_map>
+
+// Frame to frame tracking of the head pose and the FACS expression weights of
+// a face whose identity is known. Each frame is warm started from the previous
+// one, optionally extrapolated with a constant velocity, and refined with a few
+// projected Gauss-Newton steps on all 52 parameters at once:
+//
+//   E = 0.5 * sum_j |r_j|^2 + 0.5 * w_exp_reg * |w|^2
+//     + 0.5 * (x - x_pred)^T * D * (x - x_pred)
+//
+// r_j are the landmark residuals of ExpressionPoseCostFunction_2D_analytic, x
+// is [R, T, w] and D holds the temporal weights. The expression weights are
+// kept in [0, 1] by clamping every step.
+//
+// The identity is fixed, so the identity mode product of every landmark is
+// done once and the per frame cost is independent of the size of the core.
+// Not thread safe, a tracker follows a single sequence.
+class FaceTracker {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  struct Settings {
+    static Settings Defaults() {
+      Settings settings;
+      settings.max_iters = 5;
+      settings.tolerance = 1e-4;
+      settings.w_landmarks = 100.0;
+      settings.w_exp_reg = 1.0;
+      settings.w_temporal_R = 100.0;
+      settings.w_temporal_T = 100.0;
+      settings.w_temporal_exp = 10.0;
+      return settings;
+    }
+
+    int max_iters;
+    double tolerance;
+    double w_landmarks;     // scaled by the inverse pupil distance
+    double w_exp_reg;
+    double w_temporal_R, w_temporal_T, w_temporal_exp;
+  };
+
+  static const int nPoseDim = 6;
+  static const int nExpDim = 46;
+  static const int nDim = nPoseDim + nExpDim;
+  typedef Matrix<double, nDim, 1> Vector52d;
+  typedef Matrix<double, nDim, nDim> Matrix52d;
+
+  // The cache must hold every vertex the landmarks of the tracked frames
+  // refer to, e.g. the landmarks and all contour candidates
+  FaceTracker(const MultilinearModelCache &landmark_cache, const MatrixXd &Uexp,
+              const VectorXd &Wid, const Settings &settings = Settings::Defaults())
+    : landmark_cache(landmark_cache), Uexp(Uexp), Wid(Wid), settings(settings),
+      use_constant_velocity(true), num_tracked(0) {
+    x.setZero();
+    x_prev.setZero();
+  }
+
+  void SetConstantVelocityPrediction(bool val) { use_constant_velocity = val; }
+
+  // Takes effect from the next frame on
+  void SetIdentity(const VectorXd &Wid_in) {
+    Wid = Wid_in;
+    models.clear();
+  }
+
+  // Starts a new track, the next frame is warm started from the given
+  // parameters
+  void Reset(const ModelParameters &params) {
+    x.head<3>() = params.R;
+    x.segment<3>(3) = params.T;
+    x.tail<nExpDim>() = params.Wexp_FACS.bottomRows(nExpDim);
+    x_prev = x;
+    num_tracked = 0;
+  }
+
+  // Fits the parameters to the next frame, returns the final cost
+  double Track(const vector<Constraint2D> &constraints, const vector<int> &indices,
+               const CameraParameters &cam) {
+    Vector52d x_pred = x;
+    if(use_constant_velocity && num_tracked >= 2) {
+      x_pred += x - x_prev;
+      Project(x_pred);
+    }
+
+    double puple_distance = glm::distance(
+      0.5 * (constraints[28].data + constraints[30].data),
+      0.5 * (constraints[32].data + constraints[34].data));
+    const double weight = settings.w_landmarks / puple_distance;
+
+    vector<unique_ptr<ExpressionPoseCostFunction_2D_analytic>> cost_functions(indices.size());
+    for(size_t j=0;j<indices.size();++j) {
+      cost_functions[j].reset(new ExpressionPoseCostFunction_2D_analytic(
+        GetModel(indices[j]), constraints[j], cam, Uexp, weight));
+    }
+
+    Vector52d D;
+    D.head<3>().setConstant(settings.w_temporal_R);
+    D.segment<3>(3).setConstant(settings.w_temporal_T);
+    D.tail<nExpDim>().setConstant(settings.w_temporal_exp);
+
+    Vector52d x_cur = x_pred;
+    double E = Cost(cost_functions, D, x_pred, x_cur);
+    for(int iters = 0; iters < settings.max_iters; ++iters) {
+      Matrix52d JtJ = D.asDiagonal();
+      JtJ.diagonal().tail<nExpDim>().array() += settings.w_exp_reg;
+      Vector52d Jtr = D.cwiseProduct(x_cur - x_pred);
+      Jtr.tail<nExpDim>() += settings.w_exp_reg * x_cur.tail<nExpDim>();
+
+      Vector2d r;
+      Matrix<double, 2, nDim, RowMajor> J;
+      Matrix<double, 2, nPoseDim, RowMajor> J_pose;
+      Matrix<double, 2, nExpDim, RowMajor> J_exp;
+      const double *parameters[] = {x_cur.data(), x_cur.data() + nPoseDim};
+      double *jacobians[] = {J_pose.data(), J_exp.data()};
+      for(auto &cost_function : cost_functions) {
+        cost_function->Evaluate(parameters, r.data(), jacobians);
+        J << J_pose, J_exp;
+        JtJ.selfadjointView<Lower>().rankUpdate(J.transpose());
+        Jtr.noalias() += J.transpose() * r;
+      }
+
+      LLT<Matrix52d, Lower> llt(JtJ);
+      if(llt.info() != Success) {
+        cerr << "[Tracking] Normal equations are not positive definite." << endl;
+        break;
+      }
+      Vector52d delta = llt.solve(-Jtr);
+
+      // Backtrack along the projected step until the cost decreases
+      double step = 1.0, E_new = E;
+      Vector52d x_new = x_cur;
+      while(step > 1e-3) {
+        x_new = x_cur + step * delta;
+        Project(x_new);
+        E_new = Cost(cost_functions, D, x_pred, x_new);
+        if(E_new <= E) break;
+        step *= 0.5;
+      }
+      if(E_new > E) break;
+
+      const double dE = E - E_new;
+      const double dx = (x_new - x_cur).norm();
+      x_cur = x_new;
+      E = E_new;
+      if(dx < settings.tolerance || dE < settings.tolerance * E) break;
+    }
+
+    x_prev = x;
+    x = x_cur;
+    ++num_tracked;
+    return E;
+  }
+
+  // Writes the pose and the expression of the last tracked frame
+  void GetParameters(ModelParameters &params) const {
+    params.Wid = Wid;
+    params.R = x.head<3>();
+    params.T = x.segment<3>(3);
+    params.Wexp_FACS.resize(ModelParameters::nFACSDim);
+    params.Wexp_FACS(0) = 1.0;
+    params.Wexp_FACS.bottomRows(nExpDim) = x.tail<nExpDim>();
+    params.Wexp = params.Wexp_FACS.transpose() * Uexp;
+  }
+
+private:
+  // Identity applied projected model of a vertex, computed on first use
+  const MultilinearModel& GetModel(int vidx) {
+    auto it = models.find(vidx);
+    if(it == models.end()) {
+      MultilinearModel model_v = landmark_cache.GetModel(vidx);
+      model_v.ApplyWeights(Wid, Uexp.row(0).transpose(), MultilinearModel::KeepTM0);
+      it = models.insert(make_pair(vidx, model_v)).first;
+    }
+    return it->second;
+  }
+
+  static void Project(Vector52d &x) {
+    x.tail<nExpDim>() = x.tail<nExpDim>().cwiseMax(0.0).cwiseMin(1.0);
+  }
+
+  double Cost(const vector<unique_ptr<ExpressionPoseCostFunction_2D_analytic>> &cost_functions,
+              const Vector52d &D, const Vector52d &x_pred, const Vector52d &x_cur) const {
+    const double *parameters[] = {x_cur.data(), x_cur.data() + nPoseDim};
+    Vector2d r;
+    double E = 0;
+    for(auto &cost_function : cost_functions) {
+      cost_function->Evaluate(parameters, r.data(), NULL);
+      E += 0.5 * r.squaredNorm();
+    }
+    Vector52d dx = x_cur - x_pred;
+    E += 0.5 * dx.dot(D.cwiseProduct(dx));
+    E += 0.5 * settings.w_exp_reg * x_cur.tail<nExpDim>().squaredNorm();
+    return E;
+  }
+
+  const MultilinearModelCache &landmark_cache;
+  const MatrixXd &Uexp;
+  VectorXd Wid;
+  Settings settings;
+  bool use_constant_velocity;
+
+  // Parameters of the last two tracked frames
+  Vector52d x, x_prev;
+  int num_tracked;
+
+  unordered_map<int, MultilinearModel> models;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_FACETRACKER_H
@@ -0,0 +1,272 @@
+#ifndef MULTILINEARRECONSTRUCTION_FACSEXPRESSIONSOLVER_H
+#define MULTILINEARRECONSTRUCTION_FACSEXPRESSIONSOLVER_H
+
+#include "costfunctions.h"
+
+// Set to 0 to solve the FACS expression step with ceres instead
+#ifndef USE_FACS_EXPRESSION_SOLVER
+#define USE_FACS_EXPRESSION_SOLVER 1
+#endif
+
+// FACS expression weights of a single image, with the identity and the pose
+// fixed. The 46 free weights w are kept in [0, 1], the first FACS weight is
+// 1 minus their sum. Landmark i is affine in w, p_i = P0_i + B_i * w, as in
+// ExpressionCostFunction_FACS_stacked, and the cost is
+//
+//   E = 0.5 * sum_i |r_i|^2 + 0.5 * prior_weight * d^T * inv_cov_mat * d
+//     + 0.5 * sparsity_weight^2 * sum_k w_k
+//
+// with r_i the 2D landmark offsets of LandmarksCostFunction_2D_analytic and
+// d = Uexp^T * [1 - sum(w); w] - prior_vec, i.e. the squared residuals of
+// ExpressionRegularizationCostFunction and ExpressionRegularizationTerm.
+//
+// Only a few action units are active in a frame, so the solver keeps a set of
+// free weights and takes projected Gauss-Newton steps on those only. A weight
+// at a bound leaves the set, and the full gradient, which is a single 3N x 46
+// matrix-vector product, is only checked once the free weights converged, to
+// release the bound weights it points into the box. Positions and costs only
+// touch the nonzero weights, a step costs O(N * |free|^2).
+class FACSExpressionSolver {
+public:
+  FACSExpressionSolver(const vector<Constraint2D> &constraints,
+                       const glm::dmat4 &Mview, const glm::dmat4 &Rmat,
+                       const CameraParameters &cam_params)
+    : constraints(constraints), Mview(Mview), cam_params(cam_params),
+      sparsity_weight(0), damping(1.0), E_prior0(0) {
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) R(i, j) = Rmat[j][i];
+    }
+  }
+
+  // Landmark i is at rows 3i to 3i+2 of P0 and B
+  void SetBasis(const VectorXd &P0_in, const MatrixXd &B_in) {
+    P0 = P0_in;
+    B = B_in;
+    if (H_prior.rows() != B.cols()) {
+      H_prior = MatrixXd::Zero(B.cols(), B.cols());
+      b_prior = VectorXd::Zero(B.cols());
+    }
+  }
+
+  // Basis of the projected models, see ExpressionCostFunction_FACS_stacked
+  void SetBasis(const vector<MultilinearModel> &models, const MatrixXd &Uexp) {
+    const int num_points = constraints.size();
+    MatrixXd A(3 * num_points, Uexp.rows());
+    for (int i = 0; i < num_points; ++i) {
+      A.middleRows(3 * i, 3).noalias() =
+        models[i].GetTM0().GetData().transpose() * Uexp.transpose();
+    }
+    SetBasis(A.col(0), A.rightCols(A.cols() - 1).colwise() - A.col(0));
+  }
+
+  // The prior is quadratic in w, its terms are expanded once here
+  void SetPrior(const VectorXd &prior_vec, const MatrixXd &inv_cov_mat,
+                const MatrixXd &Uexp, double weight) {
+    const VectorXd c = Uexp.row(0).transpose() - prior_vec;
+    const MatrixXd G = Uexp.bottomRows(Uexp.rows() - 1).transpose().colwise() -
+                       Uexp.row(0).transpose();
+    const MatrixXd SG = weight * inv_cov_mat * G;
+    H_prior = G.transpose() * SG;
+    b_prior = SG.transpose() * c;
+    E_prior0 = 0.5 * weight * c.dot(inv_cov_mat * c);
+  }
+
+  // Weight of the sqrt(|w_k|) residuals, an L1 penalty on the weights
+  void SetSparsityWeight(double weight) { sparsity_weight = weight; }
+
+  // Levenberg-Marquardt damping added to the normal equations
+  void SetDamping(double val) { damping = val; }
+
+  // Refines w in place, returns the final cost. w is clamped to [0, 1] first.
+  double Solve(VectorXd &w, int max_iters = 10, double tolerance = 1e-6) const {
+    w = w.cwiseMax(0.0).cwiseMin(1.0);
+    double E = Cost(w);
+
+    vector<int> free_set;
+    VectorXd g = Gradient(w);
+    for (int k = 0; k < w.size(); ++k) {
+      if ((w[k] > 0 && w[k] < 1) || PointsIntoBox(w[k], g[k])) free_set.push_back(k);
+    }
+
+    for (int iters = 0; iters < max_iters; ++iters) {
+      bool converged = free_set.empty();
+      if (!converged) {
+        VectorXd delta = GaussNewtonStep(w, free_set);
+
+        // Backtrack along the projected step until the cost decreases
+        double step = 1.0, E_new = E;
+        VectorXd w_new = w;
+        while (step > 1e-3) {
+          for (size_t j = 0; j < free_set.size(); ++j) {
+            const int k = free_set[j];
+            w_new[k] = min(1.0, max(0.0, w[k] + step * delta[j]));
+          }
+          E_new = Cost(w_new);
+          if (E_new <= E) break;
+          step *= 0.5;
+        }
+
+        if (E_new > E) {
+          converged = true;
+        } else {
+          const double dE = E - E_new;
+          const double dw = (w_new - w).norm();
+          w = w_new;
+          E = E_new;
+          DEBUG_OUTPUT("[Expression optimization] iteration " + to_string(iters) +
+                       ": cost = " + to_string(E) + ", free weights = " +
+                       to_string(free_set.size()))
+
+          // Weights that hit a bound are fixed until the next check
+          free_set.erase(remove_if(free_set.begin(), free_set.end(),
+                                   [&w](int k) { return w[k] <= 0 || w[k] >= 1; }),
+                         free_set.end());
+          converged = dw < tolerance * (w.norm() + tolerance) || dE < tolerance * E;
+        }
+      }
+
+      if (converged) {
+        // Optimal unless the gradient points into the box at a bound weight
+        g = Gradient(w);
+        vector<int> released;
+        for (int k = 0; k < w.size(); ++k) {
+          if ((w[k] <= 0 || w[k] >= 1) && PointsIntoBox(w[k], g[k]) &&
+              find(free_set.begin(), free_set.end(), k) == free_set.end()) {
+            released.push_back(k);
+          }
+        }
+        if (released.empty()) break;
+        free_set.insert(free_set.end(), released.begin(), released.end());
+        sort(free_set.begin(), free_set.end());
+      }
+    }
+
+    return E;
+  }
+
+  double Cost(const VectorXd &w) const {
+    const vector<int> nz = NonzeroWeights(w);
+    VectorXd r;
+    Residuals(w, nz, r, NULL);
+
+    double E = 0.5 * r.squaredNorm() + E_prior0;
+    for (size_t a = 0; a < nz.size(); ++a) {
+      const int k = nz[a];
+      double Hw_k = 0;
+      for (size_t b = 0; b < nz.size(); ++b) Hw_k += H_prior(k, nz[b]) * w[nz[b]];
+      E += w[k] * (0.5 * Hw_k + b_prior[k] + 0.5 * sparsity_weight * sparsity_weight);
+    }
+    return E;
+  }
+
+protected:
+  // Rows 2i and 2i+1 of JhR map the motion of landmark i to its residuals
+  typedef Matrix<double, Dynamic, 3, RowMajor> JacobianType;
+
+  static bool PointsIntoBox(double w_k, double g_k) {
+    const double kGradientTolerance = 1e-10;
+    return (w_k <= 0 && g_k < -kGradientTolerance) || (w_k >= 1 && g_k > kGradientTolerance);
+  }
+
+  static vector<int> NonzeroWeights(const VectorXd &w) {
+    vector<int> nz;
+    for (int k = 0; k < w.size(); ++k) {
+      if (w[k] != 0) nz.push_back(k);
+    }
+    return nz;
+  }
+
+  // Landmark residuals from the nonzero weights nz of w, plus their
+  // derivatives with respect to the landmark positions if JhR is given
+  void Residuals(const VectorXd &w, const vector<int> &nz, VectorXd &r,
+                 JacobianType *JhR) const {
+    const int num_points = constraints.size();
+    VectorXd p = P0;
+    for (int k : nz) p.noalias() += B.col(k) * w[k];
+
+    r.resize(2 * num_points);
+    if (JhR != NULL) JhR->resize(2 * num_points, 3);
+    const double sy = cam_params.image_size.y;
+    const double f = cam_params.focal_length;
+    for (int i = 0; i < num_points; ++i) {
+      glm::dvec3 p_i(p[3*i], p[3*i+1], p[3*i+2]);
+      glm::dvec3 q = ProjectPoint(p_i, Mview, cam_params);
+      const double weight_i = constraints[i].weight;
+      r[2*i] = (q.x - constraints[i].data.x) * weight_i;
+      r[2*i+1] = (q.y - constraints[i].data.y) * weight_i;
+
+      if (JhR != NULL) {
+        glm::dvec4 P = Mview * glm::dvec4(p_i, 1.0);
+        const double inv_z0 = 1.0 / P.z;
+        const double common_factor = 0.5 * sy * f * inv_z0 * weight_i;
+        JhR->row(2*i) = common_factor * (P.x * inv_z0 * R.row(2) - R.row(0));
+        JhR->row(2*i+1) = common_factor * (P.y * inv_z0 * R.row(2) - R.row(1));
+      }
+    }
+  }
+
+  // Gradient of E with respect to all weights
+  VectorXd Gradient(const VectorXd &w) const {
+    const int num_points = constraints.size();
+    VectorXd r;
+    JacobianType JhR;
+    Residuals(w, NonzeroWeights(w), r, &JhR);
+
+    VectorXd u(3 * num_points);
+    for (int i = 0; i < num_points; ++i) {
+      u.segment<3>(3*i) = JhR.middleRows<2>(2*i).transpose() * r.segment<2>(2*i);
+    }
+    VectorXd g = B.transpose() * u + H_prior * w + b_prior;
+    g.array() += 0.5 * sparsity_weight * sparsity_weight;
+    return g;
+  }
+
+  // Damped Gauss-Newton step of the free weights, in the order of free_set
+  VectorXd GaussNewtonStep(const VectorXd &w, const vector<int> &free_set) const {
+    const int num_points = constraints.size();
+    const int num_free = free_set.size();
+    VectorXd r;
+    JacobianType JhR;
+    Residuals(w, NonzeroWeights(w), r, &JhR);
+
+    MatrixXd J(2 * num_points, num_free);
+    for (int j = 0; j < num_free; ++j) {
+      const int k = free_set[j];
+      for (int i = 0; i < num_points; ++i) {
+        J.block<2, 1>(2*i, j).noalias() = JhR.middleRows<2>(2*i) * B.block<3, 1>(3*i, k);
+      }
+    }
+
+    MatrixXd JtJ(num_free, num_free);
+    VectorXd Jtr = J.transpose() * r;
+    const VectorXd Hw = H_prior * w;
+    for (int a = 0; a < num_free; ++a) {
+      for (int b = 0; b < num_free; ++b) JtJ(a, b) = H_prior(free_set[a], free_set[b]);
+      JtJ(a, a) += damping;
+      Jtr[a] += Hw[free_set[a]] + b_prior[free_set[a]] + 0.5 * sparsity_weight * sparsity_weight;
+    }
+    JtJ.selfadjointView<Lower>().rankUpdate(J.transpose());
+
+    // Only the lower triangle holds the landmark terms
+    LLT<MatrixXd, Lower> llt(JtJ);
+    if (llt.info() != Success) {
+      cerr << "[Expression optimization] Normal equations are not positive definite." << endl;
+      return VectorXd::Zero(num_free);
+    }
+    return llt.solve(-Jtr);
+  }
+
+  VectorXd P0;
+  MatrixXd B;
+  Matrix3d R;
+  vector<Constraint2D> constraints;
+  glm::dmat4 Mview;
+  CameraParameters cam_params;
+
+  // Prior expanded as 0.5 * w^T * H_prior * w + b_prior^T * w + E_prior0
+  MatrixXd H_prior;
+  VectorXd b_prior;
+  double sparsity_weight, damping, E_prior0;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_FACSEXPRESSIONSOLVER_H
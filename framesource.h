@@ -0,0 +1,204 @@
+#ifndef MULTILINEARRECONSTRUCTION_FRAMESOURCE_H
+#define MULTILINEARRECONSTRUCTION_FRAMESOURCE_H
+
+#include "common.h"
+#include "constraints.h"
+#include "ioutilities.h"
+
+#include <QImage>
+#include <QImageReader>
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+
+// Images and landmarks of an image sequence, for sequences too long to keep
+// decoded in memory. The landmarks are parsed when a frame is added, the image
+// size is read from the file header, and the pixels are only decoded when
+// image() is called. Decoded images are kept in a bounded LRU cache. Each
+// access queues the following frames for a prefetch thread, so a sequential
+// pass rarely waits for the decoder.
+//
+// Frames are equivalent to the result of LoadImageAndPoints. Frames may be
+// added while others are accessed, every access to the frame list holds the
+// lock, and filename() and points() return copies for that reason.
+class FrameSource {
+public:
+  explicit FrameSource(int capacity = 32, int prefetch = 4)
+    : capacity(capacity), prefetch(prefetch), stopped(false),
+      worker(&FrameSource::PrefetchLoop, this) {}
+
+  ~FrameSource() {
+    {
+      lock_guard<mutex> lock(mtx);
+      stopped = true;
+    }
+    cv_request.notify_all();
+    worker.join();
+  }
+
+  FrameSource(const FrameSource&) = delete;
+  FrameSource& operator=(const FrameSource&) = delete;
+
+  // Same arguments as LoadImageAndPoints
+  bool AddFrame(const string &image_filename, const string &pts_filename,
+                bool resize = false) {
+    QImageReader reader(image_filename.c_str());
+    QSize size = reader.size();
+    if(!size.isValid()) {
+      cerr << "Failed to read image header of " << image_filename << endl;
+      return false;
+    }
+
+    Frame frame;
+    frame.image_filename = image_filename;
+    frame.points = LoadConstraints(pts_filename);
+
+    // Same scaling and flipping as LoadImageAndPoints
+    double puple_distance = glm::distance(
+      0.5 * (frame.points[28].data + frame.points[30].data),
+      0.5 * (frame.points[32].data + frame.points[34].data));
+    const double reference_distance = 100.0;
+    frame.scale_ratio = resize ? reference_distance / puple_distance : 1.0;
+    frame.size = size.scaled(size.width() * frame.scale_ratio,
+                             size.height() * frame.scale_ratio,
+                             Qt::KeepAspectRatio);
+    cout << "image size: " << frame.size.width() << "x" << frame.size.height() << endl;
+
+    for(auto &constraint : frame.points) {
+      constraint.data = constraint.data * frame.scale_ratio;
+      constraint.data.y = frame.size.height() - 1 - constraint.data.y;
+    }
+
+    lock_guard<mutex> lock(mtx);
+    frames.push_back(frame);
+    return true;
+  }
+
+  int size() const {
+    lock_guard<mutex> lock(mtx);
+    return frames.size();
+  }
+  string filename(int i) const {
+    lock_guard<mutex> lock(mtx);
+    return frames[i].image_filename;
+  }
+  vector<Constraint2D> points(int i) const {
+    lock_guard<mutex> lock(mtx);
+    return frames[i].points;
+  }
+  int width(int i) const {
+    lock_guard<mutex> lock(mtx);
+    return frames[i].size.width();
+  }
+  int height(int i) const {
+    lock_guard<mutex> lock(mtx);
+    return frames[i].size.height();
+  }
+
+  // Decoded image of frame i. The returned image shares its pixels with the
+  // cache, which is cheap to copy and stays valid after eviction.
+  QImage image(int i) {
+    unique_lock<mutex> lock(mtx);
+
+    // Requests of other accesses stay queued, frame i is decoded below and
+    // the oldest requests are dropped once more than the cache holds are queued
+    requests.erase(remove(requests.begin(), requests.end(), i), requests.end());
+    for(int j = i + 1; j <= i + prefetch && j < static_cast<int>(frames.size()); ++j) {
+      if(!cache_index.count(j) && !decoding.count(j) &&
+         find(requests.begin(), requests.end(), j) == requests.end()) {
+        requests.push_back(j);
+      }
+    }
+    while(static_cast<int>(requests.size()) > capacity) requests.pop_front();
+    if(!requests.empty()) cv_request.notify_one();
+
+    while(decoding.count(i)) cv_decoded.wait(lock);
+    auto it = cache_index.find(i);
+    if(it != cache_index.end()) {
+      cache.splice(cache.begin(), cache, it->second);
+      return it->second->second;
+    }
+
+    decoding.insert(i);
+    const Frame frame = frames[i];
+    lock.unlock();
+    QImage img = Decode(frame);
+    lock.lock();
+    Insert(i, img);
+    return img;
+  }
+
+  // Drop all decoded images
+  void Clear() {
+    lock_guard<mutex> lock(mtx);
+    requests.clear();
+    cache.clear();
+    cache_index.clear();
+  }
+
+private:
+  struct Frame {
+    string image_filename;
+    vector<Constraint2D> points;
+    QSize size;
+    double scale_ratio;
+  };
+
+  // Takes a copy of the frame, the decoding runs without the lock
+  static QImage Decode(const Frame &frame) {
+    QImage img(frame.image_filename.c_str());
+    if(frame.scale_ratio != 1.0) {
+      img = img.scaled(frame.size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+    return img;
+  }
+
+  // Must hold the lock
+  void Insert(int i, const QImage &img) {
+    decoding.erase(i);
+    cache.push_front(make_pair(i, img));
+    cache_index[i] = cache.begin();
+    while(static_cast<int>(cache.size()) > capacity) {
+      cache_index.erase(cache.back().first);
+      cache.pop_back();
+    }
+    cv_decoded.notify_all();
+  }
+
+  void PrefetchLoop() {
+    unique_lock<mutex> lock(mtx);
+    while(true) {
+      cv_request.wait(lock, [this]{ return stopped || !requests.empty(); });
+      if(stopped) return;
+
+      int i = requests.front();
+      requests.pop_front();
+      if(cache_index.count(i) || decoding.count(i)) continue;
+
+      decoding.insert(i);
+      const Frame frame = frames[i];
+      lock.unlock();
+      QImage img = Decode(frame);
+      lock.lock();
+      Insert(i, img);
+    }
+  }
+
+  int capacity, prefetch;
+  vector<Frame> frames;
+
+  // Most recently used first
+  list<pair<int, QImage>> cache;
+  unordered_map<int, list<pair<int, QImage>>::iterator> cache_index;
+  unordered_set<int> decoding;
+  deque<int> requests;
+
+  bool stopped;
+  mutable mutex mtx;
+  condition_variable cv_request, cv_decoded;
+  thread worker;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_FRAMESOURCE_H
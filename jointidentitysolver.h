@@ -0,0 +1,135 @@
+#ifndef MULTILINEARRECONSTRUCTION_JOINTIDENTITYSOLVER_H
+#define MULTILINEARRECONSTRUCTION_JOINTIDENTITYSOLVER_H
+
+#include "costfunctions.h"
+
+#include "boost/timer/timer.hpp"
+
+// Set to 0 to solve the joint identity step with ceres instead
+#ifndef USE_JOINT_IDENTITY_SOLVER
+#define USE_JOINT_IDENTITY_SOLVER 1
+#endif
+
+// Identity weights shared by a set of images, with the pose and the expression
+// of every image fixed. Every image contributes the stacked landmark residuals
+// of IdentityCostFunction_stacked, the prior adds
+//   0.5 * weight * (w - prior_vec)^T * inv_cov_mat * (w - prior_vec),
+// which is the squared PriorCostFunction residual. The problem is only as
+// large as the identity weights, so each Gauss-Newton step accumulates the
+// per-image normal equations J^T J, J^T r in parallel and solves the d x d
+// system with a Cholesky factorization.
+class JointIdentitySolver {
+public:
+  JointIdentitySolver(const VectorXd &prior_vec, const MatrixXd &inv_cov_mat,
+                      double prior_weight, int num_images)
+    : prior_vec(prior_vec), inv_cov_mat(inv_cov_mat), prior_weight(prior_weight),
+      images(num_images) {}
+
+  int size() const { return images.size(); }
+
+  // Adds empty image slots or drops the last ones. Every slot must be set
+  // before solving.
+  void Resize(int num_images) { images.resize(num_images); }
+
+  void SetPriorWeight(double weight) { prior_weight = weight; }
+
+  // Residuals of image k, see IdentityCostFunction_stacked. Different images
+  // may be set concurrently. Setting an image again replaces it.
+  void SetImage(int k, const vector<MultilinearModel> &models,
+                const vector<Constraint2D> &constraints,
+                const glm::dmat4 &Mview, const glm::dmat4 &Rmat,
+                const CameraParameters &cam_params, double weight) {
+    images[k].reset(new IdentityCostFunction_stacked(models, constraints, Mview,
+                                                     Rmat, cam_params, weight));
+  }
+
+  // Refines w in place, returns the final cost
+  double Solve(VectorXd &w, int max_iters = 10, double tolerance = 1e-6) const {
+    boost::timer::auto_cpu_timer timer_solve(
+      "[Identity optimization] Problem solve time = %w seconds.\n");
+
+    const int num_images = images.size();
+    const int d = w.size();
+    vector<MatrixXd> JtJ_i(num_images);
+    vector<VectorXd> Jtr_i(num_images);
+
+    double E = Cost(w);
+    for(int iters = 0; iters < max_iters; ++iters) {
+      // The per-image terms are summed in a fixed order afterwards, so the
+      // result does not depend on the scheduling
+      #pragma omp parallel for schedule(dynamic, 1)
+      for(int k = 0; k < num_images; ++k) {
+        const int num_residuals = images[k]->num_residuals();
+        VectorXd r(num_residuals);
+        Matrix<double, Dynamic, Dynamic, RowMajor> J(num_residuals, d);
+        const double *parameters[] = {w.data()};
+        double *jacobians[] = {J.data()};
+        images[k]->Evaluate(parameters, r.data(), jacobians);
+
+        JtJ_i[k] = MatrixXd::Zero(d, d);
+        JtJ_i[k].selfadjointView<Lower>().rankUpdate(J.transpose());
+        Jtr_i[k] = J.transpose() * r;
+      }
+
+      MatrixXd JtJ = prior_weight * inv_cov_mat;
+      VectorXd Jtr = prior_weight * (inv_cov_mat * (w - prior_vec));
+      for(int k = 0; k < num_images; ++k) {
+        JtJ += JtJ_i[k];
+        Jtr += Jtr_i[k];
+      }
+
+      // Only the lower triangle of the per-image terms is filled
+      LLT<MatrixXd, Lower> llt(JtJ);
+      if(llt.info() != Success) {
+        cerr << "[Identity optimization] Normal equations are not positive definite." << endl;
+        break;
+      }
+      VectorXd delta = llt.solve(-Jtr);
+
+      // Relinearize at the new weights only if the step reduces the cost,
+      // the projection is not linear in w
+      double step = 1.0, E_new = E;
+      VectorXd w_new = w;
+      while(step > 1e-3) {
+        w_new = w + step * delta;
+        E_new = Cost(w_new);
+        if(E_new <= E) break;
+        step *= 0.5;
+      }
+      if(E_new > E) break;
+
+      const double dE = E - E_new;
+      w = w_new;
+      E = E_new;
+      DEBUG_OUTPUT("[Identity optimization] iteration " + to_string(iters) + ": cost = " + to_string(E))
+      if(step * delta.norm() < tolerance * (w.norm() + tolerance) || dE < tolerance * E) break;
+    }
+
+    return E;
+  }
+
+  double Cost(const VectorXd &w) const {
+    const int num_images = images.size();
+    vector<double> E_i(num_images);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int k = 0; k < num_images; ++k) {
+      VectorXd r(images[k]->num_residuals());
+      const double *parameters[] = {w.data()};
+      images[k]->Evaluate(parameters, r.data(), NULL);
+      E_i[k] = 0.5 * r.squaredNorm();
+    }
+
+    VectorXd diff = w - prior_vec;
+    double E = 0.5 * prior_weight * diff.dot(inv_cov_mat * diff);
+    for(int k = 0; k < num_images; ++k) E += E_i[k];
+    return E;
+  }
+
+private:
+  const VectorXd &prior_vec;
+  const MatrixXd &inv_cov_mat;
+  double prior_weight;
+  vector<unique_ptr<IdentityCostFunction_stacked>> images;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_JOINTIDENTITYSOLVER_H
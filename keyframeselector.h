@@ -0,0 +1,78 @@
+#ifndef MULTILINEARRECONSTRUCTION_KEYFRAMESELECTOR_H
+#define MULTILINEARRECONSTRUCTION_KEYFRAMESELECTOR_H
+
+#include "common.h"
+#include "parameters.h"
+
+// Bounded set of frames that are diverse in head rotation and expression, for
+// estimating the identity of a long sequence. Frames are offered one at a time
+// as they arrive. A frame closer than min_distance to any keyframe adds
+// nothing and is rejected. Otherwise it is appended, or once the set is full,
+// it replaces the keyframe whose nearest neighbor is closest if it is farther
+// from the set than that one. Offering a frame costs O(max_keyframes), a
+// replacement O(max_keyframes^2).
+//
+// The distance is the euclidean distance between the rotations in radians
+// scaled by w_pose, concatenated with the FACS weights scaled by w_exp.
+class KeyframeSelector {
+public:
+  KeyframeSelector(int max_keyframes = 16, double min_distance = 0.1,
+                   double w_pose = 1.0, double w_exp = 1.0)
+    : max_keyframes(max_keyframes), min_distance(min_distance),
+      w_pose(w_pose), w_exp(w_exp) {}
+
+  // Returns the slot the frame is stored at, or -1 if it is rejected. A slot
+  // index equal to the previous size() means the frame was appended,
+  // otherwise it replaced the keyframe in that slot.
+  int AddFrame(int frame_index, const ModelParameters &params) {
+    VectorXd d(3 + params.Wexp_FACS.size() - 1);
+    d << w_pose * params.R, w_exp * params.Wexp_FACS.bottomRows(params.Wexp_FACS.size() - 1);
+
+    const int num_keyframes = frames.size();
+    VectorXd dist(num_keyframes);
+    for(int k=0;k<num_keyframes;++k) dist(k) = (descriptors[k] - d).norm();
+
+    int nearest = -1;
+    double d_min = numeric_limits<double>::max();
+    if(num_keyframes > 0) d_min = dist.minCoeff(&nearest);
+    if(d_min < min_distance) return -1;
+
+    if(num_keyframes < max_keyframes) {
+      for(int k=0;k<num_keyframes;++k) nn_distance[k] = min(nn_distance[k], dist(k));
+      frames.push_back(frame_index);
+      descriptors.push_back(d);
+      nn_distance.push_back(d_min);
+      return num_keyframes;
+    }
+
+    // Replace the most redundant keyframe
+    int slot = min_element(nn_distance.begin(), nn_distance.end()) - nn_distance.begin();
+    if(d_min <= nn_distance[slot]) return -1;
+
+    frames[slot] = frame_index;
+    descriptors[slot] = d;
+    for(int k=0;k<num_keyframes;++k) {
+      nn_distance[k] = numeric_limits<double>::max();
+      for(int l=0;l<num_keyframes;++l) {
+        if(l != k) nn_distance[k] = min(nn_distance[k], (descriptors[k] - descriptors[l]).norm());
+      }
+    }
+    return slot;
+  }
+
+  int size() const { return frames.size(); }
+
+  // Frame indices of the keyframes, by slot
+  const vector<int>& keyframes() const { return frames; }
+
+private:
+  int max_keyframes;
+  double min_distance;
+  double w_pose, w_exp;
+
+  vector<int> frames;
+  vector<VectorXd> descriptors;
+  vector<double> nn_distance;   // distance of each keyframe to its nearest neighbor
+};
+
+#endif // MULTILINEARRECONSTRUCTION_KEYFRAMESELECTOR_H
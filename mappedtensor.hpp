@@ -0,0 +1,268 @@
+#ifndef MAPPEDTENSOR_HPP
+#define MAPPEDTENSOR_HPP
+
+#include "tensor.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only core tensor backed by a memory mapped file.
+//
+// On disk the tensor is stored as a 64 byte header followed by the payload at
+// a 64 byte aligned offset. The payload uses the same layout as Tensor3::Write,
+// i.e. layer after layer, each layer a column major (rows x cols) matrix, so
+// element (i, j, k) lives at i*m*n + k*m + j. With this layout both unfoldings
+// used by MultilinearModel are plain column major matrices over the mapped
+// pages and no copy of the core is ever made:
+//
+//   mode 0: (m*n) x l, column i is layer i
+//   mode 1: m x (l*n), column i*n+k is the fiber core(i, :, k)
+//
+// The mapping is shared, so several processes mapping the same file share a
+// single page cache copy.
+class MappedTensor3 {
+public:
+  enum DataType : int32_t {
+    Float32 = 0,
+    Float64 = 1
+  };
+
+  static const uint32_t kMagic = 0x5443544d;  // "MTCT"
+  static const uint32_t kVersion = 1;
+  static const size_t kAlignment = 64;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t dtype;
+    int32_t l, m, n;
+    uint64_t offset;    // payload offset in bytes, multiple of kAlignment
+    char reserved[32];
+  };
+  static_assert(sizeof(Header) == 64, "MappedTensor3 header must be 64 bytes");
+
+  MappedTensor3() : l(0), m(0), n(0), dtype(Float64), payload(nullptr) {}
+
+  int layers() const { return l; }
+  int rows() const { return m; }
+  int cols() const { return n; }
+  DataType type() const { return dtype; }
+  bool empty() const { return payload == nullptr; }
+
+  double operator()(int i, int j, int k) const {
+    size_t idx = (static_cast<size_t>(i) * n + k) * m + j;
+    if(dtype == Float32) return static_cast<const float*>(payload)[idx];
+    else return static_cast<const double*>(payload)[idx];
+  }
+
+  // Zero-copy views of the unfolded core, see the layout notes above
+  template <typename T>
+  Map<const Matrix<T, Dynamic, Dynamic>> Unfold0() const {
+    assert(sizeof(T) == ElementSize());
+    return Map<const Matrix<T, Dynamic, Dynamic>>(
+      static_cast<const T*>(payload), m*n, l);
+  }
+
+  template <typename T>
+  Map<const Matrix<T, Dynamic, Dynamic>> Unfold1() const {
+    assert(sizeof(T) == ElementSize());
+    return Map<const Matrix<T, Dynamic, Dynamic>>(
+      static_cast<const T*>(payload), m, l*n);
+  }
+
+  // Same as Tensor3::ModeProduct<0>: returns the m x n matrix sum_i w(i) * core(i, :, :)
+  MatrixXd ModeProduct0(const Tensor1 &w) const {
+    assert(w.size() == l);
+    if(dtype == Float32) {
+      VectorXf u = Unfold0<float>() * w.cast<float>();
+      return Map<MatrixXf>(u.data(), m, n).cast<double>();
+    } else {
+      VectorXd u = Unfold0<double>() * w;
+      return Map<MatrixXd>(u.data(), m, n);
+    }
+  }
+
+  // Same as Tensor3::ModeProduct<1>: returns the l x n matrix sum_j w(j) * core(:, j, :)
+  MatrixXd ModeProduct1(const Tensor1 &w) const {
+    assert(w.size() == m);
+    if(dtype == Float32) {
+      VectorXf u = Unfold1<float>().transpose() * w.cast<float>();
+      return Map<MatrixXf>(u.data(), n, l).transpose().cast<double>();
+    } else {
+      VectorXd u = Unfold1<double>().transpose() * w;
+      return Map<MatrixXd>(u.data(), n, l).transpose();
+    }
+  }
+
+  // Copy the 3 coordinates of the given vertices into an in-memory tensor
+  Tensor3 Project(const vector<int> &indices) const {
+    Tensor3 t(l, m, indices.size() * 3);
+    for(int i=0;i<l;++i) {
+      for(int j=0;j<m;++j) {
+        for(int k=0, idx=0;k<indices.size();++k, idx+=3) {
+          int vidx = indices[k] * 3;
+          t(i, j, idx) = (*this)(i, j, vidx);
+          t(i, j, idx+1) = (*this)(i, j, vidx+1);
+          t(i, j, idx+2) = (*this)(i, j, vidx+2);
+        }
+      }
+    }
+    return t;
+  }
+
+  static bool IsMappedTensorFile(const string& filename) {
+    ifstream fin(filename, ios::in | ios::binary);
+    uint32_t magic = 0;
+    fin.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
+    return fin && magic == kMagic;
+  }
+
+  bool MapFile(const string& filename) {
+    cout << "Mapping tensor file " << filename << endl;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+      cerr << "Failed to open tensor file " << filename << endl;
+      return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+      cerr << "Invalid tensor file " << filename << endl;
+      close(fd);
+      return false;
+    }
+    size_t file_size = st.st_size;
+
+    void *addr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+    if(addr == MAP_FAILED) {
+      cerr << "Failed to map tensor file " << filename << endl;
+      return false;
+    }
+    region = shared_ptr<void>(addr, [file_size](void *p) { munmap(p, file_size); });
+
+    Header header;
+    memcpy(&header, addr, sizeof(Header));
+    if(header.magic != kMagic || header.version != kVersion
+       || (header.dtype != Float32 && header.dtype != Float64)
+       || header.offset % kAlignment != 0) {
+      cerr << "Unsupported tensor file " << filename << endl;
+      region.reset();
+      return false;
+    }
+
+    l = header.l; m = header.m; n = header.n;
+    dtype = static_cast<DataType>(header.dtype);
+    size_t payload_size = static_cast<size_t>(l) * m * n * ElementSize();
+    if(header.offset + payload_size > file_size) {
+      cerr << "Truncated tensor file " << filename << endl;
+      region.reset();
+      return false;
+    }
+    payload = static_cast<const char*>(addr) + header.offset;
+
+    // The whole core is touched on every mode product
+    madvise(addr, file_size, MADV_WILLNEED);
+
+    cout << "tensor size = " << l << "x" << m << "x" << n
+         << (dtype == Float32 ? " (float32)" : " (float64)") << endl;
+    return true;
+  }
+
+  // Read a file written by Tensor3::Write into a single buffer owned by the
+  // tensor. Like a mapping, the buffer is shared by every copy of the model
+  // instead of being duplicated and unfolded twice as with Tensor3.
+  bool Load(const string& filename) {
+    cout << "Reading tensor file " << filename << endl;
+    ifstream fin(filename, ios::in | ios::binary);
+
+    int32_t dims[3];
+    fin.read(reinterpret_cast<char*>(dims), sizeof(dims));
+    if(!fin || dims[0] < 0 || dims[1] < 0 || dims[2] < 0) {
+      cerr << "Invalid tensor file " << filename << endl;
+      return false;
+    }
+
+    const size_t count = static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+    shared_ptr<double> buffer(new double[count], default_delete<double[]>());
+    fin.read(reinterpret_cast<char*>(buffer.get()), sizeof(double) * count);
+    if(!fin) {
+      cerr << "Tensor file " << filename << " is truncated." << endl;
+      return false;
+    }
+
+    Attach(buffer, buffer.get(), Float64, dims[0], dims[1], dims[2]);
+    cout << "tensor size = " << l << "x" << m << "x" << n << endl;
+    return true;
+  }
+
+  // View a tensor payload inside a region mapped by someone else, e.g. a
+  // ModelContainer entry. The region is kept alive by this tensor.
+  void Attach(shared_ptr<void> region_in, const void *payload_in,
+              DataType dtype_in, int l_in, int m_in, int n_in) {
+    region = region_in;
+    payload = payload_in;
+    dtype = dtype_in;
+    l = l_in; m = m_in; n = n_in;
+  }
+
+  // Write an in-memory tensor in the mapped format
+  static bool Write(const string& filename, const Tensor3& t, DataType dtype = Float64) {
+    try {
+      cout << "writing mapped tensor to file " << filename << endl;
+      Header header;
+      memset(&header, 0, sizeof(Header));
+      header.magic = kMagic;
+      header.version = kVersion;
+      header.dtype = dtype;
+      header.l = t.layers(); header.m = t.rows(); header.n = t.cols();
+      header.offset = kAlignment;
+
+      fstream fout;
+      fout.open(filename, ios::out | ios::binary);
+      fout.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+      // Layers are written in the same order as Tensor3::Write
+      vector<float> buffer;
+      for(int i=0;i<t.layers();++i) {
+        vector<double> layer(static_cast<size_t>(t.rows()) * t.cols());
+        for(int k=0, idx=0;k<t.cols();++k) {
+          for(int j=0;j<t.rows();++j, ++idx) layer[idx] = t(i, j, k);
+        }
+        if(dtype == Float32) {
+          buffer.assign(layer.begin(), layer.end());
+          fout.write(reinterpret_cast<const char*>(buffer.data()), sizeof(float)*buffer.size());
+        } else {
+          fout.write(reinterpret_cast<const char*>(layer.data()), sizeof(double)*layer.size());
+        }
+      }
+
+      fout.close();
+      cout << "done." << endl;
+      return fout.good();
+    }
+    catch(...) {
+      cerr << "Failed to write tensor to file " << filename << endl;
+      return false;
+    }
+  }
+
+private:
+  size_t ElementSize() const {
+    return dtype == Float32 ? sizeof(float) : sizeof(double);
+  }
+
+  int l, m, n;
+  DataType dtype;
+  shared_ptr<void> region;
+  const void *payload;
+};
+
+#endif // MAPPEDTENSOR_HPP
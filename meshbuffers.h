@@ -0,0 +1,237 @@
+#ifndef MULTILINEARRECONSTRUCTION_MESHBUFFERS_H
+#define MULTILINEARRECONSTRUCTION_MESHBUFFERS_H
+
+#include "basicmesh.h"
+
+#include <QOpenGLBuffer>
+
+// GPU copy of a BasicMesh for the fixed function pipeline, so that a mesh is
+// drawn with a single glDrawElements call instead of a glBegin/glEnd block per
+// face.
+//
+// Every face owns its three corners in the buffers, which is what lets a face
+// carry a single flat color (the index encoding) or texture coordinates that
+// are indexed separately from the vertices. The arrays that only depend on the
+// topology are uploaded when the faces change, Update otherwise only rewrites
+// the positions and normals. The subset of faces to draw lives in the index
+// buffer and is uploaded when it changes.
+//
+// All calls need the GL context the buffers were created in to be current.
+class MeshBuffers {
+public:
+  enum Attribute {
+    Position = 0x1,
+    VertexNormal = 0x2,         // smooth normals, or the ones given to Update
+    FaceNormal = 0x4,           // the face normal at all three corners
+    TexCoord = 0x8,             // flipped vertically for QImage textures
+    TexCoordAsPosition = 0x10,  // 2D positions in texture space
+    IndexColor = 0x20,          // face index, see ColorEncoding::encode_index
+    BarycentricColor = 0x40,    // red, green and blue at the three corners
+    CustomColor = 0x80          // RGBA per vertex given to SetColors
+  };
+
+  MeshBuffers() : num_faces(0), draw_all_faces(true) {}
+
+  // Uploads the positions and normals, plus the topology dependent arrays if
+  // the faces differ from the last update. normals_in optionally replaces the
+  // vertex normals of the mesh, 3 floats per vertex, normalized here.
+  void Update(const BasicMesh &mesh, const vector<float> &normals_in = vector<float>()) {
+    if(!SameTopology(mesh)) UpdateTopology(mesh);
+
+    const int num_corners = num_faces * 3;
+    vector<float> positions(num_corners * 3), normals(num_corners * 3), face_normals(num_corners * 3);
+    for(int i=0, c=0;i<num_faces;++i) {
+      Vector3i f = mesh.face(i);
+      Vector3d nf = mesh.normal(i);
+      for(int k=0;k<3;++k, ++c) {
+        Vector3d v = mesh.vertex(f[k]);
+        Vector3d n;
+        if(normals_in.empty()) {
+          n = mesh.vertex_normal(f[k]);
+        } else {
+          n = Vector3d(normals_in[f[k]*3], normals_in[f[k]*3+1], normals_in[f[k]*3+2]);
+          n.normalize();
+        }
+        for(int j=0;j<3;++j) {
+          positions[c*3+j] = v[j];
+          normals[c*3+j] = n[j];
+          face_normals[c*3+j] = nf[j];
+        }
+      }
+    }
+    Upload(position_buffer, positions.data(), positions.size() * sizeof(float));
+    Upload(normal_buffer, normals.data(), normals.size() * sizeof(float));
+    Upload(face_normal_buffer, face_normals.data(), face_normals.size() * sizeof(float));
+  }
+
+  // Faces drawn by Draw, all of them if empty
+  void SetFaces(const vector<int> &faces) {
+    if(faces.empty()) {
+      draw_all_faces = true;
+      return;
+    }
+    draw_all_faces = false;
+    if(faces == faces_to_draw) return;
+
+    faces_to_draw = faces;
+    vector<GLuint> indices(faces.size() * 3);
+    for(size_t i=0;i<faces.size();++i) {
+      for(int k=0;k<3;++k) indices[i*3+k] = faces[i] * 3 + k;
+    }
+    Upload(index_buffer, indices.data(), indices.size() * sizeof(GLuint),
+           QOpenGLBuffer::IndexBuffer);
+  }
+
+  // 4 floats per vertex of the mesh, for CustomColor
+  void SetColors(const BasicMesh &mesh, const vector<float> &colors) {
+    vector<float> corner_colors(num_faces * 3 * 4);
+    for(int i=0, c=0;i<num_faces;++i) {
+      Vector3i f = mesh.face(i);
+      for(int k=0;k<3;++k, ++c) {
+        for(int j=0;j<4;++j) corner_colors[c*4+j] = colors[f[k]*4+j];
+      }
+    }
+    Upload(custom_color_buffer, corner_colors.data(), corner_colors.size() * sizeof(float));
+  }
+
+  // Draws the faces with the given attributes, see Attribute. Without a
+  // color attribute the current color is used.
+  void Draw(int attributes, GLenum primitive = GL_TRIANGLES) {
+    if(num_faces == 0) return;
+
+    if(attributes & TexCoordAsPosition) {
+      BindArray(texcoord_position_buffer, GL_VERTEX_ARRAY, 2, GL_FLOAT);
+    } else if(attributes & Position) {
+      BindArray(position_buffer, GL_VERTEX_ARRAY, 3, GL_FLOAT);
+    }
+    if(attributes & VertexNormal) BindArray(normal_buffer, GL_NORMAL_ARRAY, 3, GL_FLOAT);
+    else if(attributes & FaceNormal) BindArray(face_normal_buffer, GL_NORMAL_ARRAY, 3, GL_FLOAT);
+    if(attributes & TexCoord) BindArray(texcoord_buffer, GL_TEXTURE_COORD_ARRAY, 2, GL_FLOAT);
+    if(attributes & IndexColor) BindArray(index_color_buffer, GL_COLOR_ARRAY, 4, GL_UNSIGNED_BYTE);
+    else if(attributes & BarycentricColor) BindArray(barycentric_color_buffer, GL_COLOR_ARRAY, 4, GL_UNSIGNED_BYTE);
+    else if(attributes & CustomColor) BindArray(custom_color_buffer, GL_COLOR_ARRAY, 4, GL_FLOAT);
+    QOpenGLBuffer::release(QOpenGLBuffer::VertexBuffer);
+
+    if(draw_all_faces) {
+      glDrawArrays(primitive, 0, num_faces * 3);
+    } else {
+      index_buffer.bind();
+      glDrawElements(primitive, faces_to_draw.size() * 3, GL_UNSIGNED_INT, 0);
+      index_buffer.release();
+    }
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+  }
+
+  // Frees the buffers
+  void Clear() {
+    for(auto buffer : {&position_buffer, &normal_buffer, &face_normal_buffer,
+                       &texcoord_buffer, &texcoord_position_buffer,
+                       &index_color_buffer, &barycentric_color_buffer,
+                       &custom_color_buffer, &index_buffer}) {
+      buffer->destroy();
+    }
+    num_faces = 0;
+    faces.clear();
+    face_textures.clear();
+    faces_to_draw.clear();
+    draw_all_faces = true;
+  }
+
+private:
+  bool SameTopology(const BasicMesh &mesh) const {
+    if(mesh.NumFaces() != num_faces) return false;
+    for(int i=0;i<num_faces;++i) {
+      if(mesh.face(i) != faces[i]) return false;
+      if(mesh.NumTextureCoords() > 0 && mesh.face_texture(i) != face_textures[i]) return false;
+    }
+    return true;
+  }
+
+  void UpdateTopology(const BasicMesh &mesh) {
+    num_faces = mesh.NumFaces();
+    faces.resize(num_faces);
+    face_textures.resize(num_faces);
+
+    const int num_corners = num_faces * 3;
+    const bool has_texcoords = mesh.NumTextureCoords() > 0;
+    vector<float> texcoords(num_corners * 2, 0.0f), texcoord_positions(num_corners * 2, 0.0f);
+    vector<unsigned char> index_colors(num_corners * 4), barycentric_colors(num_corners * 4, 0);
+    for(int i=0, c=0;i<num_faces;++i) {
+      faces[i] = mesh.face(i);
+      face_textures[i] = has_texcoords ? mesh.face_texture(i) : Vector3i(0, 0, 0);
+
+      // Same encoding as ColorEncoding::encode_index
+      const unsigned char r = i & 0xff, g = (i >> 8) & 0xff, b = (i >> 16) & 0xff;
+      for(int k=0;k<3;++k, ++c) {
+        if(has_texcoords) {
+          Vector2d t = mesh.texture_coords(face_textures[i][k]);
+          texcoords[c*2] = t[0];
+          texcoords[c*2+1] = 1.0 - t[1];
+          texcoord_positions[c*2] = t[0];
+          texcoord_positions[c*2+1] = t[1];
+        }
+        index_colors[c*4] = r;
+        index_colors[c*4+1] = g;
+        index_colors[c*4+2] = b;
+        index_colors[c*4+3] = 255;
+        barycentric_colors[c*4+k] = 255;
+        barycentric_colors[c*4+3] = 255;
+      }
+    }
+
+    Upload(texcoord_buffer, texcoords.data(), texcoords.size() * sizeof(float),
+           QOpenGLBuffer::VertexBuffer, QOpenGLBuffer::StaticDraw);
+    Upload(texcoord_position_buffer, texcoord_positions.data(), texcoord_positions.size() * sizeof(float),
+           QOpenGLBuffer::VertexBuffer, QOpenGLBuffer::StaticDraw);
+    Upload(index_color_buffer, index_colors.data(), index_colors.size(),
+           QOpenGLBuffer::VertexBuffer, QOpenGLBuffer::StaticDraw);
+    Upload(barycentric_color_buffer, barycentric_colors.data(), barycentric_colors.size(),
+           QOpenGLBuffer::VertexBuffer, QOpenGLBuffer::StaticDraw);
+
+    // Corner indices refer to the old faces
+    faces_to_draw.clear();
+    draw_all_faces = true;
+  }
+
+  static void Upload(QOpenGLBuffer &buffer, const void *data, int size,
+                     QOpenGLBuffer::Type type = QOpenGLBuffer::VertexBuffer,
+                     QOpenGLBuffer::UsagePattern usage = QOpenGLBuffer::DynamicDraw) {
+    if(!buffer.isCreated()) {
+      buffer = QOpenGLBuffer(type);
+      buffer.setUsagePattern(usage);
+      buffer.create();
+    }
+    buffer.bind();
+    if(buffer.size() == size) buffer.write(0, data, size);
+    else buffer.allocate(data, size);
+    buffer.release();
+  }
+
+  static void BindArray(QOpenGLBuffer &buffer, GLenum array, int size, GLenum type) {
+    buffer.bind();
+    glEnableClientState(array);
+    switch(array) {
+      case GL_VERTEX_ARRAY: glVertexPointer(size, type, 0, 0); break;
+      case GL_NORMAL_ARRAY: glNormalPointer(type, 0, 0); break;
+      case GL_TEXTURE_COORD_ARRAY: glTexCoordPointer(size, type, 0, 0); break;
+      case GL_COLOR_ARRAY: glColorPointer(size, type, 0, 0); break;
+    }
+  }
+
+  int num_faces;
+  vector<Vector3i> faces, face_textures;
+
+  QOpenGLBuffer position_buffer, normal_buffer, face_normal_buffer;
+  QOpenGLBuffer texcoord_buffer, texcoord_position_buffer;
+  QOpenGLBuffer index_color_buffer, barycentric_color_buffer, custom_color_buffer;
+
+  bool draw_all_faces;
+  vector<int> faces_to_draw;
+  QOpenGLBuffer index_buffer;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_MESHBUFFERS_H
@@ -0,0 +1,267 @@
+#ifndef MULTILINEARRECONSTRUCTION_MESHRASTERIZER_H
+#define MULTILINEARRECONSTRUCTION_MESHRASTERIZER_H
+
+#include "basicmesh.h"
+#include "parameters.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/euler_angles.hpp>
+
+#include <set>
+
+// CPU replacement of the index encoded CamPerspective render of
+// OffscreenMeshVisualizer, for passes that only need to know which triangle
+// covers a pixel. It needs no GL context, so it also runs on headless nodes,
+// and the face indices come out as integers instead of encoded colors.
+//
+// Same projection, back face culling and depth test as the GL render. The
+// screen is split in tiles, every triangle is binned to the tiles its bounding
+// box overlaps and the tiles are rasterized in parallel. The pixels of a tile
+// row are tested in a loop the compiler vectorizes. Edges shared by two faces
+// are evaluated identically for both, and pixel centers on an edge go to one
+// side only, so there are no cracks between faces. Depth ties go to the face
+// listed first, the result does not depend on the scheduling.
+//
+// Triangles reaching behind the near or the far plane are dropped instead of
+// clipped, which never happens for a face in front of the camera.
+//
+// Buffers are stored top row first like a QImage, pixel (x, y) is at
+// y * width + x.
+class MeshRasterizer {
+public:
+  MeshRasterizer(int width, int height) : width(width), height(height) {}
+
+  void SetCameraParameters(const CameraParameters& cam_params) {
+    camera_params = cam_params;
+  }
+  void SetMeshRotationTranslation(const Vector3d& R, const Vector3d& T) {
+    mesh_rotation = R;
+    mesh_translation = T;
+  }
+
+  // Rasterizes the given faces of the mesh, all of them if empty
+  void Rasterize(const BasicMesh& mesh, const vector<int>& faces = vector<int>()) {
+    const int num_pixels = width * height;
+    face_index_buffer.assign(num_pixels, -1);
+    barycentric_buffer.assign(num_pixels * 3, 0.0f);
+    depth_buffer.assign(num_pixels, 1.0f);
+
+    vector<int> faces_to_render = faces;
+    if(faces_to_render.empty()) {
+      faces_to_render.resize(mesh.NumFaces());
+      for(int i=0;i<mesh.NumFaces();++i) faces_to_render[i] = i;
+    }
+
+    // Window coordinates of the vertices, y pointing up like in GL
+    const glm::dmat4 MVP = ProjectionMatrix() * ModelViewMatrix();
+    const int num_verts = mesh.NumVertices();
+    vector<glm::dvec4> screen_verts(num_verts);
+    vector<char> valid(num_verts);
+    #pragma omp parallel for
+    for(int i=0;i<num_verts;++i) {
+      Vector3d v = mesh.vertex(i);
+      glm::dvec4 p = MVP * glm::dvec4(v[0], v[1], v[2], 1.0);
+      valid[i] = p.w > 0 && p.z >= -p.w && p.z <= p.w;
+      if(!valid[i]) continue;
+      const double inv_w = 1.0 / p.w;
+      screen_verts[i] = glm::dvec4((p.x * inv_w + 1.0) * 0.5 * width,
+                                   (p.y * inv_w + 1.0) * 0.5 * height,
+                                   (p.z * inv_w + 1.0) * 0.5,
+                                   inv_w);
+    }
+
+    const int num_faces = faces_to_render.size();
+    vector<Triangle> triangles(num_faces);
+    vector<char> visible(num_faces, 0);
+    #pragma omp parallel for
+    for(int i=0;i<num_faces;++i) {
+      visible[i] = SetupTriangle(faces_to_render[i], mesh.face(faces_to_render[i]),
+                                 screen_verts, valid, triangles[i]);
+    }
+
+    // Binning is sequential so every bin lists its faces in drawing order
+    const int tiles_x = (width + kTileSize - 1) / kTileSize;
+    const int tiles_y = (height + kTileSize - 1) / kTileSize;
+    vector<vector<int>> bins(tiles_x * tiles_y);
+    for(int i=0;i<num_faces;++i) {
+      if(!visible[i]) continue;
+      const Triangle& t = triangles[i];
+      for(int ty = t.y_min / kTileSize; ty <= t.y_max / kTileSize; ++ty) {
+        for(int tx = t.x_min / kTileSize; tx <= t.x_max / kTileSize; ++tx) {
+          bins[ty * tiles_x + tx].push_back(i);
+        }
+      }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int tile_i = 0; tile_i < tiles_x * tiles_y; ++tile_i) {
+      const int x0 = (tile_i % tiles_x) * kTileSize, y0 = (tile_i / tiles_x) * kTileSize;
+      const int x1 = min(x0 + kTileSize, width) - 1, y1 = min(y0 + kTileSize, height) - 1;
+      for(int i : bins[tile_i]) {
+        RasterizeTriangle(triangles[i], max(x0, triangles[i].x_min), min(x1, triangles[i].x_max),
+                          max(y0, triangles[i].y_min), min(y1, triangles[i].y_max));
+      }
+    }
+  }
+
+  // Face covering each pixel, -1 for the background
+  const vector<int>& face_indices() const { return face_index_buffer; }
+
+  // Perspective correct barycentric coordinates of each pixel in its face,
+  // 3 per pixel and zero for the background
+  const vector<float>& barycentrics() const { return barycentric_buffer; }
+
+  // Window depth in [0, 1] like the GL depth buffer, 1 for the background
+  const vector<float>& depth() const { return depth_buffer; }
+
+  set<int> VisibleFaces() const {
+    set<int> S;
+    for(int idx : face_index_buffer) {
+      if(idx >= 0) S.insert(idx);
+    }
+    return S;
+  }
+
+protected:
+  static const int kTileSize = 64;
+
+  // The edge functions are evaluated as
+  //   E(p) = sign * ((b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x))
+  // from the endpoint with the smaller vertex index, so both faces sharing an
+  // edge get bitwise opposite values
+  struct Edge {
+    double ax, ay, dx, dy, sign;
+    bool top_left;
+  };
+
+  struct Triangle {
+    int face_index;
+    int x_min, x_max, y_min, y_max;
+    Edge edges[3];              // edge k is opposite to vertex k
+    double inv_area;
+    double z[3], inv_w[3];
+  };
+
+  glm::dmat4 ProjectionMatrix() const {
+    // Same as the CamPerspective mode of OffscreenMeshVisualizer
+    const double aspect_ratio = camera_params.image_size.x / camera_params.image_size.y;
+    const double far = camera_params.far;
+    const double near = camera_params.focal_length;
+    const double top = near * tan(0.5 * camera_params.fovy);
+    const double right = top * aspect_ratio;
+    return glm::dmat4(near/right, 0, 0, 0,
+                      0, near/top, 0, 0,
+                      0, 0, -(far+near)/(far-near), -1,
+                      0, 0, -2.0 * far * near / (far - near), 0.0);
+  }
+
+  glm::dmat4 ModelViewMatrix() const {
+    glm::dmat4 Rmat = glm::eulerAngleYXZ(mesh_rotation[0], mesh_rotation[1], mesh_rotation[2]);
+    glm::dmat4 Tmat = glm::translate(glm::dmat4(1.0),
+                                     glm::dvec3(mesh_translation[0],
+                                                mesh_translation[1],
+                                                mesh_translation[2]));
+    return Tmat * Rmat;
+  }
+
+  bool SetupTriangle(int face_index, const Vector3i& f, const vector<glm::dvec4>& screen_verts,
+                     const vector<char>& valid, Triangle& t) const {
+    if(!valid[f[0]] || !valid[f[1]] || !valid[f[2]]) return false;
+
+    const glm::dvec4& p0 = screen_verts[f[0]];
+    const glm::dvec4& p1 = screen_verts[f[1]];
+    const glm::dvec4& p2 = screen_verts[f[2]];
+
+    // Counter clockwise faces are front facing, cull the rest
+    const double area = (p1[0] - p0[0]) * (p2[1] - p0[1]) - (p1[1] - p0[1]) * (p2[0] - p0[0]);
+    if(!(area > 0)) return false;
+
+    // Pixels whose centers lie in the bounding box
+    t.x_min = max(0.0, ceil(min(p0[0], min(p1[0], p2[0])) - 0.5));
+    t.x_max = min(width - 1.0, floor(max(p0[0], max(p1[0], p2[0])) - 0.5));
+    t.y_min = max(0.0, ceil(min(p0[1], min(p1[1], p2[1])) - 0.5));
+    t.y_max = min(height - 1.0, floor(max(p0[1], max(p1[1], p2[1])) - 0.5));
+    if(t.x_min > t.x_max || t.y_min > t.y_max) return false;
+
+    t.face_index = face_index;
+    t.inv_area = 1.0 / area;
+    for(int k=0;k<3;++k) {
+      int a = f[(k+1)%3], b = f[(k+2)%3];
+      // Direction of the edge when walking around the face
+      const double dx = screen_verts[b][0] - screen_verts[a][0];
+      const double dy = screen_verts[b][1] - screen_verts[a][1];
+      // A center on the edge belongs to the face on its left or top side
+      t.edges[k].top_left = dy < 0 || (dy == 0 && dx < 0);
+
+      t.edges[k].sign = 1.0;
+      if(a > b) {
+        swap(a, b);
+        t.edges[k].sign = -1.0;
+      }
+      t.edges[k].ax = screen_verts[a][0];
+      t.edges[k].ay = screen_verts[a][1];
+      t.edges[k].dx = screen_verts[b][0] - screen_verts[a][0];
+      t.edges[k].dy = screen_verts[b][1] - screen_verts[a][1];
+
+      t.z[k] = screen_verts[f[k]][2];
+      t.inv_w[k] = screen_verts[f[k]][3];
+    }
+    return true;
+  }
+
+  void RasterizeTriangle(const Triangle& t, int x_begin, int x_end, int y_begin, int y_end) {
+    const int span = x_end - x_begin + 1;
+    if(span <= 0) return;
+
+    double E[3][kTileSize];
+    for(int y = y_begin; y <= y_end; ++y) {
+      const double py = y + 0.5;
+      for(int k=0;k<3;++k) {
+        const Edge& e = t.edges[k];
+        const double row_term = e.dx * (py - e.ay);
+        double* Ek = E[k];
+        #pragma omp simd
+        for(int j=0;j<span;++j) {
+          const double px = x_begin + j + 0.5;
+          Ek[j] = e.sign * (row_term - e.dy * (px - e.ax));
+        }
+      }
+
+      // GL rows start at the bottom
+      const int row_offset = (height - 1 - y) * width + x_begin;
+      int* face_row = &face_index_buffer[row_offset];
+      float* depth_row = &depth_buffer[row_offset];
+      float* bary_row = &barycentric_buffer[row_offset * 3];
+      for(int j=0;j<span;++j) {
+        const bool inside =
+          (E[0][j] > 0 || (E[0][j] == 0 && t.edges[0].top_left)) &&
+          (E[1][j] > 0 || (E[1][j] == 0 && t.edges[1].top_left)) &&
+          (E[2][j] > 0 || (E[2][j] == 0 && t.edges[2].top_left));
+        if(!inside) continue;
+
+        const double l0 = E[0][j] * t.inv_area, l1 = E[1][j] * t.inv_area, l2 = E[2][j] * t.inv_area;
+        const float z = l0 * t.z[0] + l1 * t.z[1] + l2 * t.z[2];
+        if(!(z < depth_row[j])) continue;
+
+        const double b0 = l0 * t.inv_w[0], b1 = l1 * t.inv_w[1], b2 = l2 * t.inv_w[2];
+        const double inv_sum = 1.0 / (b0 + b1 + b2);
+        depth_row[j] = z;
+        face_row[j] = t.face_index;
+        bary_row[j*3] = b0 * inv_sum;
+        bary_row[j*3+1] = b1 * inv_sum;
+        bary_row[j*3+2] = b2 * inv_sum;
+      }
+    }
+  }
+
+private:
+  int width, height;
+  Vector3d mesh_rotation, mesh_translation;
+  CameraParameters camera_params;
+
+  vector<int> face_index_buffer;
+  vector<float> barycentric_buffer;
+  vector<float> depth_buffer;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_MESHRASTERIZER_H
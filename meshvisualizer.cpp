@@ -24,6 +24,8 @@ void MeshVisualizer::initializeGL() {
   if(!image.isNull()) {
     CreateTexture();
   }
+
+  mesh_buffers.Update(mesh);
 }
 
 void MeshVisualizer::CreateTexture() {
@@ -176,40 +178,7 @@ void MeshVisualizer::paintGL() {
       glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, mat_shininess);
       glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specular);
 
-      glBegin(GL_TRIANGLES);
-      for (int i = 0; i < mesh.NumFaces(); ++i) {
-        auto face_i = mesh.face(i);
-        auto v0 = mesh.vertex(face_i[0]);
-        auto v1 = mesh.vertex(face_i[1]);
-        auto v2 = mesh.vertex(face_i[2]);
-        auto n0 = mesh.vertex_normal(face_i[0]);
-        auto n1 = mesh.vertex_normal(face_i[1]);
-        auto n2 = mesh.vertex_normal(face_i[2]);
-
-        auto set_diffuse_color_by_normal = [=](Vector3d n0) {
-          glm::dvec4 n = glm::transpose(glm::inverse(rotation_matrix)) * glm::dvec4(n0[0], n0[1], n0[2], 1.0);
-          if(n.z > 0) {
-            GLfloat mat_diffuse[] = {static_cast<float>(n.x + 1.0) * 0.5f,
-                                     static_cast<float>(n.y + 1.0) * 0.5f,
-                                     static_cast<float>(n.z + 1.0) * 0.5f,
-                                     static_cast<float>(face_alpha)};
-            glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
-          } else {
-            GLfloat mat_diffuse[] = {0.05, 0.05, 0.05, static_cast<float>(face_alpha)};
-            glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mat_diffuse);
-          }
-        };
-
-        //set_diffuse_color_by_normal(n0);
-        glNormal3dv(n0.data());glVertex3dv(v0.data());
-
-        //set_diffuse_color_by_normal(n1);
-        glNormal3dv(n1.data());glVertex3dv(v1.data());
-
-        //set_diffuse_color_by_normal(n2);
-        glNormal3dv(n2.data());glVertex3dv(v2.data());
-      }
-      glEnd();
+      mesh_buffers.Draw(MeshBuffers::Position | MeshBuffers::VertexNormal);
       glDisable(GL_CULL_FACE);
     }
 
@@ -217,17 +186,9 @@ void MeshVisualizer::paintGL() {
       /// Draw edges
       glColor3f(.25, .25, .25);
       glLineWidth(2.5);
-      for (int i = 0; i < mesh.NumFaces(); ++i) {
-        auto face_i = mesh.face(i);
-        auto v0 = mesh.vertex(face_i[0]);
-        auto v1 = mesh.vertex(face_i[1]);
-        auto v2 = mesh.vertex(face_i[2]);
-        glBegin(GL_LINE_LOOP);
-        glVertex3dv(v0.data());
-        glVertex3dv(v1.data());
-        glVertex3dv(v2.data());
-        glEnd();
-      }
+      glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+      mesh_buffers.Draw(MeshBuffers::Position);
+      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     }
 
     // Draw landmarks
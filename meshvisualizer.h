@@ -5,6 +5,7 @@
 #include <QKeyEvent>
 
 #include "basicmesh.h"
+#include "meshbuffers.h"
 #include "common.h"
 #include "constraints.h"
 #include "parameters.h"
@@ -45,6 +46,7 @@ protected:
 
 private:
   BasicMesh mesh;
+  MeshBuffers mesh_buffers;
   vector<Constraint2D> constraints;
   QImage image;
   GLuint image_tex;
@@ -0,0 +1,383 @@
+#ifndef MODELCONTAINER_HPP
+#define MODELCONTAINER_HPP
+
+#include "tensor.hpp"
+#include "mappedtensor.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Checksum {
+  // CRC-32 (IEEE 802.3, same as zlib)
+  inline uint32_t crc32(const void *data, size_t size, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool table_ready = [] {
+      for(uint32_t i=0;i<256;++i) {
+        uint32_t c = i;
+        for(int k=0;k<8;++k) c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+        table[i] = c;
+      }
+      return true;
+    }();
+    (void)table_ready;
+
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for(size_t i=0;i<size;++i) crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+}
+
+// Single file container for everything a reconstruction needs from the model:
+// the core tensor, the U matrices and the identity/expression priors.
+//
+// Layout:
+//   [Header, 64 bytes][Entry directory][payload 0][payload 1]...
+//
+// Every payload starts at a 64 byte aligned offset, so the core tensor can be
+// used in place through MappedTensor3. The header carries a byte order mark
+// and a checksum of itself and of the directory; each entry carries the
+// checksum of its payload. Files failing any of these checks are rejected.
+// Copied entries are checked on every read, mapped ones through
+// VerifyPayloadsOnce.
+class ModelContainer {
+public:
+  using DataType = MappedTensor3::DataType;
+
+  static const uint32_t kMagic = 0x434d4c4d;      // "MLMC"
+  static const uint32_t kVersion = 1;
+  static const uint32_t kByteOrderMark = 0x01020304;
+  static const size_t kAlignment = 64;
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_entries;
+    uint64_t directory_offset;
+    uint64_t file_size;
+    uint32_t directory_crc;
+    uint32_t header_crc;      // crc of all fields above
+    char reserved[24];
+  };
+  static_assert(sizeof(Header) == 64, "ModelContainer header must be 64 bytes");
+
+  struct Entry {
+    char name[32];
+    int32_t dtype;
+    int32_t ndims;
+    int64_t dims[3];
+    uint64_t offset;
+    uint64_t nbytes;
+    uint32_t crc;
+    char reserved[12];
+  };
+  static_assert(sizeof(Entry) == 96, "ModelContainer entry must be 96 bytes");
+
+  static size_t ElementSize(int32_t dtype) {
+    return dtype == MappedTensor3::Float32 ? sizeof(float) : sizeof(double);
+  }
+
+  static size_t AlignUp(size_t offset) {
+    return (offset + kAlignment - 1) / kAlignment * kAlignment;
+  }
+
+  static bool IsContainerFile(const string& filename) {
+    ifstream fin(filename, ios::in | ios::binary);
+    uint32_t magic = 0;
+    fin.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
+    return fin && magic == kMagic;
+  }
+
+  ModelContainer() : base(nullptr), file_size(0), file_mtime(0) {}
+
+  // Maps the whole file once and validates its header and directory. The
+  // payload checksums need a full read of the file, which would defeat the
+  // mapping, so they are only verified when asked for, see VerifyPayloads.
+  bool Open(const string& filename, bool verify_payloads = false) {
+    cout << "Opening model container " << filename << endl;
+    entries.clear();
+    region.reset();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+      cerr << "Failed to open model container " << filename << endl;
+      return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+      cerr << "Model container " << filename << " is truncated." << endl;
+      close(fd);
+      return false;
+    }
+    file_size = st.st_size;
+    file_mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    path = filename;
+    void *addr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+      cerr << "Failed to map model container " << filename << endl;
+      return false;
+    }
+    size_t mapped_size = file_size;
+    region = shared_ptr<void>(addr, [mapped_size](void *p) { munmap(p, mapped_size); });
+    base = static_cast<const char*>(addr);
+
+    auto reject = [&](const string& reason) {
+      cerr << "Rejecting model container " << filename << ": " << reason << endl;
+      entries.clear();
+      region.reset();
+      base = nullptr;
+      return false;
+    };
+
+    Header header;
+    memcpy(&header, base, sizeof(Header));
+    if(header.magic != kMagic) return reject("bad magic number");
+    if(header.byte_order != kByteOrderMark) return reject("unsupported byte order");
+    if(header.version != kVersion) return reject("unsupported version " + to_string(header.version));
+    if(header.header_crc != Checksum::crc32(&header, offsetof(Header, header_crc)))
+      return reject("header checksum mismatch");
+    if(header.file_size != file_size) return reject("file size mismatch, file is truncated");
+
+    // Bounds are checked without forming sums that could wrap around
+    if(header.num_entries > file_size / sizeof(Entry)) return reject("directory out of bounds");
+    size_t directory_size = sizeof(Entry) * header.num_entries;
+    if(header.directory_offset > file_size || directory_size > file_size - header.directory_offset)
+      return reject("directory out of bounds");
+    if(header.directory_crc != Checksum::crc32(base + header.directory_offset, directory_size))
+      return reject("directory checksum mismatch");
+
+    entries.resize(header.num_entries);
+    memcpy(entries.data(), base + header.directory_offset, directory_size);
+
+    for(auto& e : entries) {
+      e.name[sizeof(e.name)-1] = '\0';
+      if(e.dtype != MappedTensor3::Float32 && e.dtype != MappedTensor3::Float64)
+        return reject(string("bad data type for ") + e.name);
+      if(e.ndims < 1 || e.ndims > 3) return reject(string("bad dimensions for ") + e.name);
+      size_t count = 1;
+      for(int i=0;i<e.ndims;++i) {
+        if(e.dims[i] < 0) return reject(string("bad dimensions for ") + e.name);
+        if(e.dims[i] > 0 && count > file_size / e.dims[i])
+          return reject(string("size mismatch for ") + e.name);
+        count *= e.dims[i];
+      }
+      if(count * ElementSize(e.dtype) != e.nbytes)
+        return reject(string("size mismatch for ") + e.name);
+      if(e.offset % kAlignment != 0) return reject(string("misaligned payload for ") + e.name);
+      if(e.offset > file_size || e.nbytes > file_size - e.offset)
+        return reject(string("payload out of bounds for ") + e.name);
+    }
+
+    if(verify_payloads && !VerifyPayloads()) return reject("payload checksum mismatch");
+
+    cout << "done. " << entries.size() << " entries." << endl;
+    return true;
+  }
+
+  // Checks the payload checksums of an open container, reads the whole file
+  bool VerifyPayloads() const {
+    for(auto& e : entries) {
+      if(e.crc != Checksum::crc32(base + e.offset, e.nbytes)) {
+        cerr << "Payload checksum mismatch for " << e.name << endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Checks the payload checksums the first time a file is opened. The size
+  // and the modification time (in nanoseconds) of a verified file are written
+  // to <filename>.verified, later opens of the unchanged file skip the read.
+  bool VerifyPayloadsOnce() const {
+    const string stamp_filename = path + ".verified";
+    const string stamp = to_string(file_size) + " " + to_string(file_mtime);
+    {
+      ifstream fin(stamp_filename);
+      string line;
+      if(getline(fin, line) && line == stamp) return true;
+    }
+    if(!VerifyPayloads()) return false;
+
+    // Written under a unique name and renamed, a failure only costs another
+    // check on the next open
+    const string tmp_filename = stamp_filename + "." + to_string(getpid()) + ".tmp";
+    {
+      ofstream fout(tmp_filename);
+      fout << stamp << endl;
+    }
+    if(std::rename(tmp_filename.c_str(), stamp_filename.c_str()) != 0) {
+      std::remove(tmp_filename.c_str());
+    }
+    return true;
+  }
+
+  bool Has(const string& name) const {
+    return Find(name) != nullptr;
+  }
+
+  const Entry* Find(const string& name) const {
+    for(auto& e : entries) {
+      if(name == e.name) return &e;
+    }
+    return nullptr;
+  }
+
+  // Zero-copy view of a 3 dimensional entry
+  bool GetTensor(const string& name, MappedTensor3& t) const {
+    const Entry *e = Find(name);
+    if(e == nullptr || e->ndims != 3) {
+      cerr << "Model container has no tensor named " << name << endl;
+      return false;
+    }
+    t.Attach(region, base + e->offset, static_cast<DataType>(e->dtype),
+             e->dims[0], e->dims[1], e->dims[2]);
+    return true;
+  }
+
+  // Copies a 1 or 2 dimensional entry, vectors come out as n x 1 matrices.
+  // The copy reads the whole payload anyway, so its checksum is checked too.
+  bool GetMatrix(const string& name, MatrixXd& M) const {
+    const Entry *e = Find(name);
+    if(e == nullptr || e->ndims > 2) {
+      cerr << "Model container has no matrix named " << name << endl;
+      return false;
+    }
+    if(e->crc != Checksum::crc32(base + e->offset, e->nbytes)) {
+      cerr << "Payload checksum mismatch for " << name << endl;
+      return false;
+    }
+    int rows = e->dims[0], cols = (e->ndims == 2) ? e->dims[1] : 1;
+    if(e->dtype == MappedTensor3::Float32) {
+      M = Map<const MatrixXf>(reinterpret_cast<const float*>(base + e->offset), rows, cols).cast<double>();
+    } else {
+      M = Map<const MatrixXd>(reinterpret_cast<const double*>(base + e->offset), rows, cols);
+    }
+    return true;
+  }
+
+  bool GetVector(const string& name, VectorXd& v) const {
+    MatrixXd M;
+    if(!GetMatrix(name, M) || M.cols() != 1) return false;
+    v = M.col(0);
+    return true;
+  }
+
+private:
+  shared_ptr<void> region;
+  const char *base;
+  size_t file_size;
+  int64_t file_mtime;
+  string path;
+  vector<Entry> entries;
+};
+
+// Collects named arrays and writes them as a ModelContainer file
+class ModelContainerWriter {
+public:
+  using DataType = MappedTensor3::DataType;
+
+  void AddTensor(const string& name, const Tensor3& t, DataType dtype = MappedTensor3::Float64) {
+    vector<double> values(static_cast<size_t>(t.layers()) * t.rows() * t.cols());
+    // Same layout as Tensor3::Write and MappedTensor3
+    for(int i=0, idx=0;i<t.layers();++i) {
+      for(int k=0;k<t.cols();++k) {
+        for(int j=0;j<t.rows();++j, ++idx) values[idx] = t(i, j, k);
+      }
+    }
+    Add(name, dtype, {t.layers(), t.rows(), t.cols()}, values);
+  }
+
+  void AddMatrix(const string& name, const MatrixXd& M, DataType dtype = MappedTensor3::Float64) {
+    Add(name, dtype, {M.rows(), M.cols()}, vector<double>(M.data(), M.data() + M.size()));
+  }
+
+  void AddVector(const string& name, const VectorXd& v, DataType dtype = MappedTensor3::Float64) {
+    Add(name, dtype, {v.size()}, vector<double>(v.data(), v.data() + v.size()));
+  }
+
+  bool Write(const string& filename) const {
+    try {
+      cout << "writing model container to file " << filename << endl;
+      ModelContainer::Header header;
+      memset(&header, 0, sizeof(header));
+      header.magic = ModelContainer::kMagic;
+      header.version = ModelContainer::kVersion;
+      header.byte_order = ModelContainer::kByteOrderMark;
+      header.num_entries = entries.size();
+      header.directory_offset = sizeof(header);
+
+      vector<ModelContainer::Entry> directory = entries;
+      size_t offset = ModelContainer::AlignUp(sizeof(header) + sizeof(ModelContainer::Entry) * entries.size());
+      for(size_t i=0;i<directory.size();++i) {
+        directory[i].offset = offset;
+        offset = ModelContainer::AlignUp(offset + directory[i].nbytes);
+      }
+      header.file_size = offset;
+      header.directory_crc = Checksum::crc32(directory.data(), sizeof(ModelContainer::Entry) * directory.size());
+      header.header_crc = Checksum::crc32(&header, offsetof(ModelContainer::Header, header_crc));
+
+      fstream fout;
+      fout.open(filename, ios::out | ios::binary);
+      fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      fout.write(reinterpret_cast<const char*>(directory.data()), sizeof(ModelContainer::Entry) * directory.size());
+
+      size_t pos = sizeof(header) + sizeof(ModelContainer::Entry) * directory.size();
+      const vector<char> padding(ModelContainer::kAlignment, 0);
+      for(size_t i=0;i<directory.size();++i) {
+        fout.write(padding.data(), directory[i].offset - pos);
+        fout.write(payloads[i].data(), payloads[i].size());
+        pos = directory[i].offset + payloads[i].size();
+      }
+      fout.write(padding.data(), header.file_size - pos);
+
+      fout.close();
+      cout << "done." << endl;
+      return fout.good();
+    }
+    catch(...) {
+      cerr << "Failed to write model container to file " << filename << endl;
+      return false;
+    }
+  }
+
+private:
+  void Add(const string& name, DataType dtype, const vector<int64_t>& dims, const vector<double>& values) {
+    assert(name.size() < sizeof(ModelContainer::Entry::name));
+    ModelContainer::Entry e;
+    memset(&e, 0, sizeof(e));
+    strncpy(e.name, name.c_str(), sizeof(e.name) - 1);
+    e.dtype = dtype;
+    e.ndims = dims.size();
+    for(size_t i=0;i<dims.size();++i) e.dims[i] = dims[i];
+
+    vector<char> payload;
+    if(dtype == MappedTensor3::Float32) {
+      vector<float> fvalues(values.begin(), values.end());
+      payload.assign(reinterpret_cast<const char*>(fvalues.data()),
+                     reinterpret_cast<const char*>(fvalues.data() + fvalues.size()));
+    } else {
+      payload.assign(reinterpret_cast<const char*>(values.data()),
+                     reinterpret_cast<const char*>(values.data() + values.size()));
+    }
+    e.nbytes = payload.size();
+    e.crc = Checksum::crc32(payload.data(), payload.size());
+
+    entries.push_back(e);
+    payloads.push_back(std::move(payload));
+  }
+
+  vector<ModelContainer::Entry> entries;
+  vector<vector<char>> payloads;
+};
+
+#endif // MODELCONTAINER_HPP
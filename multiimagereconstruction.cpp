@@ -34,7 +34,8 @@ int main(int argc, char *argv[]) {
   ("direct_multi_recon", "Use direct multi-recon")
   ("no_selection", "Disable selection")
   ("no_failure_detection", "Disable feature points failure detection")
-  ("no_progressive", "Diable progressive reconstruction");
+  ("no_progressive", "Diable progressive reconstruction")
+  ("jobs", po::value<int>()->default_value(0), "Number of images reconstructed concurrently, 0 uses all cores");
 
   po::variables_map vm;
 
@@ -69,7 +70,9 @@ int main(int argc, char *argv[]) {
   // Create reconstructor and load the common resources
   MultiImageReconstructor<Constraint2D> recon;
   recon.LoadModel(model_filename);
-  recon.LoadPriors(id_prior_filename, exp_prior_filename);
+  // A model container carries the priors as well
+  if(ModelContainer::IsContainerFile(model_filename)) recon.LoadPriors(model_filename);
+  else recon.LoadPriors(id_prior_filename, exp_prior_filename);
   recon.SetMesh(mesh);
   recon.SetContourIndices(contour_indices);
   recon.SetIndices(landmarks);
@@ -78,6 +81,7 @@ int main(int argc, char *argv[]) {
   recon.SetFailureDetectionState(!vm.count("no_failure_detection"));
   recon.SetProgressiveReconState(!vm.count("no_progressive"));
   recon.SetDirectMultiRecon(vm.count("direct_multi_recon"));
+  recon.SetNumJobs(vm["jobs"].as<int>());
 
   // Parse the setting file and load image related resources
   fs::path settings_filepath(settings_filename);
@@ -88,8 +92,7 @@ int main(int argc, char *argv[]) {
     fs::path pts_filename = settings_filepath.parent_path() / fs::path(p.second);
     cout << "[" << image_filename << ", " << pts_filename << "]" << endl;
 
-    auto image_points_pair = LoadImageAndPoints(image_filename.string(), pts_filename.string(), false);
-    recon.AddImagePointsPair(image_filename.string(), image_points_pair);
+    if(!recon.AddImage(image_filename.string(), pts_filename.string())) return 1;
   }
 
   {
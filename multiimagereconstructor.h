@@ -19,6 +19,9 @@
 #include "common.h"
 #include "constraints.h"
 #include "costfunctions.h"
+#include "framesource.h"
+#include "jointidentitysolver.h"
+#include "meshrasterizer.h"
 #include "multilinearmodel.h"
 #include "parameters.h"
 #include "singleimagereconstructor.hpp"
@@ -32,6 +35,8 @@
 #include "boost/filesystem/operations.hpp"
 #include "boost/filesystem/path.hpp"
 
+#include "omp.h"
+
 namespace fs = boost::filesystem;
 
 using namespace Eigen;
@@ -83,31 +88,6 @@ namespace {
     return glm::dvec3(r, g, b);
   }
 
-  inline pair<set<int>, vector<int>> FindTrianglesIndices(const QImage& img) {
-    int w = img.width(), h = img.height();
-    set<int> S;
-    vector<int> indices_map(w*h);
-    for(int i=0, pidx = 0;i<h;++i) {
-      for(int j=0;j<w;++j, ++pidx) {
-        QRgb pix = img.pixel(j, i);
-        unsigned char r = static_cast<unsigned char>(qRed(pix));
-        unsigned char g = static_cast<unsigned char>(qGreen(pix));
-        unsigned char b = static_cast<unsigned char>(qBlue(pix));
-
-        if(r == 0 && g == 0 && b == 0) {
-          indices_map[pidx] = -1;
-          continue;
-        }
-        else {
-          int idx;
-          decode_index(r, g, b, idx);
-          S.insert(idx);
-          indices_map[pidx] = idx;
-        }
-      }
-    }
-    return make_pair(S, indices_map);
-  }
   static QImage TransferColor(const QImage& source, const QImage& target,
                               const vector<int>& valid_pixels_s,
                               const vector<int>& valid_pixels_t) {
@@ -228,21 +208,30 @@ template <typename Constraint>
 class MultiImageReconstructor {
 public:
   MultiImageReconstructor():
+    recon_context(make_shared<ReconstructionContext>()),
     enable_selection(true),
     enable_failure_detection(true),
-    direct_multi_recon(false) {}
+    direct_multi_recon(false),
+    num_jobs(0) {}
 
+  // The model and the priors are loaded once into the context shared by all
+  // single image reconstruction jobs
   void LoadModel(const string& filename) {
-    model = MultilinearModel(filename);
-    single_recon.LoadModel(filename);
+    recon_context->LoadModel(filename);
+    model = recon_context->model;
+    landmark_cache.Clear();
   }
   void LoadPriors(const string& filename_id, const string& filename_exp) {
-    prior.load(filename_id, filename_exp);
-    single_recon.LoadPriors(filename_id, filename_exp);
+    recon_context->LoadPriors(filename_id, filename_exp);
+    prior = recon_context->prior;
+  }
+  void LoadPriors(const string& filename) {
+    recon_context->LoadPriors(filename);
+    prior = recon_context->prior;
   }
   void SetContourIndices(const vector<vector<int>>& contour_indices_in) {
     contour_indices = contour_indices_in;
-    single_recon.SetContourIndices(contour_indices_in);
+    recon_context->SetContourIndices(contour_indices_in);
   }
   void SetMesh(const BasicMesh& mesh) {
     template_mesh = mesh;
@@ -251,9 +240,11 @@ public:
     init_indices = indices;
   }
 
-  void AddImagePointsPair(const string& filename, const pair<QImage, vector<Constraint>>& p) {
-    image_filenames.push_back(filename);
-    image_points_pairs.push_back(p);
+  // The landmarks are loaded right away, the image only when it is needed
+  bool AddImage(const string& image_filename, const string& pts_filename) {
+    if(!frames.AddFrame(image_filename, pts_filename)) return false;
+    image_filenames.push_back(image_filename);
+    return true;
   }
 
   bool Reconstruct();
@@ -262,9 +253,19 @@ public:
   const Vector3d& GetTranslation(int imgidx) const { return param_sets[imgidx].model.T; }
   const VectorXd& GetIdentityWeights(int imgidx) const { return param_sets[imgidx].model.Wid; }
   const VectorXd& GetExpressionWeights(int imgidx) const { return param_sets[imgidx].model.Wexp_FACS; }
-  const Tensor1& GetGeometry(int imgidx) const {
-    model.ApplyWeights(GetIdentityWeights(imgidx), GetExpressionWeights(imgidx));
-    return model.GetTM();
+  Tensor1 GetGeometry(int imgidx) const {
+    return model.EvaluateBatch(param_sets[imgidx].model.Wid, param_sets[imgidx].model.Wexp).col(0);
+  }
+  // Geometry of all images in one pass over the core, one column per image
+  MatrixXd GetGeometries() const {
+    const int num_images = param_sets.size();
+    MatrixXd Wid(param_sets.front().model.Wid.size(), num_images);
+    MatrixXd Wexp(param_sets.front().model.Wexp.size(), num_images);
+    for(int i=0;i<num_images;++i) {
+      Wid.col(i) = param_sets[i].model.Wid;
+      Wexp.col(i) = param_sets[i].model.Wexp;
+    }
+    return model.EvaluateBatch(Wid, Wexp);
   }
   const CameraParameters GetCameraParameters(int imgidx) const { return param_sets[imgidx].cam; }
   const vector<int> GetIndices(int imgidx) const { return param_sets[imgidx].indices; }
@@ -280,20 +281,22 @@ public:
   void SetFailureDetectionState(bool val) { enable_failure_detection = val; }
   void SetDirectMultiRecon(bool val) { direct_multi_recon = val; }
   void SetProgressiveReconState(bool val) { enable_progressive_recon = val; }
+  // Number of images reconstructed concurrently, 0 uses all cores
+  void SetNumJobs(int val) { num_jobs = val; }
 
 protected:
   void VisualizeReconstructionResult(const fs::path& folder, int i, bool scale_output=true) {
     // Visualize the reconstruction results
     #if 0
     MeshVisualizer w("reconstruction result", param_sets[i].mesh);
-    w.BindConstraints(image_points_pairs[i].second);
-    w.BindImage(image_points_pairs[i].first);
+    w.BindConstraints(frames.points(i));
+    w.BindImage(frames.image(i));
     w.BindLandmarks(init_indices);
 
     w.BindUpdatedLandmarks(param_sets[i].indices);
     w.SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
     w.SetCameraParameters(param_sets[i].cam);
-    w.resize(image_points_pairs[i].first.width(), image_points_pairs[i].first.height());
+    w.resize(frames.width(i), frames.height(i));
     w.show();
     w.paintGL();
     w.update();
@@ -303,8 +306,8 @@ protected:
 
     recon_image.save( (folder / fs::path(image_path.stem().string() + ".png")).string().c_str() );
     #else
-    int imgw = image_points_pairs[i].first.width();
-    int imgh = image_points_pairs[i].first.height();
+    int imgw = frames.width(i);
+    int imgh = frames.height(i);
     if(scale_output) {
       const int target_size = 640;
       double scale = static_cast<double>(target_size) / imgw;
@@ -323,7 +326,7 @@ protected:
     visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
     visualizer.SetRenderMode(OffscreenMeshVisualizer::MeshAndImage);
     visualizer.BindMesh(param_sets[i].mesh);
-    visualizer.BindImage(image_points_pairs[i].first);
+    visualizer.BindImage(frames.image(i));
     visualizer.SetCameraParameters(param_sets[i].cam);
     visualizer.SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
     visualizer.SetIndexEncoded(false);
@@ -338,6 +341,7 @@ protected:
 
 private:
   MultilinearModel model;
+  MultilinearModelCache landmark_cache;
   MultilinearModelPrior prior;
   vector<vector<int>> contour_indices;
   vector<int> init_indices;
@@ -355,8 +359,8 @@ private:
     string img_filename;
   };
 
-  // Input image points pairs
-  vector<pair<QImage, vector<Constraint>>> image_points_pairs;
+  // Input images and points, decoded on demand
+  FrameSource frames;
   vector<string> image_filenames;
 
   // AAM model for consistent set selection
@@ -365,13 +369,14 @@ private:
   // A set of parameters for each image
   vector<ParameterSet> param_sets;
 
-  // The worker for single image reconstruction
-  SingleImageReconstructor<Constraint> single_recon;
+  // Model data shared by the single image reconstruction jobs
+  shared_ptr<ReconstructionContext> recon_context;
 
   bool enable_selection;
   bool enable_failure_detection;
   bool enable_progressive_recon;
   bool direct_multi_recon;
+  int num_jobs;
 };
 
 namespace {
@@ -463,15 +468,15 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
   cout << "directory created ..." << endl;
 
   // Initialize the parameter sets
-  param_sets.resize(image_points_pairs.size());
+  param_sets.resize(frames.size());
   for(size_t i=0;i<param_sets.size();++i) {
     auto& params = param_sets[i];
     params.img_filename = fs::path(image_filenames[i]).filename().string();
     params.indices = init_indices;
     params.mesh = template_mesh;
 
-    const int image_width = image_points_pairs[i].first.width();
-    const int image_height = image_points_pairs[i].first.height();
+    const int image_width = frames.width(i);
+    const int image_height = frames.height(i);
 
     // camera parameters
     cout << image_width << "x" << image_height << endl;
@@ -482,12 +487,12 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
     params.model = ModelParameters::DefaultParameters(prior.Uid, prior.Uexp);
 
     // reconstruction parameters
-    params.recon.cons = image_points_pairs[i].second;
+    params.recon.cons = frames.points(i);
     params.recon.imageWidth = image_width;
     params.recon.imageHeight = image_height;
   }
 
-  const int num_images = image_points_pairs.size();
+  const int num_images = frames.size();
 
   // Initialize AAM model
   auto constraints_to_mat = [=](const vector<Constraint>& constraints, int h) {
@@ -502,14 +507,13 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
 
   vector<int> inliers;
   if(enable_failure_detection) {
-    vector<QImage> images(image_points_pairs.size());
-    vector<cv::Mat> points(image_points_pairs.size());
+    vector<QImage> images(frames.size());
+    vector<cv::Mat> points(frames.size());
 
     // Collect input images and points
-    for(int i=0;i<image_points_pairs.size();++i) {
-      images[i] = image_points_pairs[i].first;
-      points[i] = constraints_to_mat(image_points_pairs[i].second,
-                                     image_points_pairs[i].first.height());
+    for(int i=0;i<frames.size();++i) {
+      images[i] = frames.image(i);
+      points[i] = constraints_to_mat(frames.points(i), frames.height(i));
     }
 
     aam.SetOutputPath(result_path.string());
@@ -527,6 +531,13 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
 
   VectorXd identity_centroid;
 
+  // Pack the landmarks once for all jobs, the context is read only from here on
+  recon_context->CacheLandmarks(init_indices);
+  landmark_cache = recon_context->landmark_cache;
+
+  const int jobs = num_jobs > 0 ? num_jobs : omp_get_max_threads();
+  cout << "Reconstructing " << jobs << " images concurrently." << endl;
+
   // Main reconstruction loop
   //  1. Use single image reconstructor to do per-image reconstruction first
   //  2. Select a consistent set of images for joint reconstruction
@@ -560,34 +571,53 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
 
     fs::path step_single_recon_result_path = step_result_path / fs::path("single_recon");
     safe_create(step_single_recon_result_path);
-    for(int i=0;i<num_images;++i) {
-      single_recon.SetMesh(param_sets[i].mesh);
-      single_recon.SetIndices(param_sets[i].indices);
-      single_recon.SetImageSize(param_sets[i].recon.imageWidth, param_sets[i].recon.imageHeight);
-      single_recon.SetConstraints(param_sets[i].recon.cons);
-
-      single_recon.SetInitialParameters(param_sets[i].model, param_sets[i].cam);
-      if(iters_main_loop > 1) single_recon.SetIdentityPrior(identity_centroid);
-
-      // Perform reconstruction
-      if(!direct_multi_recon) {
-        boost::timer::auto_cpu_timer t("Single image reconstruction finished in %w seconds.\n");
-        single_recon.Reconstruct(opt_params);
-      } else continue;
-
-      // Store results
-      auto tm = single_recon.GetGeometry();
-      param_sets[i].mesh.UpdateVertices(tm);
-      param_sets[i].mesh.ComputeNormals();
-      param_sets[i].model = single_recon.GetModelParameters();
-      param_sets[i].indices = single_recon.GetIndices();
-      param_sets[i].cam = single_recon.GetCameraParameters();
-
-      if (true) {
-        VisualizeReconstructionResult(step_single_recon_result_path, i);
+
+    // The images are independent given the identity prior. Idle threads pick
+    // up the next image and every result goes to its own param_sets entry, so
+    // the outcome does not depend on the scheduling.
+    if(!direct_multi_recon) {
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(jobs)
+      for(int i=0;i<num_images;++i) {
+        SingleImageReconstructor<Constraint> single_recon(recon_context);
+        single_recon.SetRandomSeed(iters_main_loop * num_images + i);
+        single_recon.SetMesh(param_sets[i].mesh);
+        single_recon.SetIndices(param_sets[i].indices);
+        single_recon.SetImageSize(param_sets[i].recon.imageWidth, param_sets[i].recon.imageHeight);
+        single_recon.SetConstraints(param_sets[i].recon.cons);
+
+        single_recon.SetInitialParameters(param_sets[i].model, param_sets[i].cam);
+        if(iters_main_loop > 1) {
+          // From the second round on the identity comes from the joint step
+          single_recon.SetIdentityPrior(identity_centroid);
+          single_recon.SetOptimizationMode(
+            static_cast<typename SingleImageReconstructor<Constraint>::OptimizationMode>(
+              SingleImageReconstructor<Constraint>::Pose
+              | SingleImageReconstructor<Constraint>::Expression
+              | SingleImageReconstructor<Constraint>::FocalLength));
+        }
+
+        // Perform reconstruction
+        {
+          boost::timer::auto_cpu_timer t("Single image reconstruction finished in %w seconds.\n");
+          single_recon.Reconstruct(opt_params);
+        }
+
+        // Store results
+        auto tm = single_recon.GetGeometry();
+        param_sets[i].mesh.UpdateVertices(tm);
+        param_sets[i].mesh.ComputeNormals();
+        param_sets[i].model = single_recon.GetModelParameters();
+        param_sets[i].indices = single_recon.GetIndices();
+        param_sets[i].cam = single_recon.GetCameraParameters();
+
         fs::path image_path = fs::path(image_filenames[i]);
         single_recon.SaveReconstructionResults( (step_single_recon_result_path / fs::path(image_path.stem().string() + ".res")).string());
       }
+
+      // The offscreen visualizer owns a GL context, render on this thread only
+      for(int i=0;i<num_images;++i) {
+        VisualizeReconstructionResult(step_single_recon_result_path, i);
+      }
     }
 
     // TODO Parameters estimation step, choose a consistent set of images for joint
@@ -673,24 +703,17 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
           {
             for(int img_i=0;img_i<num_images;++img_i) {
               const auto& mesh = param_sets[img_i].mesh;
+              const QImage input_image = frames.image(img_i);
+
+              // for each image bundle, rasterize the mesh with culling to get the visible triangles
+              MeshRasterizer rasterizer(frames.width(img_i), frames.height(img_i));
+              rasterizer.SetCameraParameters(param_sets[img_i].cam);
+              rasterizer.SetMeshRotationTranslation(param_sets[img_i].model.R, param_sets[img_i].model.T);
+              rasterizer.Rasterize(param_sets[img_i].mesh);
 
-              // for each image bundle, render the mesh to FBO with culling to get the visible triangles
-              OffscreenMeshVisualizer visualizer(image_points_pairs[img_i].first.width(),
-                                                 image_points_pairs[img_i].first.height());
-              visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
-              visualizer.SetRenderMode(OffscreenMeshVisualizer::Mesh);
-              visualizer.BindMesh(param_sets[img_i].mesh);
-              visualizer.SetCameraParameters(param_sets[img_i].cam);
-              visualizer.SetMeshRotationTranslation(param_sets[img_i].model.R, param_sets[img_i].model.T);
-              visualizer.SetIndexEncoded(true);
-              visualizer.SetEnableLighting(false);
-              QImage img = visualizer.Render();
-              //img.save("mesh.png");
-
-              // find the visible triangles from the index map
-              auto triangles_indices_pair = FindTrianglesIndices(img);
-              set<int> triangles = triangles_indices_pair.first;
-              face_indices_maps.push_back(triangles_indices_pair.second);
+              // the visible triangles and the index map
+              set<int> triangles = rasterizer.VisibleFaces();
+              face_indices_maps.push_back(rasterizer.face_indices());
               cerr << "triangles = " << triangles.size() << endl;
 
               // get the projection parameters
@@ -706,7 +729,7 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
               // FOR DEBUGGING
               #if 0
               // for each visible triangle, compute the coordinates of its 3 corners
-              QImage img_vertices = img;
+              QImage img_vertices = input_image;
               vector<vector<glm::dvec3>> triangles_projected;
               for(auto tidx : triangles) {
                 auto face_i = mesh.face(tidx);
@@ -751,7 +774,7 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
                     glm::dvec3 v_img = ProjectPoint(glm::dvec3(v[0], v[1], v[2]), Mview, param_sets[img_i].cam);
 
                     // take the pixel from the input image through bilinear sampling
-                    glm::dvec3 texel = bilinear_sample(image_points_pairs[img_i].first, v_img.x, image_points_pairs[img_i].first.height()-1-v_img.y);
+                    glm::dvec3 texel = bilinear_sample(input_image, v_img.x, input_image.height()-1-v_img.y);
 
                     if(texel.r < 0 && texel.g < 0 && texel.b < 0) continue;
 
@@ -838,11 +861,15 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
 
         // Rendering the albedo to each image
         vector<QImage> albedo_images(num_images);
-        //#pragma omp parallel for
-        for(int i=0;i<num_images;++i) {
+
+        // Render a few images ahead on the render queue, so comparing the
+        // textures of image i overlaps rendering the following ones
+        OffscreenRenderQueue render_queue;
+        vector<future<OffscreenRenderQueue::RenderResult>> albedo_renders(num_images);
+        auto submit_albedo_render = [&](int i) {
           // for each image bundle, render the mesh to FBO with culling to get the visible triangles
-          OffscreenMeshVisualizer visualizer(image_points_pairs[i].first.width(),
-                                             image_points_pairs[i].first.height());
+          OffscreenMeshVisualizer visualizer(frames.width(i),
+                                             frames.height(i));
           visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
           visualizer.SetRenderMode(OffscreenMeshVisualizer::TexturedMesh);
           visualizer.BindMesh(param_sets[i].mesh);
@@ -850,15 +877,23 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
           visualizer.SetCameraParameters(param_sets[i].cam);
           visualizer.SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
           visualizer.SetFacesToRender(valid_faces_indices);
+          albedo_renders[i] = render_queue.Submit(move(visualizer));
+        };
+        const int render_lookahead = 4;
+        for(int i=0;i<min(render_lookahead, num_images);++i) submit_albedo_render(i);
+
+        for(int i=0;i<num_images;++i) {
+          if(i + render_lookahead < num_images) submit_albedo_render(i + render_lookahead);
 
           vector<float> depth_i;
-          tie(albedo_images[i],depth_i) = visualizer.RenderWithDepth();
+          tie(albedo_images[i],depth_i) = albedo_renders[i].get();
 
           auto unpack_pixel = [](QRgb pix) {
             return Vector3d(qRed(pix)/255.0, qGreen(pix)/255.0, qBlue(pix)/255.0);
           };
-          int img_w = image_points_pairs[i].first.width();
-          int img_h = image_points_pairs[i].first.height();
+          const QImage input_image = frames.image(i);
+          int img_w = frames.width(i);
+          int img_h = frames.height(i);
 
           vector<int> valid_pixels_map_i;
           for(int y=0;y<img_h;++y) {
@@ -872,7 +907,7 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
             }
           }
 
-          albedo_images[i] = TransferColor(albedo_images[i], image_points_pairs[i].first,
+          albedo_images[i] = TransferColor(albedo_images[i], input_image,
                                            valid_pixels_map_i, valid_pixels_map_i);
           #if DEBUG_RECON
           albedo_images[i].save( (step_result_path / fs::path("albedo_" + std::to_string(i) + ".png")).string().c_str() );
@@ -895,7 +930,7 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
                 #endif
                 valid_count++;
                 QRgb pix1 = albedo_images[i].pixel(x, y);
-                QRgb pix2 = image_points_pairs[i].first.pixel(x, y);
+                QRgb pix2 = input_image.pixel(x, y);
                 auto p1 = unpack_pixel(pix1);
                 auto p2 = unpack_pixel(pix2);
                 double dr = p1[0] - p2[0];
@@ -996,7 +1031,11 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
       fs::path joint_pre_result_path = step_result_path / fs::path("joint_recon_" + to_string(iters_joint_optimization) + "_pre");
       safe_create(joint_pre_result_path);
 
-      for(auto i : consistent_set) {
+      #pragma omp parallel for schedule(dynamic, 1) num_threads(jobs)
+      for(int set_i=0;set_i<consistent_set.size();++set_i) {
+        const int i = consistent_set[set_i];
+        SingleImageReconstructor<Constraint> single_recon(recon_context);
+        single_recon.SetRandomSeed(iters_main_loop * num_images + i);
         single_recon.SetMesh(param_sets[i].mesh);
         single_recon.SetIndices(param_sets[i].indices);
         single_recon.SetImageSize(param_sets[i].recon.imageWidth, param_sets[i].recon.imageHeight);
@@ -1019,11 +1058,11 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
         param_sets[i].model = single_recon.GetModelParameters();
         param_sets[i].indices = single_recon.GetIndices();
         param_sets[i].cam = single_recon.GetCameraParameters();
+      }
 
-        if (true) {
-          // Visualize the reconstruction results
-          VisualizeReconstructionResult(joint_pre_result_path, i);
-        }
+      // Visualize the reconstruction results
+      for(auto i : consistent_set) {
+        VisualizeReconstructionResult(joint_pre_result_path, i);
       }
 
       if((iters_joint_optimization == num_iters_joint_optimization - 1) && (iters_main_loop == max_iters_main_loop)) {
@@ -1036,15 +1075,54 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
         fs::path joint_post_result_path = step_result_path / fs::path("joint_recon_" + to_string(iters_joint_optimization) + "_post");
         safe_create(joint_post_result_path);
 
-        ceres::Problem problem;
         VectorXd params = param_sets[0].model.Wid;
 
+#if USE_JOINT_IDENTITY_SOLVER
+        // Pack the landmarks of all images up front, the cache is not thread safe
+        for(auto i : consistent_set) landmark_cache.Update(model, param_sets[i].indices);
+
+        JointIdentitySolver solver(prior.Wid_avg, prior.inv_sigma_Wid,
+                                   prior.weight_Wid * consistent_set.size(),
+                                   consistent_set.size());
+
+        // Add constraints from each image
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int set_i=0;set_i<consistent_set.size();++set_i) {
+          const int i = consistent_set[set_i];
+          vector<MultilinearModel> model_projected_i(param_sets[i].indices.size());
+          for(size_t j=0;j<param_sets[i].indices.size();++j) {
+            model_projected_i[j] = landmark_cache.GetModel(param_sets[i].indices[j]);
+            model_projected_i[j].ApplyWeights(param_sets[i].model.Wid, param_sets[i].model.Wexp);
+          }
+
+          glm::dmat4 Rmat_i = glm::eulerAngleYXZ(param_sets[i].model.R[0], param_sets[i].model.R[1],
+                                                 param_sets[i].model.R[2]);
+          glm::dmat4 Tmat_i = glm::translate(glm::dmat4(1.0),
+                                             glm::dvec3(param_sets[i].model.T[0],
+                                                        param_sets[i].model.T[1],
+                                                        param_sets[i].model.T[2]));
+          glm::dmat4 Mview_i = Tmat_i * Rmat_i;
+
+          double puple_distance = glm::distance(
+            0.5 * (param_sets[i].recon.cons[28].data + param_sets[i].recon.cons[30].data),
+            0.5 * (param_sets[i].recon.cons[32].data + param_sets[i].recon.cons[34].data));
+          double weight_i = 100.0 / puple_distance;
+
+          solver.SetImage(set_i, model_projected_i, param_sets[i].recon.cons, Mview_i, Rmat_i,
+                          param_sets[i].cam, weight_i);
+        }
+
+        solver.Solve(params);
+#else
+        ceres::Problem problem;
+
         // Add constraints from each image
         for(auto i : consistent_set) {
           // Create a projected model first
+          landmark_cache.Update(model, param_sets[i].indices);
           vector<MultilinearModel> model_projected_i(param_sets[i].indices.size());
           for(size_t j=0;j<param_sets[i].indices.size();++j) {
-            model_projected_i[j] = model.project(vector<int>(1, param_sets[i].indices[j]));
+            model_projected_i[j] = landmark_cache.GetModel(param_sets[i].indices[j]);
             model_projected_i[j].ApplyWeights(param_sets[i].model.Wid, param_sets[i].model.Wexp);
           }
 
@@ -1063,6 +1141,12 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
           double weight_i = 100.0 / puple_distance;
 
           // Add per-vertex constraints
+#if USE_ANALYTIC_COST_FUNCTIONS
+          ceres::CostFunction * cost_function = new IdentityCostFunction_stacked(
+            model_projected_i, param_sets[i].recon.cons, Mview_i, Rmat_i,
+            param_sets[i].cam, weight_i);
+          problem.AddResidualBlock(cost_function, NULL, params.data());
+#else
           for(size_t j=0;j<param_sets[i].indices.size();++j) {
             ceres::CostFunction * cost_function = new IdentityCostFunction_analytic(
               model_projected_i[j], param_sets[i].recon.cons[j], params.size(), Mview_i, Rmat_i,
@@ -1070,6 +1154,7 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
 
             problem.AddResidualBlock(cost_function, NULL, params.data());
           }
+#endif
         }
 
         // Add prior constraint
@@ -1087,6 +1172,7 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
             "[Identity optimization] Problem solve time = %w seconds.\n");
           ceres::Solver::Options options;
           options.max_num_iterations = 3;
+          options.check_gradients = CHECK_ANALYTIC_COST_FUNCTIONS;
           options.minimizer_type = ceres::LINE_SEARCH;
           options.line_search_direction_type = ceres::LBFGS;
           DEBUG_EXPR(options.minimizer_progress_to_stdout = true;)
@@ -1094,16 +1180,19 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
           ceres::Solve(options, &problem, &summary);
           DEBUG_OUTPUT(summary.FullReport())
         }
+#endif
 
         // Update the identity weights
         for(auto& param : param_sets) {
           param.model.Wid = params;
+        }
 
-          // Also update geometry if needed
-          {
-            model.ApplyWeights(param.model.Wid, param.model.Wexp);
-            param.mesh.UpdateVertices(model.GetTM());
-            param.mesh.ComputeNormals();
+        // Also update geometry if needed
+        {
+          MatrixXd geometries = GetGeometries();
+          for(size_t i=0;i<param_sets.size();++i) {
+            param_sets[i].mesh.UpdateVertices(geometries.col(i));
+            param_sets[i].mesh.ComputeNormals();
           }
         }
 
@@ -1150,16 +1239,16 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
     // Visualize the reconstruction results
     #if 0
     MeshVisualizer* w = new MeshVisualizer("reconstruction result", param_sets[i].mesh);
-    w->BindConstraints(image_points_pairs[i].second);
-    w->BindImage(image_points_pairs[i].first);
+    w->BindConstraints(frames.points(i));
+    w->BindImage(frames.image(i));
     w->BindLandmarks(init_indices);
 
     w->BindUpdatedLandmarks(param_sets[i].indices);
     w->SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
     w->SetCameraParameters(param_sets[i].cam);
 
-    int show_width = image_points_pairs[i].first.width();
-    int show_height = image_points_pairs[i].first.height();
+    int show_width = frames.width(i);
+    int show_height = frames.height(i);
     double show_ratio = 640.0 / show_height;
     w->resize(show_width * show_ratio, 640);
     w->show();
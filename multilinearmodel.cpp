@@ -1,9 +1,124 @@
 #include "multilinearmodel.h"
 
+namespace {
+// tm(k) = sum_i sum_j w0(i) * w1(j) * core(i, j, k), where layers[i] points to
+// the column major (m x n) layer i of the core. The coordinate axis is split
+// into blocks; per block the layers are first combined with w0 into an m x kb
+// buffer (axpy, vectorized) which is then contracted with w1. Only the block
+// buffer is live, no m x n or l x n intermediate is created.
+template <typename T>
+void FusedModeProduct(const vector<const T*> &layers, int m, int n,
+                      const Tensor1 &w0, const Tensor1 &w1, Tensor1 &tm) {
+  using MatrixT = Matrix<T, Dynamic, Dynamic>;
+  using VectorT = Matrix<T, Dynamic, 1>;
+
+  const int block_size = 256;
+  const int num_blocks = (n + block_size - 1) / block_size;
+  const int l = layers.size();
+  const VectorT w1t = w1.cast<T>();
+
+  tm.resize(n);
+  #pragma omp parallel
+  {
+    MatrixT buffer(m, block_size);
+    #pragma omp for schedule(static)
+    for(int b = 0; b < num_blocks; ++b) {
+      const int k0 = b * block_size;
+      const int kb = std::min(block_size, n - k0);
+      auto block = buffer.leftCols(kb);
+      block.setZero();
+      for(int i = 0; i < l; ++i) {
+        block.noalias() += static_cast<T>(w0(i)) *
+          Map<const MatrixT>(layers[i] + static_cast<size_t>(k0) * m, m, kb);
+      }
+      tm.segment(k0, kb) = (block.transpose() * w1t).template cast<double>();
+    }
+  }
+}
+
+// T = sum_i layers[i]^T * C_i with C_i = Wexp scaled row-wise by Wid(i, :), i.e.
+// one (n x m) * (m x N) GEMM per layer. The output rows are processed in blocks
+// small enough for the output block to stay in cache while all layers are
+// accumulated into it, so the core is streamed once for the whole batch.
+// cols lists the core columns to evaluate.
+template <typename T>
+MatrixXd BatchModeProduct(const vector<const T*> &layers, int m,
+                          const MatrixXd &Wid, const MatrixXd &Wexp,
+                          const vector<int> &cols) {
+  using MatrixT = Matrix<T, Dynamic, Dynamic>;
+
+  const int l = layers.size();
+  const int num_samples = Wid.cols();
+  const int n = cols.size();
+
+  vector<MatrixT> C(l);
+  for(int i = 0; i < l; ++i) {
+    C[i] = (Wexp * Wid.row(i).asDiagonal()).template cast<T>();
+  }
+
+  // Keep a block of the output around 256KB
+  const int block_size = std::max(8, std::min(1024, 32768 / std::max(num_samples, 1)));
+  const int num_blocks = (n + block_size - 1) / block_size;
+
+  // Consecutive columns can be mapped directly from the layers
+  bool contiguous = true;
+  for(int k = 1; k < n && contiguous; ++k) contiguous = (cols[k] == cols[k-1] + 1);
+
+  MatrixXd result(n, num_samples);
+  #pragma omp parallel
+  {
+    MatrixT block(block_size, num_samples);
+    MatrixT gathered(m, block_size);
+    #pragma omp for schedule(static)
+    for(int b = 0; b < num_blocks; ++b) {
+      const int k0 = b * block_size;
+      const int kb = std::min(block_size, n - k0);
+      auto out = block.topRows(kb);
+      out.setZero();
+      for(int i = 0; i < l; ++i) {
+        if(contiguous) {
+          Map<const MatrixT> Li(layers[i] + static_cast<size_t>(cols[k0]) * m, m, kb);
+          out.noalias() += Li.transpose() * C[i];
+        } else {
+          for(int k = 0; k < kb; ++k) {
+            gathered.col(k) = Map<const Matrix<T, Dynamic, 1>>(
+              layers[i] + static_cast<size_t>(cols[k0 + k]) * m, m);
+          }
+          out.noalias() += gathered.leftCols(kb).transpose() * C[i];
+        }
+      }
+      result.middleRows(k0, kb) = out.template cast<double>();
+    }
+  }
+  return result;
+}
+}
+
 MultilinearModel::MultilinearModel(const string &filename)
 {
-  core.Read(filename);
-  UnfoldCoreTensor();
+  if(ModelContainer::IsContainerFile(filename)) {
+    ModelContainer container;
+    auto mapped = make_shared<MappedTensor3>();
+    if(!container.Open(filename) || !container.VerifyPayloadsOnce() ||
+       !container.GetTensor("core", *mapped)) {
+      abort("failed to load multilinear model from " + filename);
+    }
+    mapped_core = mapped;
+    return;
+  }
+
+  if(MappedTensor3::IsMappedTensorFile(filename)) {
+    auto mapped = make_shared<MappedTensor3>();
+    if(!mapped->MapFile(filename)) abort("failed to load multilinear model from " + filename);
+    mapped_core = mapped;
+    return;
+  }
+
+  // Legacy tensor files are read into a buffer shared by all copies of the
+  // model, so copies of a reconstructor do not duplicate the core
+  auto loaded = make_shared<MappedTensor3>();
+  if(!loaded->Load(filename)) abort("failed to load multilinear model from " + filename);
+  mapped_core = loaded;
 }
 
 MultilinearModel MultilinearModel::project(const vector<int> &indices) const
@@ -11,6 +126,12 @@ MultilinearModel MultilinearModel::project(const vector<int> &indices) const
   //cout << "creating projected tensors..." << endl;
   // create a projected version of the model
   MultilinearModel newmodel;
+  if(mapped_core) {
+    newmodel.core = mapped_core->Project(indices);
+    newmodel.UnfoldCoreTensor();
+    return newmodel;
+  }
+
   newmodel.core.resize(core.layers(), core.rows(), indices.size() * 3);
 
   for (int i = 0; i < core.layers(); i++) {
@@ -31,6 +152,11 @@ MultilinearModel MultilinearModel::project(const vector<int> &indices) const
 
 void MultilinearModel::UpdateTM0(const Tensor1 &w)
 {
+  if(mapped_core) {
+    tm0 = Tensor2(mapped_core->ModeProduct0(w));
+    return;
+  }
+
 #if 0
   tm0 = core.ModeProduct<0>(w);
 #else
@@ -47,6 +173,11 @@ void MultilinearModel::UpdateTM0(const Tensor1 &w)
 
 void MultilinearModel::UpdateTM1(const Tensor1 &w)
 {
+  if(mapped_core) {
+    tm1 = Tensor2(mapped_core->ModeProduct1(w));
+    return;
+  }
+
 #if 0
   tm1 = core.ModeProduct<1>(w);
 #else
@@ -70,11 +201,83 @@ void MultilinearModel::UpdateTMWithTM1(const Tensor1 &w)
   tm = tm1.ModeProduct<0>(w);
 }
 
-void MultilinearModel::ApplyWeights(const Tensor1 &w0, const Tensor1 &w1)
+void MultilinearModel::UpdateTM(const Tensor1 &w0, const Tensor1 &w1)
+{
+  const int l = CoreLayers(), m = CoreRows();
+  if(mapped_core && mapped_core->type() == MappedTensor3::Float32) {
+    const float *data = mapped_core->Unfold0<float>().data();
+    vector<const float*> layers(l);
+    for(int i = 0; i < l; ++i) layers[i] = data + static_cast<size_t>(i) * m * mapped_core->cols();
+    FusedModeProduct(layers, m, mapped_core->cols(), w0, w1, tm);
+  } else if(mapped_core) {
+    const double *data = mapped_core->Unfold0<double>().data();
+    vector<const double*> layers(l);
+    for(int i = 0; i < l; ++i) layers[i] = data + static_cast<size_t>(i) * m * mapped_core->cols();
+    FusedModeProduct(layers, m, mapped_core->cols(), w0, w1, tm);
+  } else {
+    vector<const double*> layers(l);
+    for(int i = 0; i < l; ++i) layers[i] = &core(i, 0, 0);
+    FusedModeProduct(layers, m, core.cols(), w0, w1, tm);
+  }
+}
+
+MatrixXd MultilinearModel::EvaluateBatch(const MatrixXd &Wid, const MatrixXd &Wexp,
+                                         const vector<int> &vertices) const
+{
+  assert(Wid.cols() == Wexp.cols());
+  const int l = CoreLayers(), m = CoreRows();
+  const int n = mapped_core ? mapped_core->cols() : core.cols();
+  assert(Wid.rows() == l && Wexp.rows() == m);
+
+  vector<int> cols;
+  if(vertices.empty()) {
+    cols.resize(n);
+    std::iota(cols.begin(), cols.end(), 0);
+  } else {
+    cols.reserve(vertices.size() * 3);
+    for(int vidx : vertices) {
+      cols.push_back(vidx * 3);
+      cols.push_back(vidx * 3 + 1);
+      cols.push_back(vidx * 3 + 2);
+    }
+  }
+
+  if(mapped_core && mapped_core->type() == MappedTensor3::Float32) {
+    const float *data = mapped_core->Unfold0<float>().data();
+    vector<const float*> layers(l);
+    for(int i = 0; i < l; ++i) layers[i] = data + static_cast<size_t>(i) * m * n;
+    return BatchModeProduct(layers, m, Wid, Wexp, cols);
+  } else if(mapped_core) {
+    const double *data = mapped_core->Unfold0<double>().data();
+    vector<const double*> layers(l);
+    for(int i = 0; i < l; ++i) layers[i] = data + static_cast<size_t>(i) * m * n;
+    return BatchModeProduct(layers, m, Wid, Wexp, cols);
+  } else {
+    vector<const double*> layers(l);
+    for(int i = 0; i < l; ++i) layers[i] = &core(i, 0, 0);
+    return BatchModeProduct(layers, m, Wid, Wexp, cols);
+  }
+}
+
+void MultilinearModel::ApplyWeights(const Tensor1 &w0, const Tensor1 &w1, int keep)
 {
-  UpdateTM0(w0);
-  UpdateTM1(w1);
-  UpdateTMWithTM0(w1);
+  switch(keep) {
+  case KeepNone:
+    UpdateTM(w0, w1);
+    break;
+  case KeepTM0:
+    UpdateTM0(w0);
+    UpdateTMWithTM0(w1);
+    break;
+  case KeepTM1:
+    UpdateTM1(w1);
+    UpdateTMWithTM1(w0);
+    break;
+  default:
+    UpdateTM0(w0);
+    UpdateTM1(w1);
+    UpdateTMWithTM0(w1);
+  }
 }
 
 void MultilinearModel::UnfoldCoreTensor()
@@ -82,3 +285,63 @@ void MultilinearModel::UnfoldCoreTensor()
   tu0 = core.Unfold(0);
   tu1 = core.Unfold(1);
 }
+
+void MultilinearModelCache::Build(const MultilinearModel &model, const vector<int> &vertices_in)
+{
+  Clear();
+  for(int vidx : vertices_in) {
+    if(slots.count(vidx)) continue;
+    slots[vidx] = vertices.size();
+    vertices.push_back(vidx);
+  }
+
+  l = model.CoreLayers();
+  m = model.CoreRows();
+  const size_t slab_size = static_cast<size_t>(l) * m * 3;
+  storage = shared_ptr<double>(new double[slab_size * vertices.size()],
+                               default_delete<double[]>());
+
+  #pragma omp parallel for
+  for(int s = 0; s < static_cast<int>(vertices.size()); ++s) {
+    double *slab = storage.get() + s * slab_size;
+    const int vidx = vertices[s] * 3;
+    for(int i = 0; i < l; ++i) {
+      for(int k = 0; k < 3; ++k) {
+        for(int j = 0; j < m; ++j) {
+          *slab++ = model.CoreElement(i, j, vidx + k);
+        }
+      }
+    }
+  }
+}
+
+void MultilinearModelCache::Update(const MultilinearModel &model, const vector<int> &vertices_in)
+{
+  bool complete = (storage != nullptr);
+  for(int vidx : vertices_in) {
+    if(!complete) break;
+    complete = Has(vidx);
+  }
+  if(complete) return;
+
+  // Keep the vertices cached so far, the previously handed out models still
+  // hold on to the old storage
+  vector<int> all_vertices = vertices;
+  all_vertices.insert(all_vertices.end(), vertices_in.begin(), vertices_in.end());
+  Build(model, all_vertices);
+}
+
+MultilinearModel MultilinearModelCache::GetModel(int vidx) const
+{
+  auto it = slots.find(vidx);
+  assert(it != slots.end());
+
+  const size_t slab_size = static_cast<size_t>(l) * m * 3;
+  auto slab = make_shared<MappedTensor3>();
+  slab->Attach(storage, storage.get() + it->second * slab_size,
+               MappedTensor3::Float64, l, m, 3);
+
+  MultilinearModel submodel;
+  submodel.mapped_core = slab;
+  return submodel;
+}
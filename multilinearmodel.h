@@ -2,12 +2,18 @@
 #define MULTILINEARMODEL_H
 
 #include "tensor.hpp"
+#include "mappedtensor.hpp"
+#include "modelcontainer.hpp"
 #include "utils.hpp"
 
 class MultilinearModel
 {
 public:
   MultilinearModel(){}
+  // Files written by MappedTensor3::Write are memory mapped instead of read,
+  // for a ModelContainer file the "core" entry is mapped. Legacy tensor files
+  // are read into a shared buffer, so copying a full model never copies the
+  // core.
   explicit MultilinearModel(const string &filename);
 
   MultilinearModel project(const vector<int> &indices) const;
@@ -16,7 +22,26 @@ public:
   void UpdateTM1(const Tensor1 &w);
   void UpdateTMWithTM0(const Tensor1 &w);
   void UpdateTMWithTM1(const Tensor1 &w);
-  void ApplyWeights(const Tensor1 &w0, const Tensor1 &w1);
+
+  // tm = core x0 w0 x1 w1 in a single pass over the core, tm0 and tm1 are
+  // left untouched
+  void UpdateTM(const Tensor1 &w0, const Tensor1 &w1);
+
+  // Intermediate mode products kept by ApplyWeights in addition to tm
+  enum Intermediate {
+    KeepNone = 0x0,
+    KeepTM0 = 0x1,
+    KeepTM1 = 0x2,
+    KeepAll = 0x3
+  };
+  void ApplyWeights(const Tensor1 &w0, const Tensor1 &w1, int keep = KeepAll);
+
+  // Geometry for N weight pairs in one pass over the core. Column s of Wid and
+  // Wexp holds the weights of sample s, column s of the result its tm. If
+  // vertices is not empty, only the 3 coordinates of these vertices are
+  // returned, in the given order. tm0, tm1 and tm are left untouched.
+  MatrixXd EvaluateBatch(const MatrixXd &Wid, const MatrixXd &Wexp,
+                         const vector<int> &vertices = vector<int>()) const;
 
   const Tensor1& GetTM() const {
     return tm;
@@ -24,17 +49,64 @@ public:
 
   const Tensor2& GetTM0() const { return tm0; }
   const Tensor2& GetTM1() const { return tm1; }
+
+  bool IsMapped() const { return mapped_core != nullptr; }
 private:
+  friend class MultilinearModelCache;
+
   void UnfoldCoreTensor();
 
+  int CoreLayers() const { return mapped_core ? mapped_core->layers() : core.layers(); }
+  int CoreRows() const { return mapped_core ? mapped_core->rows() : core.rows(); }
+  double CoreElement(int i, int j, int k) const {
+    return mapped_core ? (*mapped_core)(i, j, k) : core(i, j, k);
+  }
+
 private:
   Tensor3 core;
   Tensor2 tu0, tu1;     // unfolded tensor in 0, 1 dimension
 
+  // Memory mapped or loaded core, shared by all copies of the model. When set,
+  // core, tu0 and tu1 are left empty and the mode products work on it.
+  shared_ptr<const MappedTensor3> mapped_core;
+
   Tensor2 tm0, tm1;  // tensor after mode product
   Tensor1 tm;        // tensor after 2 mode product
 };
 
+// Packed sub-tensors of a set of vertices, typically the landmarks plus all
+// contour candidates. Each vertex owns a contiguous l x m x 3 slab in the
+// MappedTensor3 layout, so the models returned by GetModel are views into the
+// cache: moving a landmark to another cached vertex copies no tensor data.
+class MultilinearModelCache {
+public:
+  MultilinearModelCache() : l(0), m(0) {}
+
+  // Packs the given vertices, dropping whatever was cached before
+  void Build(const MultilinearModel &model, const vector<int> &vertices);
+
+  // Rebuilds the cache if any of the given vertices is missing
+  void Update(const MultilinearModel &model, const vector<int> &vertices);
+
+  void Clear() {
+    storage.reset();
+    slots.clear();
+    vertices.clear();
+  }
+
+  bool Has(int vidx) const { return slots.count(vidx) > 0; }
+  int size() const { return vertices.size(); }
+
+  // Equivalent to model.project(vector<int>(1, vidx)) for a cached vertex
+  MultilinearModel GetModel(int vidx) const;
+
+private:
+  int l, m;
+  shared_ptr<double> storage;
+  unordered_map<int, int> slots;
+  vector<int> vertices;
+};
+
 struct MultilinearModelPrior {
   VectorXd Wid_avg, Wexp_avg;
   VectorXd Wid0, Wexp0;       // identity and expression prior
@@ -55,6 +127,7 @@ struct MultilinearModelPrior {
 
     int ndims;
     fwid.read(reinterpret_cast<char*>(&ndims), sizeof(int));
+    if(!fwid || ndims <= 0) abort("invalid identity prior file " + fnwid);
     cout << "identity prior dim = " << ndims << endl;
 
     Wid_avg.resize(ndims);
@@ -64,6 +137,7 @@ struct MultilinearModelPrior {
     fwid.read(reinterpret_cast<char*>(Wid_avg.data()), sizeof(double)*ndims);
     fwid.read(reinterpret_cast<char*>(Wid0.data()), sizeof(double)*ndims);
     fwid.read(reinterpret_cast<char*>(sigma_Wid.data()), sizeof(double)*ndims*ndims);
+    if(!fwid) abort("identity prior file " + fnwid + " is truncated.");
     inv_sigma_Wid = sigma_Wid.inverse();
 
     // Take the diagonal
@@ -78,6 +152,7 @@ struct MultilinearModelPrior {
     cout << "Uid size: " << m << 'x' << n << endl;
     Uid.resize(m, n);
     fwid.read(reinterpret_cast<char*>(Uid.data()), sizeof(double)*m*n);
+    if(!fwid) abort("identity prior file " + fnwid + " is truncated.");
 
     fwid.close();
 
@@ -104,6 +179,7 @@ struct MultilinearModelPrior {
     ifstream fwexp(fnwexp, ios::in | ios::binary);
 
     fwexp.read(reinterpret_cast<char*>(&ndims), sizeof(int));
+    if(!fwexp || ndims <= 0) abort("invalid expression prior file " + fnwexp);
     cout << "expression prior dim = " << ndims << endl;
 
     Wexp0.resize(ndims);
@@ -113,6 +189,7 @@ struct MultilinearModelPrior {
     fwexp.read(reinterpret_cast<char*>(Wexp_avg.data()), sizeof(double)*ndims);
     fwexp.read(reinterpret_cast<char*>(Wexp0.data()), sizeof(double)*ndims);
     fwexp.read(reinterpret_cast<char*>(sigma_Wexp.data()), sizeof(double)*ndims*ndims);
+    if(!fwexp) abort("expression prior file " + fnwexp + " is truncated.");
     inv_sigma_Wexp = sigma_Wexp.inverse();
 
     // Take the diagonal
@@ -126,6 +203,7 @@ struct MultilinearModelPrior {
     cout << "Uexp size: " << m << 'x' << n << endl;
     Uexp.resize(m, n);
     fwexp.read(reinterpret_cast<char*>(Uexp.data()), sizeof(double)*m*n);
+    if(!fwexp) abort("expression prior file " + fnwexp + " is truncated.");
 
     fwexp.close();
 
@@ -146,6 +224,56 @@ struct MultilinearModelPrior {
     }
     message("done.");
   }
+
+  // Loads both priors from a ModelContainer file
+  void load(const string &filename) {
+    ModelContainer container;
+    if(!container.Open(filename)) abort("failed to load priors from " + filename);
+    load(container);
+  }
+
+  void load(const ModelContainer &container) {
+    cout << "loading prior data from model container ..." << endl;
+    bool ok = container.GetVector("id_avg", Wid_avg)
+           && container.GetVector("id_w0", Wid0)
+           && container.GetMatrix("id_sigma", sigma_Wid)
+           && container.GetMatrix("id_u", Uid)
+           && container.GetVector("exp_avg", Wexp_avg)
+           && container.GetVector("exp_w0", Wexp0)
+           && container.GetMatrix("exp_sigma", sigma_Wexp)
+           && container.GetMatrix("exp_u", Uexp);
+    if(!ok) abort("model container has no valid prior data.");
+
+    const double MAX_ALLOWED_WEIGHT_RANGE = 1.25;
+    auto process = [MAX_ALLOWED_WEIGHT_RANGE](const VectorXd& W_avg, const MatrixXd& sigma, const MatrixXd& U,
+                      MatrixXd& inv_sigma, VectorXd& inv_sigma_diag, VectorXd& U_max, VectorXd& U_min) {
+      inv_sigma = sigma.inverse();
+      inv_sigma_diag = inv_sigma.diagonal();
+      U_max.resize(U.cols());
+      U_min.resize(U.cols());
+      for(int i=0;i<U.cols();++i) {
+        U_max(i) = W_avg(i) + (U.col(i).maxCoeff() - W_avg(i)) * MAX_ALLOWED_WEIGHT_RANGE;
+        U_min(i) = W_avg(i) + (U.col(i).minCoeff() - W_avg(i)) * MAX_ALLOWED_WEIGHT_RANGE;
+      }
+    };
+    process(Wid_avg, sigma_Wid, Uid, inv_sigma_Wid, inv_sigma_Wid_diag, Uid_max, Uid_min);
+    process(Wexp_avg, sigma_Wexp, Uexp, inv_sigma_Wexp, inv_sigma_Wexp_diag, Uexp_max, Uexp_min);
+    cout << "identity prior dim = " << Wid_avg.size() << ", Uid size: " << Uid.rows() << 'x' << Uid.cols() << endl;
+    cout << "expression prior dim = " << Wexp_avg.size() << ", Uexp size: " << Uexp.rows() << 'x' << Uexp.cols() << endl;
+    message("priors loaded.");
+  }
+
+  // Adds the prior data to a container, the inverse of load(const ModelContainer&)
+  void save(ModelContainerWriter &writer) const {
+    writer.AddVector("id_avg", Wid_avg);
+    writer.AddVector("id_w0", Wid0);
+    writer.AddMatrix("id_sigma", sigma_Wid);
+    writer.AddMatrix("id_u", Uid);
+    writer.AddVector("exp_avg", Wexp_avg);
+    writer.AddVector("exp_w0", Wexp0);
+    writer.AddMatrix("exp_sigma", sigma_Wexp);
+    writer.AddMatrix("exp_u", Uexp);
+  }
 };
 
 #endif // MULTILINEARMODEL_H
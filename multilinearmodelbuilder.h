@@ -3,6 +3,7 @@
 
 #include "blendshape_data.h"
 #include "tensor.hpp"
+#include "mappedtensor.hpp"
 #include "utils.hpp"
 
 class MultilinearModelBuilder {
@@ -84,6 +85,9 @@ public:
     auto tus = std::get<1>(comp2);
     cout << "writing core tensor ..." << endl;
     tcore.Write("blendshape_core.tensor");
+    // Memory mapped copies of the core, loadable directly by MultilinearModel
+    MappedTensor3::Write("blendshape_core_f64.mtensor", tcore, MappedTensor3::Float64);
+    MappedTensor3::Write("blendshape_core_f32.mtensor", tcore, MappedTensor3::Float32);
     cout << "writing U tensors ..." << endl;
     for(int i=0;i<tus.size();i++) {
       tus[i].Write("blendshape_u_" + std::to_string(ms[i]) + ".tensor");
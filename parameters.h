@@ -4,6 +4,9 @@
 #include "glm/glm.hpp"
 #include "mathutils.hpp"
 
+#include <limits>
+#include <mutex>
+
 struct CameraParameters {
   CameraParameters() {}
   CameraParameters(double fovy, double far, int image_width, int image_height)
@@ -153,7 +156,8 @@ struct OptimizationParameters {
   OptimizationParameters() : errorThreshold(1e-6), errorDiffThreshold(1e-6),
                              w_prior_id(100.0), w_prior_exp(100.0),
                              d_w_prior_id(10.0), d_w_prior_exp(10.0),
-                             max_iters(3), num_initializations(1) {}
+                             max_iters(3), num_initializations(1),
+                             restart_cancel_margin(0.0) {}
 
   static OptimizationParameters Defaults() {
     return OptimizationParameters();
@@ -166,6 +170,33 @@ struct OptimizationParameters {
   int max_iters;
   int num_initializations;
   double perturbation_range;
+
+  // Concurrent restarts whose error is more than this fraction above the best
+  // error at the same iteration are cancelled, 0 disables cancellation
+  double restart_cancel_margin;
+};
+
+// Shared by concurrent restarts of Reconstruct. A restart reports its error
+// after every main loop iteration and is cancelled if the error is more than
+// margin (relative) above the best error any restart reported at the same
+// iteration.
+class RestartMonitor {
+public:
+  RestartMonitor(int max_iters, double margin)
+    : best_errors(max_iters, numeric_limits<double>::max()), margin(margin) {}
+
+  // Returns false if the restart should be cancelled
+  bool Report(int iter, double error) {
+    lock_guard<mutex> lock(best_errors_mutex);
+    double &best_error = best_errors[iter];
+    best_error = min(best_error, error);
+    return margin <= 0 || error <= best_error * (1.0 + margin);
+  }
+
+private:
+  vector<double> best_errors;
+  double margin;
+  mutex best_errors_mutex;
 };
 
 
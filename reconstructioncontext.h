@@ -0,0 +1,46 @@
+#ifndef MULTILINEARRECONSTRUCTION_RECONSTRUCTIONCONTEXT_H
+#define MULTILINEARRECONSTRUCTION_RECONSTRUCTIONCONTEXT_H
+
+#include "multilinearmodel.h"
+
+// Model data shared by all single image reconstruction jobs: the multilinear
+// model, the priors, the contour candidates and the packed landmark slabs.
+// The context is set up once and only read afterwards, so any number of
+// SingleImageReconstructors may run concurrently on one context. Every job
+// keeps its own copy of the model for the mode products, the core itself is
+// shared and never copied.
+struct ReconstructionContext {
+  void LoadModel(const string &filename) {
+    model = MultilinearModel(filename);
+    landmark_cache.Clear();
+  }
+
+  void LoadPriors(const string &filename_id, const string &filename_exp) {
+    prior.load(filename_id, filename_exp);
+  }
+  void LoadPriors(const string &filename) {
+    prior.load(filename);
+  }
+
+  void SetContourIndices(const vector<vector<int>> &contour_points) {
+    contour_indices = contour_points;
+  }
+
+  // Packs the given landmarks and all contour candidates, so that jobs
+  // working on these landmarks never have to touch the core for their
+  // projected models
+  void CacheLandmarks(const vector<int> &landmarks) {
+    vector<int> cached_vertices = landmarks;
+    for(auto &contour_j : contour_indices) {
+      cached_vertices.insert(cached_vertices.end(), contour_j.begin(), contour_j.end());
+    }
+    landmark_cache.Update(model, cached_vertices);
+  }
+
+  MultilinearModel model;
+  MultilinearModelPrior prior;
+  vector<vector<int>> contour_indices;
+  MultilinearModelCache landmark_cache;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_RECONSTRUCTIONCONTEXT_H
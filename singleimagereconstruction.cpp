@@ -26,6 +26,7 @@ int main(int argc, char *argv[]) {
     ("iters", po::value<int>(), "Maximum iterations")
     ("inits", po::value<int>(), "Number of initializations")
     ("perturb_range", po::value<double>(), "Range of perturbation")
+    ("cancel_margin", po::value<double>(), "Cancel restarts whose error is this fraction above the best")
     ("error_thres", po::value<double>(), "Error threhsold")
     ("error_diff_thres", po::value<double>(), "Error difference threhsold")
     ("vis,v", "Visualize reconstruction results")
@@ -51,6 +52,7 @@ int main(int argc, char *argv[]) {
     if(vm.count("iters")) opt_params.max_iters = vm["iters"].as<int>();
     if(vm.count("inits")) opt_params.num_initializations = vm["inits"].as<int>();
     if(vm.count("perturb_range")) opt_params.perturbation_range = vm["perturb_range"].as<double>();
+    if(vm.count("cancel_margin")) opt_params.restart_cancel_margin = vm["cancel_margin"].as<double>();
     if(vm.count("error_thres")) opt_params.errorThreshold = vm["error_thres"].as<double>();
     if(vm.count("error_diff_thres")) opt_params.errorDiffThreshold = vm["error_diff_thres"].as<double>();
     if(vm.count("-v") || vm.count("vis")) visualize_results = true;
@@ -96,7 +98,9 @@ int main(int argc, char *argv[]) {
   // Create reconstructor and load the common resources
   SingleImageReconstructor<Constraint2D> recon;
   recon.LoadModel(model_filename);
-  recon.LoadPriors(id_prior_filename, exp_prior_filename);
+  // A model container carries the priors as well
+  if(ModelContainer::IsContainerFile(model_filename)) recon.LoadPriors(model_filename);
+  else recon.LoadPriors(id_prior_filename, exp_prior_filename);
   recon.SetMesh(mesh);
   recon.SetContourIndices(contour_indices);
   recon.SetIndices(landmarks);
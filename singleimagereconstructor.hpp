@@ -19,9 +19,11 @@ using namespace Eigen;
 #include "common.h"
 #include "constraints.h"
 #include "costfunctions.h"
+#include "facsexpressionsolver.h"
 #include "meshvisualizer.h"
 #include "multilinearmodel.h"
 #include "parameters.h"
+#include "reconstructioncontext.h"
 #include "statsutils.h"
 #include "utils.hpp"
 #include "meshvisualizer.h"
@@ -37,6 +39,12 @@ using namespace Eigen;
 
 #define USE_ANALYTIC_COST_FUNCTIONS 1
 
+// Let ceres compare the analytic jacobians against numeric differentiation
+// in every solve, for validating the cost functions only
+#ifndef CHECK_ANALYTIC_COST_FUNCTIONS
+#define CHECK_ANALYTIC_COST_FUNCTIONS 0
+#endif
+
 static double REFERENCE_SCALE = 1.0;
 
 template<typename Constraint>
@@ -51,17 +59,38 @@ public:
   };
 
   SingleImageReconstructor()
-    : opt_mode(All), need_precise_result(false), is_parameters_initialized(false),
+    : SingleImageReconstructor(make_shared<ReconstructionContext>()) {}
+
+  // A reconstruction job on a shared context. The job only copies the
+  // per-image state, so one context can serve many concurrent jobs.
+  explicit SingleImageReconstructor(shared_ptr<const ReconstructionContext> context_in)
+    : context(context_in), model(context_in->model),
+    landmark_cache(context_in->landmark_cache), prior(context_in->prior),
+    opt_mode(All), need_precise_result(false), is_parameters_initialized(false),
     display_step_result(false), enable_selection(true) {}
 
-  void LoadModel(const string &filename) { model = MultilinearModel(filename); }
+  // The setup functions below are for a reconstructor working alone, each of
+  // them leaves the reconstructor with a private copy of the context
+  void LoadModel(const string &filename) {
+    PrivateContext().LoadModel(filename);
+    model = context->model;
+    landmark_cache = context->landmark_cache;
+  }
 
   void LoadPriors(const string &filename_id, const string &filename_exp) {
-    prior.load(filename_id, filename_exp);
+    PrivateContext().LoadPriors(filename_id, filename_exp);
+    prior = context->prior;
+  }
+  void LoadPriors(const string &filename) {
+    PrivateContext().LoadPriors(filename);
+    prior = context->prior;
   }
 
-  void SetContourIndices(
-    const vector<vector<int>> &contour_points) { contour_indices = contour_points; }
+  void SetContourIndices(const vector<vector<int>> &contour_points) {
+    PrivateContext().SetContourIndices(contour_points);
+  }
+
+  const shared_ptr<const ReconstructionContext> &GetContext() const { return context; }
 
   void SetConstraints(
     const vector<Constraint> &cons) { params_recon.cons = cons; }
@@ -126,6 +155,10 @@ public:
     image_filename = image_filename_in;
   }
 
+  // Seed of the perturbations, concurrent jobs with fixed seeds reproduce
+  // their results regardless of the scheduling
+  void SetRandomSeed(unsigned int seed) { rng.seed(seed); }
+
   vector<int> GetUpdatedIndices() const {
     vector<int> idxs;
     for (size_t i = 0; i < params_recon.cons.size(); ++i) {
@@ -183,11 +216,29 @@ protected:
 
   double ComputeError();
 
+  // One run of the main loop from the given identity weights, returns false
+  // if the run was cancelled by the monitor
+  bool ReconstructFrom(const VectorXd &wid_init,
+                       const OptimizationParameters &opt_params,
+                       RestartMonitor *monitor);
+
+  ReconstructionContext &PrivateContext() {
+    auto private_context = make_shared<ReconstructionContext>(*context);
+    context = private_context;
+    return *private_context;
+  }
+
 private:
+  // Shared, read only model data
+  shared_ptr<const ReconstructionContext> context;
+
+  // Per-job state. The model shares its core with the context, only the mode
+  // products are owned by the job. The prior weights change during the
+  // optimization, so the job works on its own copy of the prior.
   MultilinearModel model;
   vector<MultilinearModel> model_projected;
+  MultilinearModelCache landmark_cache;   // landmarks and contour candidates
   MultilinearModelPrior prior;
-  vector<vector<int>> contour_indices;
 
   vector<int> indices;
   BasicMesh mesh;
@@ -208,6 +259,8 @@ private:
   bool display_step_result;
 
   bool enable_selection;
+
+  mt19937 rng;
 };
 
 template <typename Constraint>
@@ -240,8 +293,8 @@ void SingleImageReconstructor<Constraint>::InitializeParameters(bool with_pertur
   if(with_perturbation) {
     // change the identity weights and the experssion weights a little
     const double range = 0.05;
-    model_params.Wid = StatsUtils::perturb(model_params.Wid, perturb_range, prior.sigma_Wid);
-    model_params.Wexp_FACS = StatsUtils::perturb(model_params.Wexp_FACS, perturb_range);
+    model_params.Wid = StatsUtils::perturb(rng, model_params.Wid, perturb_range, prior.sigma_Wid);
+    model_params.Wexp_FACS = StatsUtils::perturb(rng, model_params.Wexp_FACS, perturb_range);
     model_params.Wexp_FACS(1) = 1.0;
     model_params.Wexp = model_params.Wexp_FACS.transpose() * prior.Uexp;
   }
@@ -255,7 +308,8 @@ void SingleImageReconstructor<Constraint>::InitializeParameters(bool with_pertur
 
 template <typename Constraint>
 void SingleImageReconstructor<Constraint>::UpdateModels() {
-  model.ApplyWeights(params_model.Wid, params_model.Wexp);
+  // The main loop starts from tm1 and recomputes tm0 itself
+  model.ApplyWeights(params_model.Wid, params_model.Wexp, MultilinearModel::KeepTM1);
 
   for (size_t i = 0; i < indices.size(); ++i) {
     params_recon.cons[i].vidx = indices[i];
@@ -264,10 +318,19 @@ void SingleImageReconstructor<Constraint>::UpdateModels() {
     params_model.vindices(i) = indices[i];
   }
 
+  // Pack the landmarks and all contour candidates once, contour updates then
+  // only pick other slabs from the cache. The cache starts as a copy of the
+  // context's, which normally holds all of them already.
+  vector<int> cached_vertices = indices;
+  for (auto &contour_j : context->contour_indices) {
+    cached_vertices.insert(cached_vertices.end(), contour_j.begin(), contour_j.end());
+  }
+  landmark_cache.Update(model, cached_vertices);
+
   // Create initial projected models
   model_projected.resize(params_recon.cons.size());
   for (size_t i = 0; i < params_recon.cons.size(); ++i) {
-    model_projected[i] = model.project(vector<int>(1, indices[i]));
+    model_projected[i] = landmark_cache.GetModel(indices[i]);
     model_projected[i].ApplyWeights(params_model.Wid, params_model.Wexp);
   }
 }
@@ -280,7 +343,7 @@ bool SingleImageReconstructor<Constraint>::Reconstruct(OptimizationParameters op
   bool iterative_recon_converged = false;
   int iterative_recon_run_i = 0;
 
-  MatrixXd wid_history(opt_params.num_initializations, 50);
+  MatrixXd wid_history;
 
   while(true) {
 
@@ -301,138 +364,196 @@ bool SingleImageReconstructor<Constraint>::Reconstruct(OptimizationParameters op
     }
 
     VectorXd wid0 = params_model.Wid;
-    for(int run_i = 0; run_i < opt_params.num_initializations; ++run_i) {
-      const int num_contour_points = 15;
-
-      // Reconstruction begins
-      params_model.Wid = StatsUtils::perturb(wid0, opt_params.perturbation_range, prior.sigma_Wid);
 
-      ColorStream(ColorOutput::Red) << "Initial Error = " << ComputeError();
+    // Draw all perturbations up front, the restarts may run concurrently
+    vector<VectorXd> wid_inits(max(opt_params.num_initializations, 1));
+    for(auto &wid_init : wid_inits) {
+      wid_init = StatsUtils::perturb(rng, wid0, opt_params.perturbation_range, prior.sigma_Wid);
+    }
 
-      // Optimization parameters
-      const int kMaxIterations = opt_params.max_iters;
-      const double init_weights = 1.0;
-      prior.weight_Wid = opt_params.w_prior_id;
-      const double d_wid = opt_params.d_w_prior_id;
-      prior.weight_Wexp = opt_params.w_prior_exp;
-      const double d_wexp = opt_params.d_w_prior_exp;
-      int iters = 0;
+    if(wid_inits.size() == 1) {
+      ReconstructFrom(wid_inits[0], opt_params, nullptr);
+      wid_history = params_model.Wid.transpose();
+    } else {
+      // Each restart works on its own copy of the reconstructor. The copies
+      // share the model core and the landmark cache, only the parameters and
+      // the projected landmark models are duplicated.
+      RestartMonitor monitor(opt_params.max_iters, opt_params.restart_cancel_margin);
+      vector<SingleImageReconstructor> restarts(opt_params.num_initializations, *this);
+      vector<int> finished(opt_params.num_initializations, 0);
+
+      #pragma omp parallel for schedule(dynamic, 1)
+      for(int run_i = 0; run_i < opt_params.num_initializations; ++run_i) {
+        // Visualizer windows can only be created on the GUI thread
+        restarts[run_i].display_step_result = false;
+        finished[run_i] = restarts[run_i].ReconstructFrom(wid_inits[run_i], opt_params, &monitor);
+      }
 
-      // Before entering the main loop, estimate the translation and roataion around z-axis first
-      ProcrustesAnalysis();
+      // Keep the best restart, the identity weights of all finished restarts
+      // initialize the next round
+      vector<int> finished_runs;
+      int best_run = -1;
+      for(int run_i = 0; run_i < opt_params.num_initializations; ++run_i) {
+        if(!finished[run_i]) continue;
+        finished_runs.push_back(run_i);
+        if(best_run < 0 || restarts[run_i].recon_stats.avg_error < restarts[best_run].recon_stats.avg_error) {
+          best_run = run_i;
+        }
+      }
+      // The restart with the lowest error at an iteration is never cancelled
+      // there, so at least one restart finishes
+      assert(best_run >= 0);
 
-      for (int i = 0; i < num_contour_points; ++i) {
-        params_recon.cons[i].weight = 0.5;
+      wid_history.resize(finished_runs.size(), wid0.size());
+      for(size_t k = 0; k < finished_runs.size(); ++k) {
+        wid_history.row(k) = restarts[finished_runs[k]].params_model.Wid.transpose();
       }
-      OptimizeForPosition();
-      for (int i = 0; i < num_contour_points; ++i) {
-        params_recon.cons[i].weight = 1.0;
+      ColorStream(ColorOutput::Green) << finished_runs.size() << " of "
+                                      << opt_params.num_initializations
+                                      << " restarts finished, best error = "
+                                      << restarts[best_run].recon_stats.avg_error;
+
+      *this = restarts[best_run];
+    }
+
+    ++iterative_recon_run_i;
+  }
+
+  return true;
+}
+
+template<typename Constraint>
+bool SingleImageReconstructor<Constraint>::ReconstructFrom(
+  const VectorXd &wid_init, const OptimizationParameters &opt_params,
+  RestartMonitor *monitor) {
+  const int num_contour_points = 15;
+
+  // Reconstruction begins
+  params_model.Wid = wid_init;
+
+  ColorStream(ColorOutput::Red) << "Initial Error = " << ComputeError();
+
+  // Optimization parameters
+  const int kMaxIterations = opt_params.max_iters;
+  const double init_weights = 1.0;
+  prior.weight_Wid = opt_params.w_prior_id;
+  const double d_wid = opt_params.d_w_prior_id;
+  prior.weight_Wexp = opt_params.w_prior_exp;
+  const double d_wexp = opt_params.d_w_prior_exp;
+  int iters = 0;
+
+  // Before entering the main loop, estimate the translation and roataion around z-axis first
+  ProcrustesAnalysis();
+
+  for (int i = 0; i < num_contour_points; ++i) {
+    params_recon.cons[i].weight = 0.5;
+  }
+  OptimizeForPosition();
+  for (int i = 0; i < num_contour_points; ++i) {
+    params_recon.cons[i].weight = 1.0;
+  }
+
+  while (iters++ < kMaxIterations) {
+    ColorStream(ColorOutput::Green) << "Iteration " << iters << " begins.";
+    {
+      boost::timer::auto_cpu_timer timer_loop(
+        "[Main loop] Iteration time = %w seconds.\n");
+
+      if((opt_mode & (Identity | Expression))){
+        boost::timer::auto_cpu_timer timer(
+          "[Main loop] Multilinear model weights update time = %w seconds.\n");
+        //model.ApplyWeights(params_model.Wid, params_model.Wexp);
+        model.UpdateTM0(params_model.Wid);
+        model.UpdateTMWithTM1(params_model.Wid);
       }
+      mesh.UpdateVertices(model.GetTM());
+      mesh.ComputeNormals();
 
-      while (iters++ < kMaxIterations) {
-        ColorStream(ColorOutput::Green) << "Iteration " << iters << " begins.";
-        {
-          boost::timer::auto_cpu_timer timer_loop(
-            "[Main loop] Iteration time = %w seconds.\n");
-
-          if((opt_mode & (Identity | Expression))){
-            boost::timer::auto_cpu_timer timer(
-              "[Main loop] Multilinear model weights update time = %w seconds.\n");
-            //model.ApplyWeights(params_model.Wid, params_model.Wexp);
-            model.UpdateTM0(params_model.Wid);
-            model.UpdateTMWithTM1(params_model.Wid);
-          }
-          mesh.UpdateVertices(model.GetTM());
-          mesh.ComputeNormals();
-
-          if(opt_mode & Pose) {
-            for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
-              OptimizeForPose(iters);
-              UpdateContourIndices(iters);
-            }
-          }
-
-          if(opt_mode & Expression) {
-            //OptimizeForExpression(iters*100);
-            OptimizeForExpression_FACS(iters*10);
-          }
-
-          if(opt_mode & FocalLength) {
-            OptimizeForFocalLength();
-          }
-
-          if(opt_mode & Expression){
-            boost::timer::auto_cpu_timer timer(
-              "[Main loop] Multilinear model weights update time = %w seconds.\n");
-            //model.ApplyWeights(params_model.Wid, params_model.Wexp);
-            model.UpdateTM1(params_model.Wexp);
-            model.UpdateTMWithTM0(params_model.Wexp);
-          }
-          mesh.UpdateVertices(model.GetTM());
-          mesh.ComputeNormals();
-
-          if(opt_mode & Pose) {
-            for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
-              OptimizeForPose(iters);
-              UpdateContourIndices(iters);
-            }
-          }
-
-          if(opt_mode & Identity) {
-            OptimizeForIdentity(iters*10);
-          }
-
-          if(opt_mode & FocalLength) {
-            OptimizeForFocalLength();
-          }
-
-          double E = ComputeError();
-
-          ColorStream(ColorOutput::Red) << "Iteration " << iters << " Error = " <<
-          E;
-
-          // Adjust weights
-          prior.weight_Wid /= d_wid; prior.weight_Wid = max(prior.weight_Wid, 1.0);
-          prior.weight_Wexp /= d_wexp; prior.weight_Wexp = max(prior.weight_Wexp, 1.0);
-          for (int i = 0; i < num_contour_points; ++i) {
-            params_recon.cons[i].weight = sqrt(params_recon.cons[i].weight);
-          }
+      if(opt_mode & Pose) {
+        for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
+          OptimizeForPose(iters);
+          UpdateContourIndices(iters);
         }
-        ColorStream(ColorOutput::Green) << "Iteration " << iters << " finished.";
-
-        // Visualize reconstruction result
-        if(display_step_result) {
-          auto tm = GetGeometry();
-          mesh.UpdateVertices(tm);
-          auto R = GetRotation();
-          auto T = GetTranslation();
-          auto cam_params = GetCameraParameters();
-
-          MeshVisualizer *w = new MeshVisualizer("reconstruction result " + std::to_string(iters), mesh);
-          w->BindConstraints(params_recon.cons);
-          w->BindImage(img);
-          w->BindLandmarks(GetIndices());
-          w->BindUpdatedLandmarks(GetUpdatedIndices());
-          w->SetMeshRotationTranslation(R, T);
-          w->SetCameraParameters(cam_params);
-
-          double scale = 640.0 / params_cam.image_size.y;
-          w->resize(params_cam.image_size.x * scale, params_cam.image_size.y * scale);
-          w->show();
+      }
+
+      if(opt_mode & Expression) {
+        //OptimizeForExpression(iters*100);
+        OptimizeForExpression_FACS(iters*10);
+      }
+
+      if(opt_mode & FocalLength) {
+        OptimizeForFocalLength();
+      }
+
+      if(opt_mode & Expression){
+        boost::timer::auto_cpu_timer timer(
+          "[Main loop] Multilinear model weights update time = %w seconds.\n");
+        //model.ApplyWeights(params_model.Wid, params_model.Wexp);
+        model.UpdateTM1(params_model.Wexp);
+        model.UpdateTMWithTM0(params_model.Wexp);
+      }
+      mesh.UpdateVertices(model.GetTM());
+      mesh.ComputeNormals();
+
+      if(opt_mode & Pose) {
+        for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
+          OptimizeForPose(iters);
+          UpdateContourIndices(iters);
         }
       }
 
-      cout << "Reconstruction done." << endl;
-      model.ApplyWeights(params_model.Wid, params_model.Wexp);
+      if(opt_mode & Identity) {
+        OptimizeForIdentity(iters*10);
+      }
 
-      //SaveReconstructionResults(image_filename + "_run_"+ to_string(run_i) + ".res");
+      if(opt_mode & FocalLength) {
+        OptimizeForFocalLength();
+      }
 
-      wid_history.row(run_i) = params_model.Wid;
-    }
+      double E = ComputeError();
 
-    ++iterative_recon_run_i;
+      ColorStream(ColorOutput::Red) << "Iteration " << iters << " Error = " <<
+      E;
+
+      if(monitor != nullptr && !monitor->Report(iters - 1, E)) {
+        ColorStream(ColorOutput::Red) << "Restart cancelled at iteration " << iters;
+        return false;
+      }
+
+      // Adjust weights
+      prior.weight_Wid /= d_wid; prior.weight_Wid = max(prior.weight_Wid, 1.0);
+      prior.weight_Wexp /= d_wexp; prior.weight_Wexp = max(prior.weight_Wexp, 1.0);
+      for (int i = 0; i < num_contour_points; ++i) {
+        params_recon.cons[i].weight = sqrt(params_recon.cons[i].weight);
+      }
+    }
+    ColorStream(ColorOutput::Green) << "Iteration " << iters << " finished.";
+
+    // Visualize reconstruction result
+    if(display_step_result) {
+      auto tm = GetGeometry();
+      mesh.UpdateVertices(tm);
+      auto R = GetRotation();
+      auto T = GetTranslation();
+      auto cam_params = GetCameraParameters();
+
+      MeshVisualizer *w = new MeshVisualizer("reconstruction result " + std::to_string(iters), mesh);
+      w->BindConstraints(params_recon.cons);
+      w->BindImage(img);
+      w->BindLandmarks(GetIndices());
+      w->BindUpdatedLandmarks(GetUpdatedIndices());
+      w->SetMeshRotationTranslation(R, T);
+      w->SetCameraParameters(cam_params);
+
+      double scale = 640.0 / params_cam.image_size.y;
+      w->resize(params_cam.image_size.x * scale, params_cam.image_size.y * scale);
+      w->show();
+    }
   }
 
+  cout << "Reconstruction done." << endl;
+  model.ApplyWeights(params_model.Wid, params_model.Wexp, MultilinearModel::KeepTM1);
+
   return true;
 }
 
@@ -567,6 +688,8 @@ void SingleImageReconstructor<Constraint>::OptimizeForPosition() {
     boost::timer::auto_cpu_timer timer_solve(
       "[Position optimization] Problem solve time = %w seconds.\n");
 
+    // Restarts are jittered with the seeded generator of this job
+    uniform_int_distribution<int> jitter(0, 127);
     const int max_tries = 5;
     for(int i=0;i<max_tries;++i) {
       ceres::Solver::Options options;
@@ -577,9 +700,9 @@ void SingleImageReconstructor<Constraint>::OptimizeForPosition() {
       DEBUG_OUTPUT(summary.BriefReport());
       //cout << params[0] << ' ' << params[1] << ' ' << params[2] << endl;
       if(i == max_tries - 1) break;
-      params[0] += (rand() % 128) / 128.0;
-      params[1] += (rand() % 128) / 128.0;
-      params[2] += (rand() % 128) / 128.0;
+      params[0] += jitter(rng) / 128.0;
+      params[1] += jitter(rng) / 128.0;
+      params[2] += jitter(rng) / 128.0;
     }
   }
 
@@ -758,29 +881,33 @@ void SingleImageReconstructor<Constraint>::OptimizeForPose(int iteration) {
     boost::timer::auto_cpu_timer timer_construction(
       "[Pose optimization] Problem construction time = %w seconds.\n");
 
+    auto cons = params_recon.cons;
     for (size_t i = 0; i < indices.size(); ++i) {
-      auto &model_i = model_projected[i];
-      //model_i.ApplyWeights(params_model.Wid, params_model.Wexp);
-      Constraint2D cons_i = params_recon.cons[i];
+      Constraint2D &cons_i = cons[i];
       if(i<15) cons_i.weight = 0.3 * iteration;
       else if(i>45 && i<64) cons_i.weight = 0.3 * iteration;
       else cons_i.weight = 1.0;
+    }
 
 #if USE_ANALYTIC_COST_FUNCTIONS
-      ceres::CostFunction *cost_function =
-        new PoseCostFunction_analytic(model_i, cons_i,
-                                      params_cam);
-      problem.AddResidualBlock(cost_function, NULL, params.data(),
-                               params.data() + 3);
+    // All landmarks in one block
+    ceres::CostFunction *cost_function =
+      new PoseCostFunction_stacked(model_projected, cons, params_cam);
+    problem.AddResidualBlock(cost_function, NULL, params.data(),
+                             params.data() + 3);
 #else
+    for (size_t i = 0; i < indices.size(); ++i) {
+      auto &model_i = model_projected[i];
+      //model_i.ApplyWeights(params_model.Wid, params_model.Wexp);
+      const Constraint2D &cons_i = cons[i];
       ceres::CostFunction *cost_function =
         new ceres::NumericDiffCostFunction<PoseCostFunction, ceres::CENTRAL, 1, 6>(
           new PoseCostFunction(model_i,
                                cons_i,
                                params_cam));
       problem.AddResidualBlock(cost_function, NULL, params.data());
-#endif
     }
+#endif
 
 #if 1
     // Add a regularization term
@@ -899,6 +1026,12 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression(
   {
     boost::timer::auto_cpu_timer timer_construction(
       "[Expression optimization] Problem construction time = %w seconds.\n");
+#if USE_ANALYTIC_COST_FUNCTIONS
+    // All landmarks in one block
+    ceres::CostFunction *cost_function = new ExpressionCostFunction_stacked(
+      model_projected, params_recon.cons, Mview, Rmat, params_cam);
+    problem.AddResidualBlock(cost_function, NULL, params.data());
+#else
     for (int i = 0; i < indices.size(); ++i) {
       auto &model_i = model_projected[i];
       //model_i.ApplyWeights(params_model.Wid, params_model.Wexp);
@@ -913,6 +1046,7 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression(
       cost_function->SetNumResiduals(1);
       problem.AddResidualBlock(cost_function, NULL, params.data());
     }
+#endif
 
     ceres::DynamicNumericDiffCostFunction<PriorCostFunction> *prior_cost_function =
       new ceres::DynamicNumericDiffCostFunction<PriorCostFunction>(
@@ -974,22 +1108,40 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression_FACS(
     0.5 * (params_recon.cons[32].data + params_recon.cons[34].data));
   double prior_scale = REFERENCE_SCALE / puple_distance;
 
+  VectorXd params = params_model.Wexp_FACS;
+
+#if USE_FACS_EXPRESSION_SOLVER
+  {
+    FACSExpressionSolver solver(params_recon.cons, Mview, Rmat, params_cam);
+    solver.SetBasis(model_projected, prior.Uexp);
+    solver.SetPrior(prior.Wexp_avg, prior.inv_sigma_Wexp, prior.Uexp,
+                    prior.weight_Wexp * prior_scale);
+    const double reg_factor = 100.0 / puple_distance;
+    solver.SetSparsityWeight(10.0 / reg_factor * exp(-(iteration / 10 - 1) * 0.25));
+
+    // Optimize the last 46 weights only, with the iteration budget the
+    // ceres solver gets. The first pass has a budget of 0, it gets a floor.
+    const int min_solver_iters = 10;
+    VectorXd w = params.bottomRows(46);
+    solver.Solve(w, max(iteration, min_solver_iters));
+    params.bottomRows(46) = w;
+  }
+#else
   // Define the optimization problem
   ceres::Problem problem;
 
-  VectorXd params = params_model.Wexp_FACS;
-
   {
     boost::timer::auto_cpu_timer timer_construction(
       "[Expression optimization] Problem construction time = %w seconds.\n");
+#if USE_ANALYTIC_COST_FUNCTIONS
+    // All landmarks in one block, optimize the last 46 weights only
+    ceres::CostFunction *cost_function = new ExpressionCostFunction_FACS_stacked(
+      model_projected, params_recon.cons, Mview, Rmat, prior.Uexp, params_cam);
+    problem.AddResidualBlock(cost_function, NULL, params.data() + 1);
+#else
     for (size_t i = 0; i < indices.size(); ++i) {
       auto &model_i = model_projected[i];
       //model_i.ApplyWeights(params_model.Wid, params_model.Wexp);
-#if USE_ANALYTIC_COST_FUNCTIONS
-      ceres::CostFunction *cost_function = new ExpressionCostFunction_FACS_analytic(
-        model_i, params_recon.cons[i], params.size(), Mview, Rmat, prior.Uexp,
-        params_cam);
-#else
       ceres::DynamicNumericDiffCostFunction<ExpressionCostFunction_FACS> *cost_function =
         new ceres::DynamicNumericDiffCostFunction<ExpressionCostFunction_FACS>(
           new ExpressionCostFunction_FACS(model_i,
@@ -1001,10 +1153,9 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression_FACS(
       // Optimize the last 46 weights only
       cost_function->AddParameterBlock(params.size() - 1);
       cost_function->SetNumResiduals(1);
-#endif
-      // Optimize the last 46 weights only
       problem.AddResidualBlock(cost_function, NULL, params.data() + 1);
     }
+#endif
 
     // Expression prior term
     ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationCostFunction> *prior_cost_function =
@@ -1039,6 +1190,7 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression_FACS(
       "[Expression optimization] Problem solve time = %w seconds.\n");
     ceres::Solver::Options options;
     options.max_num_iterations = iteration;
+    options.check_gradients = CHECK_ANALYTIC_COST_FUNCTIONS;
 
     options.num_threads = 8;
     options.num_linear_solver_threads = 8;
@@ -1068,6 +1220,7 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression_FACS(
       DEBUG_OUTPUT(summary.BriefReport())
     }
   }
+#endif
 
   // Update the model parameters
   DEBUG_OUTPUT(params_model.Wexp_FACS.transpose() << endl
@@ -1107,14 +1260,16 @@ void SingleImageReconstructor<Constraint>::OptimizeForIdentity(int iteration) {
   {
     boost::timer::auto_cpu_timer timer_construction(
       "[Identity optimization] Problem construction time = %w seconds.\n");
+#if USE_ANALYTIC_COST_FUNCTIONS
+    // All landmarks in one block
+    ceres::CostFunction *cost_function = new IdentityCostFunction_stacked(
+      model_projected, params_recon.cons, Mview, Rmat, params_cam);
+    problem.AddResidualBlock(cost_function, NULL, params.data());
+#else
     for (size_t i = 0; i < indices.size(); ++i) {
       auto &model_i = model_projected[i];
       //model_i.ApplyWeights(params_model.Wid, params_model.Wexp);
 
-#if USE_ANALYTIC_COST_FUNCTIONS
-      ceres::CostFunction *cost_function = new IdentityCostFunction_analytic(
-        model_i, params_recon.cons[i], params.size(), Mview, Rmat, params_cam);
-#else
       ceres::DynamicNumericDiffCostFunction<IdentityCostFunction> *cost_function =
         new ceres::DynamicNumericDiffCostFunction<IdentityCostFunction>(
           new IdentityCostFunction(model_i, params_recon.cons[i], params.size(),
@@ -1122,9 +1277,9 @@ void SingleImageReconstructor<Constraint>::OptimizeForIdentity(int iteration) {
 
       cost_function->AddParameterBlock(params.size());
       cost_function->SetNumResiduals(1);
-#endif
       problem.AddResidualBlock(cost_function, NULL, params.data());
     }
+#endif
 
     // Prior term
     #if 0
@@ -1164,6 +1319,7 @@ void SingleImageReconstructor<Constraint>::OptimizeForIdentity(int iteration) {
       "[Identity optimization] Problem solve time = %w seconds.\n");
     ceres::Solver::Options options;
     options.max_num_iterations = iteration;
+    options.check_gradients = CHECK_ANALYTIC_COST_FUNCTIONS;
 
     options.num_threads = 8;
     options.num_linear_solver_threads = 8;
@@ -1215,6 +1371,7 @@ void SingleImageReconstructor<Constraint>::UpdateContourIndices(int iterations)
   vector<pair<int, glm::dvec4>> candidates_center;
   vector<pair<int, glm::dvec4>> candidates_right;
 
+  const vector<vector<int>> &contour_indices = context->contour_indices;
   for (size_t j = 0; j < contour_indices.size(); ++j) {
     vector<double> dot_products(contour_indices[j].size(), 0.0);
     vector<glm::dvec4> contour_vertices(contour_indices[j].size());
@@ -1336,7 +1493,7 @@ void SingleImageReconstructor<Constraint>::UpdateContourIndices(int iterations)
       indices[i] = (*candidates)[min_iter - dists.begin()].first;
       params_recon.cons[i].vidx = (*candidates)[min_iter - dists.begin()].first;
       params_model.vindices(i) = params_recon.cons[i].vidx;
-      model_projected[i] = model.project(vector<int>(1, indices[i]));
+      model_projected[i] = landmark_cache.GetModel(indices[i]);
       model_projected[i].ApplyWeights(params_model.Wid, params_model.Wexp);
     }
   }
@@ -19,6 +19,7 @@ using namespace Eigen;
 #include "common.h"
 #include "constraints.h"
 #include "costfunctions_exp.h"
+#include "facsexpressionsolver.h"
 #include "multilinearmodel.h"
 #include "parameters.h"
 #include "statsutils.h"
@@ -51,11 +52,17 @@ public:
   SingleImageReconstructor()
     : opt_mode(All), need_precise_result(false), is_parameters_initialized(false), display_step_result(false) {}
 
-  void LoadModel(const string &filename) { model = MultilinearModel(filename); }
+  void LoadModel(const string &filename) {
+    model = MultilinearModel(filename);
+    landmark_cache.Clear();
+  }
 
   void LoadPriors(const string &filename_id, const string &filename_exp) {
     prior.load(filename_id, filename_exp);
   }
+  void LoadPriors(const string &filename) {
+    prior.load(filename);
+  }
 
   void SetContourIndices(
     const vector<vector<int>> &contour_points) { contour_indices = contour_points; }
@@ -165,6 +172,10 @@ public:
     display_step_result = !display_step_result;
   }
 
+  // Seed of the pose restarts, jobs with fixed seeds reproduce their results
+  // regardless of the scheduling
+  void SetRandomSeed(unsigned int seed) { rng.seed(seed); }
+
 protected:
   void InitializeParameters(bool with_perturbation=false, double perturb_range=0.0);
 
@@ -194,9 +205,16 @@ protected:
 
   double ComputeError();
 
+  // One run of the main loop from the given identity weights, returns false
+  // if the run was cancelled by the monitor
+  bool ReconstructFrom(const VectorXd &wid_init,
+                       const OptimizationParameters &opt_params,
+                       RestartMonitor *monitor);
+
 private:
   MultilinearModel model;
   vector<MultilinearModel> model_projected;
+  MultilinearModelCache landmark_cache;   // landmarks and contour candidates
   MultilinearModelPrior prior;
   vector<vector<int>> contour_indices;
 
@@ -206,6 +224,12 @@ private:
   vector<BasicMesh> blendshapes;
   vector<Vector3d> current_shape;
 
+  // The blendshapes as base + deltas * w, w the last 46 FACS weights. Vertex
+  // v is at rows 3v to 3v+2, column j - 1 of deltas is blendshape j minus
+  // blendshape 0.
+  VectorXd blendshape_base;
+  MatrixXd blendshape_deltas;
+
   QImage img;
   string image_filename;
 
@@ -220,6 +244,8 @@ private:
   bool need_precise_result;
   bool is_parameters_initialized;
   bool display_step_result;
+
+  mt19937 rng;
 };
 
 template <typename Constraint>
@@ -274,10 +300,18 @@ void SingleImageReconstructor<Constraint>::UpdateModels() {
     params_recon.cons[i].weight = 1.0;
   }
 
+  // Pack the landmarks and all contour candidates once, contour updates then
+  // only pick other slabs from the cache
+  vector<int> cached_vertices = indices;
+  for (auto &contour_j : contour_indices) {
+    cached_vertices.insert(cached_vertices.end(), contour_j.begin(), contour_j.end());
+  }
+  landmark_cache.Update(model, cached_vertices);
+
   // Create initial projected models
   model_projected.resize(params_recon.cons.size());
   for (size_t i = 0; i < params_recon.cons.size(); ++i) {
-    model_projected[i] = model.project(vector<int>(1, indices[i]));
+    model_projected[i] = landmark_cache.GetModel(indices[i]);
     model_projected[i].ApplyWeights(params_model.Wid, params_model.Wexp);
   }
 }
@@ -289,11 +323,24 @@ void SingleImageReconstructor<Constraint>::LoadBlendshapes(
 
   const int num_blendshapes = 46;
   blendshapes.resize(num_blendshapes + 1);
+  #pragma omp parallel for
   for(int i=0;i<=num_blendshapes;++i) {
     blendshapes[i].LoadOBJMesh(blendshapes_path + "/" + "B_" + to_string(i) + ".obj");
     blendshapes[i].ComputeNormals();
   }
 
+  const int num_verts = blendshapes[0].NumVertices();
+  auto flatten = [](const MatrixX3d& verts) {
+    Matrix<double, 3, Dynamic> verts_t = verts.transpose();
+    return VectorXd(Map<const VectorXd>(verts_t.data(), verts_t.size()));
+  };
+  blendshape_base = flatten(blendshapes[0].vertices());
+  blendshape_deltas.resize(num_verts * 3, num_blendshapes);
+  #pragma omp parallel for
+  for(int j=1;j<=num_blendshapes;++j) {
+    blendshape_deltas.col(j-1) = flatten(blendshapes[j].vertices()) - blendshape_base;
+  }
+
   if(alsoApplyWeights) ApplyWeights();
 }
 
@@ -303,26 +350,21 @@ void SingleImageReconstructor<Constraint>::ApplyWeights() {
   //cout << params_model.Wexp_FACS << endl;
   // Create initial shape
   const int num_blendshapes = 46;
+  const VectorXd w = params_model.Wexp_FACS.bottomRows(num_blendshapes);
   current_shape.resize(params_recon.cons.size());
   for(size_t i = 0; i < params_recon.cons.size(); ++i) {
-    Vector3d pi0 = blendshapes[0].vertex(params_recon.cons[i].vidx);
-    Vector3d pi = pi0;
-    for(int j=1;j<=num_blendshapes;++j) {
-      pi += (blendshapes[j].vertex(params_recon.cons[i].vidx) - pi0) * params_model.Wexp_FACS(j);
-    }
-    current_shape[i] = pi;
+    const int row = params_recon.cons[i].vidx * 3;
+    current_shape[i] = blendshape_base.segment<3>(row);
+    current_shape[i].noalias() += blendshape_deltas.middleRows<3>(row) * w;
   }
 }
 
 template<typename Constraint>
 void SingleImageReconstructor<Constraint>::UpdateMesh() {
   const int num_blendshapes = 46;
-  MatrixX3d verts0 = blendshapes[0].vertices();
-  MatrixX3d verts = verts0;
-  for(int j=1;j<=num_blendshapes;++j) {
-    verts += (blendshapes[j].vertices() - verts0) * params_model.Wexp_FACS(j);
-  }
-  mesh.vertices() = verts;
+  VectorXd verts = blendshape_base;
+  verts.noalias() += blendshape_deltas * params_model.Wexp_FACS.bottomRows(num_blendshapes);
+  mesh.vertices() = Map<const Matrix<double, Dynamic, 3, RowMajor>>(verts.data(), verts.size() / 3, 3);
   mesh.ComputeNormals();
 }
 
@@ -334,7 +376,7 @@ bool SingleImageReconstructor<Constraint>::Reconstruct(OptimizationParameters op
   bool iterative_recon_converged = false;
   int iterative_recon_run_i = 0;
 
-  MatrixXd wid_history(opt_params.num_initializations, 50);
+  MatrixXd wid_history;
 
   while(true) {
 
@@ -355,140 +397,198 @@ bool SingleImageReconstructor<Constraint>::Reconstruct(OptimizationParameters op
     }
 
     VectorXd wid0 = params_model.Wid;
-    for(int run_i = 0; run_i < opt_params.num_initializations; ++run_i) {
-      const int num_contour_points = 15;
 
-      // Reconstruction begins
-      params_model.Wid = StatsUtils::perturb(wid0, opt_params.perturbation_range, prior.sigma_Wid);
+    // Draw all perturbations up front, the restarts may run concurrently
+    vector<VectorXd> wid_inits(max(opt_params.num_initializations, 1));
+    for(auto &wid_init : wid_inits) {
+      wid_init = StatsUtils::perturb(wid0, opt_params.perturbation_range, prior.sigma_Wid);
+    }
 
-      ColorStream(ColorOutput::Red) << "Initial Error = " << ComputeError();
+    if(wid_inits.size() == 1) {
+      ReconstructFrom(wid_inits[0], opt_params, nullptr);
+      wid_history = params_model.Wid.transpose();
+    } else {
+      // Each restart works on its own copy of the reconstructor. The copies
+      // share the model core and the landmark cache, only the parameters and
+      // the projected landmark models are duplicated.
+      RestartMonitor monitor(opt_params.max_iters, opt_params.restart_cancel_margin);
+      vector<SingleImageReconstructor> restarts(opt_params.num_initializations, *this);
+      vector<int> finished(opt_params.num_initializations, 0);
+
+      #pragma omp parallel for schedule(dynamic, 1)
+      for(int run_i = 0; run_i < opt_params.num_initializations; ++run_i) {
+        // Visualizer windows can only be created on the GUI thread
+        restarts[run_i].display_step_result = false;
+        finished[run_i] = restarts[run_i].ReconstructFrom(wid_inits[run_i], opt_params, &monitor);
+      }
 
-      // Optimization parameters
-      const int kMaxIterations = opt_params.max_iters;
-      const double init_weights = 1.0;
-      prior.weight_Wid = opt_params.w_prior_id;
-      const double d_wid = opt_params.d_w_prior_id;
-      prior.weight_Wexp = opt_params.w_prior_exp;
-      const double d_wexp = opt_params.d_w_prior_exp;
-      int iters = 0;
+      // Keep the best restart, the identity weights of all finished restarts
+      // initialize the next round
+      vector<int> finished_runs;
+      int best_run = -1;
+      for(int run_i = 0; run_i < opt_params.num_initializations; ++run_i) {
+        if(!finished[run_i]) continue;
+        finished_runs.push_back(run_i);
+        if(best_run < 0 || restarts[run_i].recon_stats.avg_error < restarts[best_run].recon_stats.avg_error) {
+          best_run = run_i;
+        }
+      }
+      // The restart with the lowest error at an iteration is never cancelled
+      // there, so at least one restart finishes
+      assert(best_run >= 0);
 
-      // Before entering the main loop, estimate the translation and roataion around z-axis first
-      // No need to do this since the translation and rotation are initialized
-      // ProcrustesAnalysis();
+      wid_history.resize(finished_runs.size(), wid0.size());
+      for(size_t k = 0; k < finished_runs.size(); ++k) {
+        wid_history.row(k) = restarts[finished_runs[k]].params_model.Wid.transpose();
+      }
+      ColorStream(ColorOutput::Green) << finished_runs.size() << " of "
+                                      << opt_params.num_initializations
+                                      << " restarts finished, best error = "
+                                      << restarts[best_run].recon_stats.avg_error;
 
-      for (int i = 0; i < num_contour_points; ++i) {
-        params_recon.cons[i].weight = 0.5;
+      *this = restarts[best_run];
+    }
+
+    ++iterative_recon_run_i;
+  }
+
+  return true;
+}
+
+template<typename Constraint>
+bool SingleImageReconstructor<Constraint>::ReconstructFrom(
+  const VectorXd &wid_init, const OptimizationParameters &opt_params,
+  RestartMonitor *monitor) {
+  const int num_contour_points = 15;
+
+  // Reconstruction begins
+  params_model.Wid = wid_init;
+
+  ColorStream(ColorOutput::Red) << "Initial Error = " << ComputeError();
+
+  // Optimization parameters
+  const int kMaxIterations = opt_params.max_iters;
+  const double init_weights = 1.0;
+  prior.weight_Wid = opt_params.w_prior_id;
+  const double d_wid = opt_params.d_w_prior_id;
+  prior.weight_Wexp = opt_params.w_prior_exp;
+  const double d_wexp = opt_params.d_w_prior_exp;
+  int iters = 0;
+
+  // Before entering the main loop, estimate the translation and roataion around z-axis first
+  // No need to do this since the translation and rotation are initialized
+  // ProcrustesAnalysis();
+
+  for (int i = 0; i < num_contour_points; ++i) {
+    params_recon.cons[i].weight = 0.5;
+  }
+  OptimizeForPosition();
+  for (int i = 0; i < num_contour_points; ++i) {
+    params_recon.cons[i].weight = 1.0;
+  }
+
+  while (iters++ < kMaxIterations) {
+    ColorStream(ColorOutput::Green) << "Iteration " << iters << " begins.";
+    {
+      boost::timer::auto_cpu_timer timer_loop(
+        "[Main loop] Iteration time = %w seconds.\n");
+
+      if((opt_mode & (Identity | Expression))){
+        boost::timer::auto_cpu_timer timer(
+          "[Main loop] Multilinear model weights update time = %w seconds.\n");
+        //model.ApplyWeights(params_model.Wid, params_model.Wexp);
+        ApplyWeights();
       }
-      OptimizeForPosition();
-      for (int i = 0; i < num_contour_points; ++i) {
-        params_recon.cons[i].weight = 1.0;
+      //mesh.UpdateVertices(model.GetTM());
+      //mesh.ComputeNormals();
+      UpdateMesh();
+
+      if(opt_mode & Pose) {
+        for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
+          OptimizeForPose(iters);
+          UpdateContourIndices(iters);
+        }
       }
 
-      while (iters++ < kMaxIterations) {
-        ColorStream(ColorOutput::Green) << "Iteration " << iters << " begins.";
-        {
-          boost::timer::auto_cpu_timer timer_loop(
-            "[Main loop] Iteration time = %w seconds.\n");
-
-          if((opt_mode & (Identity | Expression))){
-            boost::timer::auto_cpu_timer timer(
-              "[Main loop] Multilinear model weights update time = %w seconds.\n");
-            //model.ApplyWeights(params_model.Wid, params_model.Wexp);
-            ApplyWeights();
-          }
-          //mesh.UpdateVertices(model.GetTM());
-          //mesh.ComputeNormals();
-          UpdateMesh();
-
-          if(opt_mode & Pose) {
-            for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
-              OptimizeForPose(iters);
-              UpdateContourIndices(iters);
-            }
-          }
-
-          if(opt_mode & Expression) {
-            //OptimizeForExpression(iters*100);
-            OptimizeForExpression_FACS(iters*10);
-          }
-
-          if(opt_mode & FocalLength) {
-            OptimizeForFocalLength();
-          }
-
-          if(opt_mode & Expression){
-            boost::timer::auto_cpu_timer timer(
-              "[Main loop] Multilinear model weights update time = %w seconds.\n");
-            //model.ApplyWeights(params_model.Wid, params_model.Wexp);
-            ApplyWeights();
-          }
-          //mesh.UpdateVertices(model.GetTM());
-          //mesh.ComputeNormals();
-          UpdateMesh();
-
-          if(opt_mode & Pose) {
-            for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
-              OptimizeForPose(iters);
-              UpdateContourIndices(iters);
-            }
-          }
-
-          if(opt_mode & Identity) {
-            OptimizeForIdentity(iters*10);
-          }
-
-          if(opt_mode & FocalLength) {
-            OptimizeForFocalLength();
-          }
-
-          double E = ComputeError();
-
-          ColorStream(ColorOutput::Red) << "Iteration " << iters << " Error = " <<
-          E;
-
-          // Adjust weights
-          prior.weight_Wid /= d_wid; prior.weight_Wid = max(prior.weight_Wid, 1.0);
-          prior.weight_Wexp /= d_wexp; prior.weight_Wexp = max(prior.weight_Wexp, 1.0);
-          for (int i = 0; i < num_contour_points; ++i) {
-            params_recon.cons[i].weight = sqrt(params_recon.cons[i].weight);
-          }
-        }
-        ColorStream(ColorOutput::Green) << "Iteration " << iters << " finished.";
-
-        // Visualize reconstruction result
-        if(display_step_result) {
-          //auto tm = GetGeometry();
-          //mesh.UpdateVertices(tm);
-          UpdateMesh();
-          auto R = GetRotation();
-          auto T = GetTranslation();
-          auto cam_params = GetCameraParameters();
-
-          MeshVisualizer *w = new MeshVisualizer("reconstruction result " + std::to_string(iters), mesh);
-          w->BindConstraints(params_recon.cons);
-          w->BindImage(img);
-          w->BindLandmarks(GetIndices());
-          w->BindUpdatedLandmarks(GetUpdatedIndices());
-          w->SetMeshRotationTranslation(R, T);
-          w->SetCameraParameters(cam_params);
-
-          double scale = 640.0 / params_cam.image_size.y;
-          w->resize(params_cam.image_size.x * scale, params_cam.image_size.y * scale);
-          w->show();
+      if(opt_mode & Expression) {
+        //OptimizeForExpression(iters*100);
+        OptimizeForExpression_FACS(iters*10);
+      }
+
+      if(opt_mode & FocalLength) {
+        OptimizeForFocalLength();
+      }
+
+      if(opt_mode & Expression){
+        boost::timer::auto_cpu_timer timer(
+          "[Main loop] Multilinear model weights update time = %w seconds.\n");
+        //model.ApplyWeights(params_model.Wid, params_model.Wexp);
+        ApplyWeights();
+      }
+      //mesh.UpdateVertices(model.GetTM());
+      //mesh.ComputeNormals();
+      UpdateMesh();
+
+      if(opt_mode & Pose) {
+        for (int pose_opt_iter = 0; pose_opt_iter < 1; ++pose_opt_iter) {
+          OptimizeForPose(iters);
+          UpdateContourIndices(iters);
         }
       }
 
-      cout << "Reconstruction done." << endl;
-      //model.ApplyWeights(params_model.Wid, params_model.Wexp);
+      if(opt_mode & Identity) {
+        OptimizeForIdentity(iters*10);
+      }
 
-      //SaveReconstructionResults(image_filename + "_run_"+ to_string(run_i) + ".res");
+      if(opt_mode & FocalLength) {
+        OptimizeForFocalLength();
+      }
 
-      wid_history.row(run_i) = params_model.Wid;
-    }
+      double E = ComputeError();
 
-    ++iterative_recon_run_i;
+      ColorStream(ColorOutput::Red) << "Iteration " << iters << " Error = " <<
+      E;
+
+      if(monitor != nullptr && !monitor->Report(iters - 1, E)) {
+        ColorStream(ColorOutput::Red) << "Restart cancelled at iteration " << iters;
+        return false;
+      }
+
+      // Adjust weights
+      prior.weight_Wid /= d_wid; prior.weight_Wid = max(prior.weight_Wid, 1.0);
+      prior.weight_Wexp /= d_wexp; prior.weight_Wexp = max(prior.weight_Wexp, 1.0);
+      for (int i = 0; i < num_contour_points; ++i) {
+        params_recon.cons[i].weight = sqrt(params_recon.cons[i].weight);
+      }
+    }
+    ColorStream(ColorOutput::Green) << "Iteration " << iters << " finished.";
+
+    // Visualize reconstruction result
+    if(display_step_result) {
+      //auto tm = GetGeometry();
+      //mesh.UpdateVertices(tm);
+      UpdateMesh();
+      auto R = GetRotation();
+      auto T = GetTranslation();
+      auto cam_params = GetCameraParameters();
+
+      MeshVisualizer *w = new MeshVisualizer("reconstruction result " + std::to_string(iters), mesh);
+      w->BindConstraints(params_recon.cons);
+      w->BindImage(img);
+      w->BindLandmarks(GetIndices());
+      w->BindUpdatedLandmarks(GetUpdatedIndices());
+      w->SetMeshRotationTranslation(R, T);
+      w->SetCameraParameters(cam_params);
+
+      double scale = 640.0 / params_cam.image_size.y;
+      w->resize(params_cam.image_size.x * scale, params_cam.image_size.y * scale);
+      w->show();
+    }
   }
 
+  cout << "Reconstruction done." << endl;
+  //model.ApplyWeights(params_model.Wid, params_model.Wexp);
+
   return true;
 }
 
@@ -628,6 +728,8 @@ void SingleImageReconstructor<Constraint>::OptimizeForPosition() {
     boost::timer::auto_cpu_timer timer_solve(
       "[Position optimization] Problem solve time = %w seconds.\n");
 
+    // Restarts are jittered with the seeded generator of this job
+    uniform_int_distribution<int> jitter(0, 127);
     const int max_tries = 5;
     for(int i=0;i<max_tries;++i) {
       ceres::Solver::Options options;
@@ -638,9 +740,9 @@ void SingleImageReconstructor<Constraint>::OptimizeForPosition() {
       DEBUG_OUTPUT(summary.BriefReport());
       //cout << params[0] << ' ' << params[1] << ' ' << params[2] << endl;
       if(i == max_tries - 1) break;
-      params[0] += (rand() % 128) / 128.0;
-      params[1] += (rand() % 128) / 128.0;
-      params[2] += (rand() % 128) / 128.0;
+      params[0] += jitter(rng) / 128.0;
+      params[1] += jitter(rng) / 128.0;
+      params[2] += jitter(rng) / 128.0;
     }
   }
 
@@ -1039,38 +1141,61 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression_FACS(
     0.5 * (params_recon.cons[32].data + params_recon.cons[34].data));
   double prior_scale = REFERENCE_SCALE / puple_distance;
 
-  // Define the optimization problem
-  ceres::Problem problem;
-
   VectorXd params = params_model.Wexp_FACS;
   cout << "params: " << params.transpose().eval() << endl;
   cout << params.size() << endl;
 
+#if USE_FACS_EXPRESSION_SOLVER
+  {
+    FACSExpressionSolver solver(params_recon.cons, Mview, Rmat, params_cam);
+    // Landmark rows of the blendshape delta matrix
+    const int num_points = params_recon.cons.size();
+    VectorXd P0(3 * num_points);
+    MatrixXd B(3 * num_points, blendshape_deltas.cols());
+    for(int i=0;i<num_points;++i) {
+      const int row = params_recon.cons[i].vidx * 3;
+      P0.segment<3>(3*i) = blendshape_base.segment<3>(row);
+      B.middleRows<3>(3*i) = blendshape_deltas.middleRows<3>(row);
+    }
+    solver.SetBasis(P0, B);
+    solver.SetPrior(prior.Wexp_avg, prior.inv_sigma_Wexp, prior.Uexp,
+                    prior.weight_Wexp * prior_scale);
+    const double reg_factor = 100.0 / puple_distance;
+    solver.SetSparsityWeight(10.0 / reg_factor * exp(-(iteration / 10 - 1) * 0.25));
+
+    // Optimize the last 46 weights only, with the iteration budget the
+    // ceres solver gets. The first pass has a budget of 0, it gets a floor.
+    const int min_solver_iters = 10;
+    VectorXd w = params.bottomRows(46);
+    solver.Solve(w, max(iteration, min_solver_iters));
+    params.bottomRows(46) = w;
+  }
+#else
+  // Define the optimization problem
+  ceres::Problem problem;
+
   {
     boost::timer::auto_cpu_timer timer_construction(
       "[Expression optimization] Problem construction time = %w seconds.\n");
     for (size_t i = 0; i < indices.size(); ++i) {
       //auto &model_i = model_projected[i];
 
-      MatrixX3d points_i(params.size(), 3);
-      for(int j=0;j<params.size();++j) {
-        points_i.row(j) = blendshapes[j].vertex(params_recon.cons[i].vidx);
-      }
+      const int row = params_recon.cons[i].vidx * 3;
+      Vector3d base_i = blendshape_base.segment<3>(row);
+      Matrix<double, 3, Dynamic> deltas_i = blendshape_deltas.middleRows<3>(row);
 
       //model_i.ApplyWeights(params_model.Wid, params_model.Wexp);
 #if 0 //USE_ANALYTIC_COST_FUNCTIONS
       ceres::CostFunction *cost_function = new ExpressionCostFunction_FACS_analytic(
-        points_i, params_recon.cons[i], params.size(), Mview, Rmat, prior.Uexp,
-        params_cam);
+        base_i, deltas_i, params_recon.cons[i], Mview, Rmat, params_cam);
 #else
       ceres::DynamicNumericDiffCostFunction<ExpressionCostFunction_FACS> *cost_function =
         new ceres::DynamicNumericDiffCostFunction<ExpressionCostFunction_FACS>(
-          new ExpressionCostFunction_FACS(points_i,
+          new ExpressionCostFunction_FACS(base_i,
+                                          deltas_i,
                                           params_recon.cons[i],
-                                          params.size(),
                                           Mview,
                                           Rmat,
-                                          prior.Uexp,
                                           params_cam));
       // Optimize the last 46 weights only
       cost_function->AddParameterBlock(params.size() - 1);
@@ -1144,6 +1269,7 @@ void SingleImageReconstructor<Constraint>::OptimizeForExpression_FACS(
       DEBUG_OUTPUT(summary.BriefReport())
     }
   }
+#endif
 
   // Update the model parameters
   DEBUG_OUTPUT(params_model.Wexp_FACS.transpose() << endl
@@ -0,0 +1,238 @@
+#ifndef STACKEDCOSTFUNCTIONS_H
+#define STACKEDCOSTFUNCTIONS_H
+
+// Stacked cost functions shared by costfunctions.h and costfunctions_exp.h.
+// Both headers include this one after ProjectPoint, include either of them
+// instead of this file.
+
+#include "common.h"
+#include "constraints.h"
+#include "multilinearmodel.h"
+#include "parameters.h"
+
+#include "glm/glm.hpp"
+#include <eigen3/Eigen/Dense>
+
+#include "ceres/ceres.h"
+
+// All landmarks of an image in a single residual block, for a weight vector
+// the landmarks are affine in: p_i = p0_i + B_i * w, which holds for either
+// mode of the model while the other mode is fixed. The per landmark bases are
+// packed into one 3N x d matrix, so an evaluation is one matrix-vector product
+// followed by N projections, and the problem holds one block instead of N
+// blocks each with its own copy of the model.
+//
+// Residuals 2i and 2i+1 are the 2D offset between the projected landmark i and
+// its constraint. Their squared norm equals the squared l2_norm residual of the
+// per landmark cost functions above, but the Jacobian stays smooth at the
+// optimum and is simply Jh * R * B_i.
+struct LandmarksCostFunction_2D_analytic : public ceres::CostFunction {
+  LandmarksCostFunction_2D_analytic(const vector<Constraint2D> &constraints,
+                                    const glm::dmat4 &Mview,
+                                    const glm::dmat4 &Rmat,
+                                    const CameraParameters &cam_params,
+                                    double weight)
+    : constraints(constraints), Mview(Mview), cam_params(cam_params),
+      weight(weight) {
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) R(i, j) = Rmat[j][i];
+    }
+    set_num_residuals(2 * constraints.size());
+  }
+
+  virtual bool Evaluate(double const *const *w,
+                        double *residuals,
+                        double **jacobians) const {
+    const int num_points = constraints.size();
+    VectorXd p = P0;
+    p.noalias() += B * Map<const VectorXd>(w[0], B.cols());
+
+    Map<Matrix<double, Dynamic, Dynamic, RowMajor>> J(
+      jacobians != NULL ? jacobians[0] : NULL, 2 * num_points, B.cols());
+    const double sy = cam_params.image_size.y;
+    const double f = cam_params.focal_length;
+
+    for (int i = 0; i < num_points; ++i) {
+      glm::dvec3 p_i(p[3*i], p[3*i+1], p[3*i+2]);
+      glm::dvec3 q = ProjectPoint(p_i, Mview, cam_params);
+      const double weight_i = constraints[i].weight * weight;
+      residuals[2*i] = (q.x - constraints[i].data.x) * weight_i;
+      residuals[2*i+1] = (q.y - constraints[i].data.y) * weight_i;
+
+      if (jacobians != NULL && jacobians[0] != NULL) {
+        glm::dvec4 P = Mview * glm::dvec4(p_i, 1.0);
+        const double inv_z0 = 1.0 / P.z;
+        const double common_factor = 0.5 * sy * f * inv_z0 * weight_i;
+        J.row(2*i) = common_factor * (P.x * inv_z0 * RB.row(3*i+2) - RB.row(3*i));
+        J.row(2*i+1) = common_factor * (P.y * inv_z0 * RB.row(3*i+2) - RB.row(3*i+1));
+      }
+    }
+
+    return true;
+  }
+
+protected:
+  void SetBasis(const VectorXd &P0_in, const MatrixXd &B_in) {
+    P0 = P0_in;
+    B = B_in;
+    RB.resize(B.rows(), B.cols());
+    for (int i = 0; i < B.rows(); i += 3) {
+      RB.middleRows(i, 3).noalias() = R * B.middleRows(i, 3);
+    }
+    mutable_parameter_block_sizes()->clear();
+    mutable_parameter_block_sizes()->push_back(B.cols());
+  }
+
+  // Rows 3i to 3i+2 of the result hold tm0^T or tm1^T of landmark i
+  static MatrixXd PackModes(const vector<MultilinearModel> &models,
+                            int num_points, bool mode1) {
+    const MatrixXd &tm_0 = mode1 ? models[0].GetTM1().GetData()
+                                 : models[0].GetTM0().GetData();
+    MatrixXd packed(3 * num_points, tm_0.rows());
+    for (int i = 0; i < num_points; ++i) {
+      packed.middleRows(3 * i, 3) = mode1 ? models[i].GetTM1().GetData().transpose()
+                                          : models[i].GetTM0().GetData().transpose();
+    }
+    return packed;
+  }
+
+  VectorXd P0;
+  MatrixXd B, RB;
+  Matrix3d R;
+  vector<Constraint2D> constraints;
+  glm::dmat4 Mview;
+  CameraParameters cam_params;
+  double weight;
+};
+
+// Identity weights of all landmarks, with the expression weights fixed
+struct IdentityCostFunction_stacked : public LandmarksCostFunction_2D_analytic {
+  IdentityCostFunction_stacked(const vector<MultilinearModel> &models,
+                               const vector<Constraint2D> &constraints,
+                               const glm::dmat4 &Mview,
+                               const glm::dmat4 &Rmat,
+                               const CameraParameters &cam_params,
+                               double weight = 1.0)
+    : LandmarksCostFunction_2D_analytic(constraints, Mview, Rmat, cam_params,
+                                        weight) {
+    MatrixXd B_id = PackModes(models, constraints.size(), true);
+    SetBasis(VectorXd::Zero(B_id.rows()), B_id);
+  }
+};
+
+// Expression weights of all landmarks, with the identity weights fixed
+struct ExpressionCostFunction_stacked : public LandmarksCostFunction_2D_analytic {
+  ExpressionCostFunction_stacked(const vector<MultilinearModel> &models,
+                                 const vector<Constraint2D> &constraints,
+                                 const glm::dmat4 &Mview,
+                                 const glm::dmat4 &Rmat,
+                                 const CameraParameters &cam_params,
+                                 double weight = 1.0)
+    : LandmarksCostFunction_2D_analytic(constraints, Mview, Rmat, cam_params,
+                                        weight) {
+    MatrixXd B_exp = PackModes(models, constraints.size(), false);
+    SetBasis(VectorXd::Zero(B_exp.rows()), B_exp);
+  }
+};
+
+// FACS expression weights of all landmarks. The first of the FACS weights is
+// 1 minus the sum of the others, so landmark i is affine in the remaining
+// weights: p_i = A_i(:, 0) + (A_i(:, 1:) - A_i(:, 0)) * w with
+// A_i = tm0_i^T * Uexp^T.
+struct ExpressionCostFunction_FACS_stacked : public LandmarksCostFunction_2D_analytic {
+  ExpressionCostFunction_FACS_stacked(const vector<MultilinearModel> &models,
+                                      const vector<Constraint2D> &constraints,
+                                      const glm::dmat4 &Mview,
+                                      const glm::dmat4 &Rmat,
+                                      const MatrixXd &Uexp,
+                                      const CameraParameters &cam_params,
+                                      double weight = 1.0)
+    : LandmarksCostFunction_2D_analytic(constraints, Mview, Rmat, cam_params,
+                                        weight) {
+    MatrixXd A = PackModes(models, constraints.size(), false) * Uexp.transpose();
+    SetBasis(A.col(0), A.rightCols(A.cols() - 1).colwise() - A.col(0));
+  }
+};
+
+// Head pose of all landmarks with fixed positions. Parameter blocks are the
+// euler angles (YXZ) and the translation, as in PoseCostFunction_analytic.
+struct PoseCostFunction_stacked : public ceres::CostFunction {
+  PoseCostFunction_stacked(const vector<MultilinearModel> &models,
+                           const vector<Constraint2D> &constraints,
+                           const CameraParameters &cam_params)
+    : points(4, constraints.size()), constraints(constraints),
+      cam_params(cam_params) {
+    for (size_t i = 0; i < constraints.size(); ++i) {
+      const Tensor1 &tm = models[i].GetTM();
+      points.col(i) = Vector4d(tm[0], tm[1], tm[2], 1.0);
+    }
+    mutable_parameter_block_sizes()->clear();
+    mutable_parameter_block_sizes()->push_back(3);
+    mutable_parameter_block_sizes()->push_back(3);
+    set_num_residuals(2 * constraints.size());
+  }
+
+  virtual bool Evaluate(double const *const *params,
+                        double *residuals,
+                        double **jacobians) const {
+    auto Ry = glm::eulerAngleY(params[0][0]);
+    auto Rx = glm::eulerAngleX(params[0][1]);
+    auto Rz = glm::eulerAngleZ(params[0][2]);
+    glm::dmat4 Rmat = Ry * Rx * Rz;
+    glm::dmat4 Tmat = glm::translate(glm::dmat4(1.0),
+                                     glm::dvec3(params[1][0], params[1][1],
+                                                params[1][2]));
+    glm::dmat4 Mview = Tmat * Rmat;
+
+    // Derivatives of the rotation w.r.t. the 3 angles, shared by all points
+    glm::dmat4 dR[3] = {
+      glm::dEulerAngleY(params[0][0]) * Rx * Rz,
+      Ry * glm::dEulerAngleX(params[0][1]) * Rz,
+      Ry * Rx * glm::dEulerAngleZ(params[0][2])
+    };
+
+    const double sy = cam_params.image_size.y;
+    const double f = cam_params.focal_length;
+
+    for (int i = 0; i < points.cols(); ++i) {
+      glm::dvec4 p(points(0, i), points(1, i), points(2, i), 1.0);
+      glm::dvec3 q = ProjectPoint(glm::dvec3(p), Mview, cam_params);
+      const double weight_i = constraints[i].weight;
+      residuals[2*i] = (q.x - constraints[i].data.x) * weight_i;
+      residuals[2*i+1] = (q.y - constraints[i].data.y) * weight_i;
+
+      if (jacobians == NULL) continue;
+
+      glm::dvec4 P = Mview * p;
+      const double inv_z0 = 1.0 / P.z;
+      const double common_factor = 0.5 * sy * f * inv_z0 * weight_i;
+      const double hx = common_factor * P.x * inv_z0;
+      const double hy = common_factor * P.y * inv_z0;
+
+      if (jacobians[0] != NULL) {
+        for (int k = 0; k < 3; ++k) {
+          glm::dvec4 dP = dR[k] * p;
+          jacobians[0][6*i+k] = -dP.x * common_factor + dP.z * hx;
+          jacobians[0][6*i+3+k] = -dP.y * common_factor + dP.z * hy;
+        }
+      }
+
+      if (jacobians[1] != NULL) {
+        jacobians[1][6*i] = -common_factor;
+        jacobians[1][6*i+1] = 0;
+        jacobians[1][6*i+2] = hx;
+        jacobians[1][6*i+3] = 0;
+        jacobians[1][6*i+4] = -common_factor;
+        jacobians[1][6*i+5] = hy;
+      }
+    }
+
+    return true;
+  }
+
+  Matrix<double, 4, Dynamic> points;
+  vector<Constraint2D> constraints;
+  CameraParameters cam_params;
+};
+
+#endif // STACKEDCOSTFUNCTIONS_H
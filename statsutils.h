@@ -15,6 +15,9 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <limits>
+#include <random>
+
 namespace StatsUtils {
 static MatrixXd cov(const MatrixXd& mat) {
   MatrixXd centered = mat.rowwise() - mat.colwise().mean();
@@ -96,6 +99,27 @@ static VectorXd randvec(int N, double range) {
   return v;
 }
 
+// Same as randvec and perturb, drawing from the given generator so that
+// concurrent callers with their own generators get reproducible results
+static VectorXd randvec(mt19937& gen, int N, double range) {
+  uniform_real_distribution<double> dist(-range, range);
+  VectorXd v(N);
+  for(int i=0;i<N;++i) {
+    v[i] = dist(gen);
+  }
+  return v;
+}
+
+static VectorXd perturb(mt19937& gen, const VectorXd& v, double range, const MatrixXd& cov_mat = MatrixXd()) {
+  VectorXd res = randvec(gen, v.rows(), range);
+  if(cov_mat.rows()>0 && cov_mat.cols()>0) {
+    for(int i=0;i<res.rows();++i) {
+      res[i] *= cov_mat(i, i);
+    }
+  }
+  return v + res;
+}
+
 static VectorXd perturb(const VectorXd& v, double range, const MatrixXd& cov_mat = MatrixXd()) {
   cout << "perturbation of identity weights ..." << endl;
   const int N = v.rows();
@@ -121,12 +145,166 @@ static vector<int> FindConsistentSet_kMeans(const MatrixXd& x, int k) {
   return vector<int>();
 }
 
+// Columns of p split into leaves of at most leaf_size columns that lie close
+// together, by recursively halving at the median of the coordinate with the
+// largest spread. Every leaf is bounded by a ball around its mean.
+struct BallLeaf {
+  vector<int> indices;
+  VectorXd center;
+  double radius;
+};
+
+static vector<BallLeaf> BuildBallLeaves(const MatrixXd& p, int leaf_size) {
+  vector<int> order(p.cols());
+  iota(order.begin(), order.end(), 0);
+
+  vector<BallLeaf> leaves;
+  vector<pair<int, int>> ranges;
+  if(!order.empty()) ranges.push_back(make_pair(0, static_cast<int>(order.size())));
+  while(!ranges.empty()) {
+    const int begin = ranges.back().first, end = ranges.back().second;
+    ranges.pop_back();
+
+    if(end - begin <= leaf_size) {
+      BallLeaf leaf;
+      leaf.indices.assign(order.begin() + begin, order.begin() + end);
+      leaf.center = VectorXd::Zero(p.rows());
+      for(int idx : leaf.indices) leaf.center += p.col(idx);
+      leaf.center /= static_cast<double>(leaf.indices.size());
+      leaf.radius = 0;
+      for(int idx : leaf.indices) leaf.radius = max(leaf.radius, (p.col(idx) - leaf.center).norm());
+      leaves.push_back(leaf);
+      continue;
+    }
+
+    VectorXd lo = p.col(order[begin]), hi = lo;
+    for(int i=begin+1;i<end;++i) {
+      lo = lo.cwiseMin(p.col(order[i]));
+      hi = hi.cwiseMax(p.col(order[i]));
+    }
+    int dim;
+    (hi - lo).maxCoeff(&dim);
+
+    const int mid = (begin + end) / 2;
+    nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                [&p, dim](int a, int b) { return p(dim, a) < p(dim, b); });
+    ranges.push_back(make_pair(begin, mid));
+    ranges.push_back(make_pair(mid, end));
+  }
+  return leaves;
+}
+
+// For every column q_i, the sum of the Gaussian weights exp(-|q_i - p_j|^2 / h^2)
+// over the columns p_j, plus the weighted sum of the p_j if psum is given. With
+// exclude_self the term j == i is left out. The squared distances of a block of
+// q come from one GEMM, |q_i|^2 + |p_j|^2 - 2 p^T q, and the blocks run in
+// parallel.
+//
+// A positive truncation drops the weights below it. Both p and q are then
+// grouped with BuildBallLeaves, and a block of q only visits the leaves of p
+// whose ball comes within the cutoff distance of one of its columns.
+static void GaussianKernelSums(const MatrixXd& p, const MatrixXd& q, double h,
+                               bool exclude_self, double truncation,
+                               VectorXd& wsum, MatrixXd* psum = nullptr) {
+  const int ndims = p.rows(), np = p.cols(), nq = q.cols();
+  const double inv_h2 = 1.0 / (h * h);
+  const bool truncate = truncation > 0;
+  const double cutoff2 = truncate ? -log(truncation) * h * h : numeric_limits<double>::infinity();
+  const double cutoff = sqrt(cutoff2);
+
+  const int kLeafSize = 64;
+  vector<BallLeaf> leaves;
+  MatrixXd centers;
+  VectorXd center_norms, radii;
+  if(truncate) {
+    leaves = BuildBallLeaves(p, kLeafSize);
+    centers.resize(ndims, leaves.size());
+    radii.resize(leaves.size());
+    for(size_t l=0;l<leaves.size();++l) {
+      centers.col(l) = leaves[l].center;
+      radii[l] = leaves[l].radius;
+    }
+    center_norms = centers.colwise().squaredNorm().transpose();
+  }
+
+  // Blocks of q, with truncation the leaves of q of up to kBlockSize columns,
+  // so that the columns of a block are close together
+  const int kBlockSize = 256;
+  vector<vector<int>> blocks;
+  if(truncate) {
+    for(auto& leaf : BuildBallLeaves(q, kBlockSize)) blocks.push_back(leaf.indices);
+  } else {
+    for(int i0=0;i0<nq;i0+=kBlockSize) {
+      blocks.push_back(vector<int>(min(kBlockSize, nq - i0)));
+      iota(blocks.back().begin(), blocks.back().end(), i0);
+    }
+  }
+
+  const VectorXd p_norms = p.colwise().squaredNorm().transpose();
+  wsum.resize(nq);
+  if(psum != nullptr) psum->resize(ndims, nq);
+
+  #pragma omp parallel for schedule(dynamic, 1)
+  for(int b=0;b<blocks.size();++b) {
+    const vector<int>& rows = blocks[b];
+    const int nb = rows.size();
+    MatrixXd qb(ndims, nb);
+    for(int i=0;i<nb;++i) qb.col(i) = q.col(rows[i]);
+    const RowVectorXd qb_norms = qb.colwise().squaredNorm();
+
+    // Columns of p in reach of the block, all of them without truncation
+    vector<int> cols;
+    MatrixXd p_block;
+    VectorXd p_block_norms;
+    if(truncate) {
+      MatrixXd DC = -2.0 * centers.transpose() * qb;
+      DC.colwise() += center_norms;
+      DC.rowwise() += qb_norms;
+      for(size_t l=0;l<leaves.size();++l) {
+        if(sqrt(max(DC.row(l).minCoeff(), 0.0)) - radii[l] <= cutoff) {
+          cols.insert(cols.end(), leaves[l].indices.begin(), leaves[l].indices.end());
+        }
+      }
+      p_block.resize(ndims, cols.size());
+      p_block_norms.resize(cols.size());
+      for(size_t c=0;c<cols.size();++c) {
+        p_block.col(c) = p.col(cols[c]);
+        p_block_norms[c] = p_norms[cols[c]];
+      }
+    }
+    const MatrixXd& P = truncate ? p_block : p;
+    const VectorXd& P_norms = truncate ? p_block_norms : p_norms;
+    const int nc = truncate ? cols.size() : np;
+
+    MatrixXd W = -2.0 * P.transpose() * qb;
+    W.colwise() += P_norms;
+    W.rowwise() += qb_norms;
+    for(int i=0;i<nb;++i) {
+      for(int c=0;c<nc;++c) {
+        const double d2 = max(W(c, i), 0.0);
+        const int j = truncate ? cols[c] : c;
+        W(c, i) = (d2 > cutoff2 || (exclude_self && j == rows[i])) ? 0.0 : exp(-d2 * inv_h2);
+      }
+    }
+
+    const RowVectorXd wsum_b = W.colwise().sum();
+    MatrixXd psum_b;
+    if(psum != nullptr) psum_b.noalias() = P * W;
+    for(int i=0;i<nb;++i) {
+      wsum[rows[i]] = wsum_b[i];
+      if(psum != nullptr) psum->col(rows[i]) = psum_b.col(i);
+    }
+  }
+}
+
 static vector<int> FindConsistentSet(const MatrixXd& x, double h, int k,
-                                     VectorXd* centroid_out=nullptr) {
+                                     VectorXd* centroid_out=nullptr,
+                                     double truncation=0.0) {
   // Meanshift until converged
   int ndims = x.rows(), nsamples = x.cols();
   MatrixXd m(ndims, nsamples);
   MatrixXd y = x;
+  VectorXd gsum;
   const double th = 1e-6;
   const int max_iters = 100;
   bool done = false;
@@ -134,22 +312,10 @@ static vector<int> FindConsistentSet(const MatrixXd& x, double h, int k,
   int iters = 0;
   double ms = 0;
   while(!done && iters < max_iters) {
-    for(int i=0;i<nsamples;++i) {
-      double gsum = 0;
-      VectorXd yi = VectorXd::Zero(ndims);
-      for(int j=0;j<nsamples;++j) {
-        if(j==i) continue;
-        else {
-          VectorXd dj = (y.col(i) - x.col(j))/h;
-          double gj = exp(-dj.transpose() * dj);
-          gsum += gj;
-          yi += gj * x.col(j);
-        }
-      }
-      m.col(i) = yi / (gsum + 1e-8);
-    }
+    GaussianKernelSums(x, y, h, true, truncation, gsum, &m);
+    m.array().rowwise() /= (gsum.array() + 1e-8).transpose();
 
-    ms = m.maxCoeff();
+    ms = (m - y).colwise().norm().maxCoeff();
 
     if(ms < th) {
       cout << "ms = " << ms << endl;
@@ -162,21 +328,11 @@ static vector<int> FindConsistentSet(const MatrixXd& x, double h, int k,
   }
 
   // Find the highest density cluster, compute its centroid
-  vector<double> d(nsamples, 0);
-  for(int i=0;i<nsamples;++i) {
-    for(int j=0;j<nsamples;++j) {
-      d[i] += exp(-(y.col(i) - y.col(j)).squaredNorm());
-    }
-  }
+  VectorXd d;
+  GaussianKernelSums(y, y, 1.0, false, truncation, d);
 
-  double max_d = 0;
   int max_idx = -1;
-  for(int i=0;i<nsamples;++i) {
-    if(d[i] > max_d) {
-      max_d = d[i];
-      max_idx = i;
-    }
-  }
+  d.maxCoeff(&max_idx);
 
   VectorXd centroid = y.col(max_idx);
   if(centroid_out != nullptr) {
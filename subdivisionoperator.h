@@ -0,0 +1,242 @@
+#ifndef MULTILINEARRECONSTRUCTION_SUBDIVISIONOPERATOR_H
+#define MULTILINEARRECONSTRUCTION_SUBDIVISIONOPERATOR_H
+
+#include "basicmesh.h"
+
+#include <eigen3/Eigen/Sparse>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+// Loop subdivision of a fixed topology as a sparse linear map. The subdivided
+// vertices of any mesh with that topology are S * V, with V the vertices as
+// rows, and the subdivided texture coordinates St * T. The faces do not depend
+// on the vertices and are computed once. Several levels compose into a
+// single operator. BasicMesh::Subdivide applies the operator of its own
+// topology.
+//
+// Build it once per topology through ForMesh, which caches the operators.
+// S * V is a single row major SpMV, parallel in Eigen with OpenMP, and the
+// vertices of several poses are subdivided at once by stacking their
+// coordinates as columns.
+class SubdivisionOperator {
+public:
+  typedef SparseMatrix<double, RowMajor> SparseMatrixType;
+
+  // Operator for the topology of the mesh, built on first use and shared by
+  // all meshes with the same faces and texture faces
+  static shared_ptr<const SubdivisionOperator> ForMesh(const BasicMesh& mesh, int levels = 1) {
+    static mutex cache_mutex;
+    static multimap<tuple<int, int, int, int>, shared_ptr<const SubdivisionOperator>> cache;
+
+    auto key = make_tuple(levels, mesh.NumVertices(), mesh.NumFaces(), mesh.NumTextureCoords());
+    lock_guard<mutex> lock(cache_mutex);
+    auto range = cache.equal_range(key);
+    for(auto it = range.first; it != range.second; ++it) {
+      if(it->second->SameTopology(mesh)) return it->second;
+    }
+
+    shared_ptr<const SubdivisionOperator> op(new SubdivisionOperator(mesh, levels));
+    cache.insert(make_pair(key, op));
+    return op;
+  }
+
+  SubdivisionOperator(const BasicMesh& mesh, int levels = 1)
+    : source_faces(mesh.faces), source_face_tex_index(mesh.face_tex_index),
+      num_source_texcoords(mesh.NumTextureCoords()) {
+    BasicMesh level_mesh = mesh;
+    for(int level = 0; level < levels; ++level) {
+      level_mesh.BuildHalfEdgeMesh();
+      SparseMatrixType S_level, St_level;
+      BuildLevel(level_mesh, S_level, St_level, faces, face_tex_index);
+      if(level == 0) {
+        S = S_level;
+        St = St_level;
+      } else {
+        S = (S_level * S).pruned();
+        St = (St_level * St).pruned();
+      }
+      if(level + 1 < levels) {
+        level_mesh.verts = S_level * level_mesh.verts;
+        level_mesh.texcoords = St_level * level_mesh.texcoords;
+        level_mesh.faces = faces;
+        level_mesh.face_tex_index = face_tex_index;
+      }
+    }
+  }
+
+  int NumVertices() const { return S.rows(); }
+  int NumFaces() const { return faces.rows(); }
+
+  const SparseMatrixType& matrix() const { return S; }
+
+  // Subdivided vertices, one vertex per row. Any number of columns, e.g. 3k
+  // for k poses of the mesh.
+  MatrixXd Apply(const MatrixXd& verts) const {
+    return S * verts;
+  }
+
+  // Subdivides the mesh in place
+  void Apply(BasicMesh& mesh) const {
+    mesh.verts = S * mesh.verts;
+    mesh.texcoords = St * mesh.texcoords;
+    mesh.faces = faces;
+    mesh.face_tex_index = face_tex_index;
+    mesh.vert_face_offsets.clear();
+    mesh.ComputeNormals();
+  }
+
+protected:
+  bool SameTopology(const BasicMesh& mesh) const {
+    if(mesh.NumTextureCoords() != num_source_texcoords || mesh.faces != source_faces) return false;
+    return num_source_texcoords == 0 || mesh.face_tex_index == source_face_tex_index;
+  }
+
+  // One level of Loop subdivision, see BasicMesh::Subdivide for the layout of
+  // the new vertices and faces. The mesh needs its half edge structure.
+  static void BuildLevel(BasicMesh& mesh, SparseMatrixType& S, SparseMatrixType& St,
+                         MatrixX3i& new_faces, MatrixX3i& new_face_tex_index) {
+    typedef Triplet<double> T;
+    const int num_verts = mesh.NumVertices();
+    const int num_faces = mesh.NumFaces();
+    HalfEdgeMesh& hemesh = mesh.hemesh;
+    auto& vhandles = mesh.vhandles;
+    auto& vhandles_map = mesh.vhandles_map;
+
+    // Weights of the edge points, in the order of their vertex pairs
+    map<pair<int, int>, vector<T>> midpoints;
+    for(HalfEdgeMesh::EdgeIter e=hemesh.edges_begin(); e!=hemesh.edges_end(); ++e) {
+      auto heh = hemesh.halfedge_handle(*e, 0);
+      auto hefh = hemesh.halfedge_handle(*e, 1);
+
+      int v0idx = vhandles_map[hemesh.to_vertex_handle(heh)];
+      int v1idx = vhandles_map[hemesh.to_vertex_handle(hefh)];
+
+      vector<T>& w = midpoints[make_pair(v0idx, v1idx)];
+      if(hemesh.is_boundary(*e)) {
+        w = {T(0, v0idx, 0.5), T(0, v1idx, 0.5)};
+      } else {
+        int v2idx = vhandles_map[hemesh.to_vertex_handle(hemesh.next_halfedge_handle(heh))];
+        int v3idx = vhandles_map[hemesh.to_vertex_handle(hemesh.next_halfedge_handle(hefh))];
+        w = {T(0, v0idx, 0.375), T(0, v1idx, 0.375), T(0, v2idx, 0.125), T(0, v3idx, 0.125)};
+      }
+    }
+
+    vector<T> coeffs;
+    coeffs.reserve(num_verts * 7 + midpoints.size() * 4);
+
+    // The old vertices are smoothed
+    for(int i=0;i<num_verts;++i) {
+      auto vh = vhandles[i];
+      if(hemesh.is_boundary(vh)) {
+        auto heh = hemesh.halfedge_handle(vh);
+        if(heh.is_valid()) {
+          auto to_vh = hemesh.to_vertex_handle(heh);
+          auto from_vh = hemesh.from_vertex_handle(hemesh.prev_halfedge_handle(heh));
+          coeffs.push_back(T(i, i, 0.75));
+          coeffs.push_back(T(i, vhandles_map[to_vh], 0.125));
+          coeffs.push_back(T(i, vhandles_map[from_vh], 0.125));
+        } else {
+          // Isolated vertex
+          coeffs.push_back(T(i, i, 1.0));
+        }
+      } else {
+        int valence = 0;
+        for(auto vvit = hemesh.vv_iter(vh); vvit.is_valid(); ++vvit) ++valence;
+        const double PI = 3.1415926535897;
+        const double wa = (0.375 + 0.25 * cos(2.0 * PI / valence));
+        const double w = (0.625 - wa * wa);
+        coeffs.push_back(T(i, i, 1 - w));
+        for(auto vvit = hemesh.vv_iter(vh); vvit.is_valid(); ++vvit) {
+          coeffs.push_back(T(i, vhandles_map[*vvit], w / valence));
+        }
+      }
+    }
+
+    // Followed by the edge points
+    map<pair<int, int>, int> midpoints_indices;
+    int new_idx = num_verts;
+    for(auto& p : midpoints) {
+      midpoints_indices[p.first] = new_idx;
+      midpoints_indices[make_pair(p.first.second, p.first.first)] = new_idx;
+      for(auto& t : p.second) coeffs.push_back(T(new_idx, t.col(), t.value()));
+      ++new_idx;
+    }
+
+    S.resize(new_idx, num_verts);
+    S.setFromTriplets(coeffs.begin(), coeffs.end());
+
+    // Every face gets its own texture coordinates at the edge midpoints,
+    // ordered by face and vertex pair. The texture faces are undefined
+    // without texture coordinates.
+    const int num_texcoords = mesh.NumTextureCoords();
+    const bool has_texcoords = num_texcoords > 0;
+    vector<T> tex_coeffs;
+    tex_coeffs.reserve(num_texcoords + num_faces * 6);
+    for(int i=0;i<num_texcoords;++i) tex_coeffs.push_back(T(i, i, 1.0));
+
+    vector<map<pair<int, int>, int>> midpoints_texcoords_indices(num_faces);
+    int new_texcoords_idx = num_texcoords;
+    for(int fidx=0;has_texcoords && fidx<num_faces;++fidx) {
+      map<pair<int, int>, pair<int, int>> face_midpoints;
+      const int j[] = {1, 2, 0};
+      for(int i=0;i<3;++i) {
+        face_midpoints.insert(make_pair(make_pair(mesh.faces(fidx, i), mesh.faces(fidx, j[i])),
+                                        make_pair(mesh.face_tex_index(fidx, i),
+                                                  mesh.face_tex_index(fidx, j[i]))));
+      }
+      for(auto& p : face_midpoints) {
+        midpoints_texcoords_indices[fidx][p.first] = new_texcoords_idx;
+        midpoints_texcoords_indices[fidx][make_pair(p.first.second, p.first.first)] = new_texcoords_idx;
+        tex_coeffs.push_back(T(new_texcoords_idx, p.second.first, 0.5));
+        tex_coeffs.push_back(T(new_texcoords_idx, p.second.second, 0.5));
+        ++new_texcoords_idx;
+      }
+    }
+
+    St.resize(new_texcoords_idx, num_texcoords);
+    St.setFromTriplets(tex_coeffs.begin(), tex_coeffs.end());
+
+    new_faces.resize(num_faces*4, 3);
+    new_face_tex_index.setZero(num_faces*4, 3);
+    for(int i=0;i<num_faces;++i) {
+      const int vidx0 = mesh.faces(i, 0), vidx1 = mesh.faces(i, 1), vidx2 = mesh.faces(i, 2);
+      const int nvidx01 = midpoints_indices.at(make_pair(vidx0, vidx1));
+      const int nvidx12 = midpoints_indices.at(make_pair(vidx1, vidx2));
+      const int nvidx20 = midpoints_indices.at(make_pair(vidx2, vidx0));
+
+      new_faces.row(i*4+0) = Vector3i(vidx0, nvidx01, nvidx20);
+      new_faces.row(i*4+1) = Vector3i(nvidx20, nvidx01, nvidx12);
+      new_faces.row(i*4+2) = Vector3i(nvidx20, nvidx12, vidx2);
+      new_faces.row(i*4+3) = Vector3i(nvidx01, vidx1, nvidx12);
+
+      if(!has_texcoords) continue;
+
+      const int tvidx0 = mesh.face_tex_index(i, 0);
+      const int tvidx1 = mesh.face_tex_index(i, 1);
+      const int tvidx2 = mesh.face_tex_index(i, 2);
+
+      auto& tex_indices = midpoints_texcoords_indices[i];
+      const int tnvidx01 = tex_indices.at(make_pair(vidx0, vidx1));
+      const int tnvidx12 = tex_indices.at(make_pair(vidx1, vidx2));
+      const int tnvidx20 = tex_indices.at(make_pair(vidx2, vidx0));
+
+      new_face_tex_index.row(i*4+0) = Vector3i(tvidx0, tnvidx01, tnvidx20);
+      new_face_tex_index.row(i*4+1) = Vector3i(tnvidx20, tnvidx01, tnvidx12);
+      new_face_tex_index.row(i*4+2) = Vector3i(tnvidx20, tnvidx12, tvidx2);
+      new_face_tex_index.row(i*4+3) = Vector3i(tnvidx01, tvidx1, tnvidx12);
+    }
+  }
+
+private:
+  // Topology the operator was built for
+  MatrixX3i source_faces, source_face_tex_index;
+  int num_source_texcoords;
+
+  SparseMatrixType S, St;
+  MatrixX3i faces, face_tex_index;
+};
+
+#endif // MULTILINEARRECONSTRUCTION_SUBDIVISIONOPERATOR_H
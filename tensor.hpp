@@ -115,9 +115,17 @@ public:
 
       fin.read(reinterpret_cast<char*>(&(m)), sizeof(int));
       fin.read(reinterpret_cast<char*>(&(n)), sizeof(int));
+      if(!fin || m < 0 || n < 0) {
+        cerr << "Invalid tensor file " << filename << endl;
+        return false;
+      }
       cout << "tensor size = " << m << "x" << n << endl;
       data.resize(m, n);
       fin.read(reinterpret_cast<char*>(data.data()), sizeof(double)*m*n);
+      if(!fin) {
+        cerr << "Tensor file " << filename << " is truncated." << endl;
+        return false;
+      }
 
       fin.close();
 
@@ -402,6 +410,10 @@ public:
       fin.read(reinterpret_cast<char*>(&(l)), sizeof(int));
       fin.read(reinterpret_cast<char*>(&(m)), sizeof(int));
       fin.read(reinterpret_cast<char*>(&(n)), sizeof(int));
+      if(!fin || l < 0 || m < 0 || n < 0) {
+        cerr << "Invalid tensor file " << filename << endl;
+        return false;
+      }
 
       this->resize(l, m, n);
 
@@ -409,6 +421,10 @@ public:
         Tensor2& ti = data[i];
         fin.read(reinterpret_cast<char*>(ti.rawptr()), sizeof(double)*m*n);
       }
+      if(!fin) {
+        cerr << "Tensor file " << filename << " is truncated." << endl;
+        return false;
+      }
 
       fin.close();
 
@@ -0,0 +1,137 @@
+#include <eigen3/Eigen/Dense>
+using namespace Eigen;
+
+#include "../statsutils.h"
+
+#include <omp.h>
+
+// Times StatsUtils::FindConsistentSet on synthetic identity weights: a main
+// cluster of consistent estimates, a few smaller clusters and uniform
+// outliers. Every size runs with the exact kernel and the truncated one, and
+// reports whether both pick the same set.
+//
+// A small problem is first checked against a naive pairwise mean-shift, the
+// test fails if either kernel selects a different set or centroid.
+MatrixXd GenerateSamples(int ndims, int nsamples, mt19937& gen) {
+  const int nclusters = 8;
+  normal_distribution<double> noise(0.0, 0.05);
+  MatrixXd centers(ndims, nclusters);
+  for(int c=0;c<nclusters;++c) centers.col(c) = StatsUtils::randvec(gen, ndims, 1.0);
+
+  MatrixXd x(ndims, nsamples);
+  uniform_real_distribution<double> u(0.0, 1.0);
+  for(int i=0;i<nsamples;++i) {
+    const double r = u(gen);
+    if(r < 0.1) {
+      x.col(i) = StatsUtils::randvec(gen, ndims, 1.5);
+      continue;
+    }
+    // Half of the samples in the first cluster
+    const int c = r < 0.55 ? 0 : 1 + static_cast<int>((r - 0.55) / 0.45 * (nclusters - 1));
+    for(int k=0;k<ndims;++k) x(k, i) = centers(k, c) + noise(gen);
+  }
+  return x;
+}
+
+// Mean-shift with one kernel evaluation per pair of samples, the reference for
+// FindConsistentSet. The set is every sample that converged to the mode of the
+// highest density, so that it is not decided by ties in the distances. The
+// modes of a cluster differ slightly since every sample leaves itself out.
+vector<int> NaiveConsistentSet(const MatrixXd& x, double h, VectorXd& centroid) {
+  const int ndims = x.rows(), nsamples = x.cols();
+  MatrixXd y = x, m(ndims, nsamples);
+  for(int iters=0;iters<100;++iters) {
+    for(int i=0;i<nsamples;++i) {
+      double gsum = 0;
+      VectorXd yi = VectorXd::Zero(ndims);
+      for(int j=0;j<nsamples;++j) {
+        if(j == i) continue;
+        const double g = exp(-(y.col(i) - x.col(j)).squaredNorm() / (h * h));
+        gsum += g;
+        yi += g * x.col(j);
+      }
+      m.col(i) = yi / (gsum + 1e-8);
+    }
+    const bool converged = (m - y).colwise().norm().maxCoeff() < 1e-6;
+    if(converged) break;
+    y = m;
+  }
+
+  VectorXd d = VectorXd::Zero(nsamples);
+  for(int i=0;i<nsamples;++i) {
+    for(int j=0;j<nsamples;++j) d[i] += exp(-(y.col(i) - y.col(j)).squaredNorm());
+  }
+  int max_idx = -1;
+  d.maxCoeff(&max_idx);
+  centroid = y.col(max_idx);
+
+  vector<int> consistent_set;
+  for(int i=0;i<nsamples;++i) {
+    if((y.col(i) - centroid).norm() < 0.1 * h) consistent_set.push_back(i);
+  }
+  return consistent_set;
+}
+
+bool CheckAgainstNaive(int ndims, int nsamples, double h, double truncation, mt19937& gen) {
+  MatrixXd x = GenerateSamples(ndims, nsamples, gen);
+  VectorXd naive_centroid;
+  vector<int> naive_set = NaiveConsistentSet(x, h, naive_centroid);
+  const int k = naive_set.size();
+
+  streambuf* cout_buf = cout.rdbuf(nullptr);
+  VectorXd exact_centroid, truncated_centroid;
+  vector<int> exact_set = StatsUtils::FindConsistentSet(x, h, k, &exact_centroid);
+  vector<int> truncated_set = StatsUtils::FindConsistentSet(x, h, k, &truncated_centroid, truncation);
+  cout.rdbuf(cout_buf);
+
+  sort(exact_set.begin(), exact_set.end());
+  sort(truncated_set.begin(), truncated_set.end());
+  const double exact_error = (exact_centroid - naive_centroid).norm();
+  const double truncated_error = (truncated_centroid - naive_centroid).norm();
+  cout << nsamples << " samples, " << k << " consistent: centroid error exact "
+       << exact_error << ", truncated " << truncated_error << endl;
+
+  // The modes are only converged to the mean-shift threshold of 1e-6
+  const double max_centroid_error = 1e-4;
+  bool passed = true;
+  if(exact_set != naive_set || exact_error > max_centroid_error) {
+    cerr << "Exact kernel does not match the naive mean-shift." << endl;
+    passed = false;
+  }
+  if(truncated_set != naive_set || truncated_error > max_centroid_error) {
+    cerr << "Truncated kernel does not match the naive mean-shift." << endl;
+    passed = false;
+  }
+  return passed;
+}
+
+int main(int argc, char** argv) {
+  const int max_samples = argc > 1 ? atoi(argv[1]) : 20000;
+  const int ndims = 50;
+  const double h = 0.5, truncation = 1e-8;
+
+  mt19937 gen(0);
+  if(!CheckAgainstNaive(ndims, 500, h, truncation, gen)) return 1;
+
+  for(int nsamples : {1000, 2000, 5000, 10000, 20000, 50000}) {
+    if(nsamples > max_samples) break;
+    MatrixXd x = GenerateSamples(ndims, nsamples, gen);
+    const int k = nsamples / 2;
+
+    // Silence the per iteration output
+    streambuf* cout_buf = cout.rdbuf(nullptr);
+    double t0 = omp_get_wtime();
+    vector<int> exact_set = StatsUtils::FindConsistentSet(x, h, k);
+    double t1 = omp_get_wtime();
+    vector<int> truncated_set = StatsUtils::FindConsistentSet(x, h, k, nullptr, truncation);
+    double t2 = omp_get_wtime();
+    cout.rdbuf(cout_buf);
+
+    sort(exact_set.begin(), exact_set.end());
+    sort(truncated_set.begin(), truncated_set.end());
+    cout << nsamples << " samples: exact " << t1 - t0 << " s, truncated "
+         << t2 - t1 << " s, same set: " << (exact_set == truncated_set ? "yes" : "no")
+         << endl;
+  }
+  return 0;
+}
@@ -0,0 +1,93 @@
+#include <QApplication>
+#include <QDir>
+#include "../OffscreenMeshVisualizer.h"
+#include "../meshrasterizer.h"
+#include "../basicmesh.h"
+#include "../ioutilities.h"
+#include "../multilinearmodel.h"
+#include "../parameters.h"
+#include "../utils.hpp"
+
+#include "boost/timer/timer.hpp"
+
+// Compares the face indices of the CPU rasterizer against the index encoded
+// GL render of the same reconstruction. Face 0 encodes to the background
+// color, so the coverage comes from a second, plain render. The two may only
+// disagree on pixels next to a triangle edge, where the rasterization rules
+// can break ties differently. The test fails on any other mismatch.
+int main(int argc, char** argv) {
+  if(argc < 2) {
+    cout << "Usage: " << argv[0] << " image" << endl;
+    return 0;
+  }
+
+  QApplication a(argc, argv);
+  const string home_directory = QDir::homePath().toStdString();
+
+  auto recon_results = LoadReconstructionResult(string(argv[1]) + ".res");
+
+  MultilinearModel model(home_directory + "/Data/Multilinear/blendshape_core.tensor");
+  model.ApplyWeights(recon_results.params_model.Wid, recon_results.params_model.Wexp);
+  BasicMesh mesh0(home_directory + "/Data/Multilinear/template.obj");
+  mesh0.UpdateVertices(model.GetTM());
+  mesh0.ComputeNormals();
+
+  const int width = recon_results.params_cam.image_size.x;
+  const int height = recon_results.params_cam.image_size.y;
+
+  OffscreenMeshVisualizer visualizer(width, height);
+  visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
+  visualizer.SetRenderMode(OffscreenMeshVisualizer::Mesh);
+  visualizer.BindMesh(mesh0);
+  visualizer.SetCameraParameters(recon_results.params_cam);
+  visualizer.SetMeshRotationTranslation(recon_results.params_model.R, recon_results.params_model.T);
+  visualizer.SetIndexEncoded(true);
+  visualizer.SetEnableLighting(false);
+  QImage img = visualizer.Render();
+
+  // Plain gray mesh on black, any nonzero pixel is covered
+  visualizer.SetIndexEncoded(false);
+  QImage coverage = visualizer.Render();
+
+  MeshRasterizer rasterizer(width, height);
+  rasterizer.SetCameraParameters(recon_results.params_cam);
+  rasterizer.SetMeshRotationTranslation(recon_results.params_model.R, recon_results.params_model.T);
+  {
+    boost::timer::auto_cpu_timer t("rasterization time = %w seconds.\n");
+    rasterizer.Rasterize(mesh0);
+  }
+
+  const vector<int>& face_indices = rasterizer.face_indices();
+
+  // A pixel is on an edge if a 4-neighbor in the CPU raster has another face
+  auto on_edge = [&](int x, int y) {
+    const int idx = face_indices[y * width + x];
+    return (x > 0 && face_indices[y * width + x - 1] != idx)
+        || (x < width - 1 && face_indices[y * width + x + 1] != idx)
+        || (y > 0 && face_indices[(y - 1) * width + x] != idx)
+        || (y < height - 1 && face_indices[(y + 1) * width + x] != idx);
+  };
+
+  int num_covered = 0, num_edge_mismatched = 0, num_interior_mismatched = 0;
+  for(int y=0, pidx=0;y<height;++y) {
+    for(int x=0;x<width;++x, ++pidx) {
+      QRgb pix = img.pixel(x, y);
+      int idx = qRed(pix) | (qGreen(pix) << 8) | (qBlue(pix) << 16);
+      if((coverage.pixel(x, y) & 0xffffff) == 0) idx = -1;
+      if(face_indices[pidx] >= 0) ++num_covered;
+      if(face_indices[pidx] != idx) {
+        if(on_edge(x, y)) ++num_edge_mismatched;
+        else ++num_interior_mismatched;
+      }
+    }
+  }
+  cout << "covered pixels: " << num_covered << endl;
+  cout << "mismatched edge pixels: " << num_edge_mismatched << endl;
+  cout << "mismatched interior pixels: " << num_interior_mismatched << endl;
+
+  if(num_covered == 0 || num_interior_mismatched > 0) {
+    cerr << "The rasterizer does not match the GL render." << endl;
+    return 1;
+  }
+  return 0;
+}
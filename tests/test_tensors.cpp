@@ -2,6 +2,8 @@
 #include "../third_party/Catch/include/catch.hpp"
 
 #include "../tensor.hpp"
+#include "../mappedtensor.hpp"
+#include "../modelcontainer.hpp"
 
 TEST_CASE("Tensor construction", "[all tensors]") {
   CHECK_NOTHROW( Tensor1(10) );
@@ -185,3 +187,137 @@ TEST_CASE("Tensor SVD", "[Tensor3]") {
   }
   CHECK( (trecon - t3).norm() < 1e-10 );
 }
+
+TEST_CASE("Mapped tensor", "[Tensor3]") {
+  Tensor3 t3{ { {0, 1, 2, 3},
+                {4, 5, 6, 7},
+                {8, 9, 10, 11} },
+              { {12, 13, 14, 15},
+                {16, 17, 18, 19},
+                {20, 21, 22, 23} } };
+
+  const string filename = "test_mapped_tensor.mtensor";
+  for(auto dtype : {MappedTensor3::Float64, MappedTensor3::Float32}) {
+    REQUIRE( MappedTensor3::Write(filename, t3, dtype) );
+    REQUIRE( MappedTensor3::IsMappedTensorFile(filename) );
+
+    MappedTensor3 mt3;
+    REQUIRE( mt3.MapFile(filename) );
+    CHECK( mt3.layers() == 2 );
+    CHECK( mt3.rows() == 3 );
+    CHECK( mt3.cols() == 4 );
+    for(int i=0;i<t3.layers();++i) {
+      for(int j=0;j<t3.rows();++j) {
+        for(int k=0;k<t3.cols();++k) {
+          CHECK( mt3(i, j, k) == t3(i, j, k) );
+        }
+      }
+    }
+
+    Tensor1 w0(2); w0 << 0.5, -2.0;
+    CHECK( (Tensor2(mt3.ModeProduct0(w0)) - t3.ModeProduct<0>(w0)).norm() < 1e-5 );
+
+    Tensor1 w1(3); w1 << 1.0, 0.25, -3.0;
+    CHECK( (Tensor2(mt3.ModeProduct1(w1)) - t3.ModeProduct<1>(w1)).norm() < 1e-5 );
+
+    Tensor3 tp = mt3.Project(vector<int>{0});
+    CHECK( tp.cols() == 3 );
+    CHECK( tp(1, 2, 2) == 22 );
+  }
+  remove(filename.c_str());
+
+  // Legacy tensor files are loaded into the same layout
+  const string legacy_filename = "test_mapped_tensor.tensor";
+  REQUIRE( t3.Write(legacy_filename) );
+  MappedTensor3 lt3;
+  REQUIRE( lt3.Load(legacy_filename) );
+  CHECK( lt3.type() == MappedTensor3::Float64 );
+  for(int i=0;i<t3.layers();++i) {
+    for(int j=0;j<t3.rows();++j) {
+      for(int k=0;k<t3.cols();++k) {
+        CHECK( lt3(i, j, k) == t3(i, j, k) );
+      }
+    }
+  }
+  remove(legacy_filename.c_str());
+}
+
+TEST_CASE("Model container", "[Tensor3]") {
+  Tensor3 t3{ { {0, 1, 2, 3},
+                {4, 5, 6, 7},
+                {8, 9, 10, 11} },
+              { {12, 13, 14, 15},
+                {16, 17, 18, 19},
+                {20, 21, 22, 23} } };
+  MatrixXd U = MatrixXd::Random(5, 3);
+  VectorXd w = VectorXd::Random(7);
+
+  const string filename = "test_model_container.mlmc";
+  ModelContainerWriter writer;
+  writer.AddTensor("core", t3, MappedTensor3::Float32);
+  writer.AddMatrix("u", U);
+  writer.AddVector("w", w);
+  REQUIRE( writer.Write(filename) );
+  REQUIRE( ModelContainer::IsContainerFile(filename) );
+
+  {
+    ModelContainer container;
+    REQUIRE( container.Open(filename) );
+
+    MappedTensor3 core;
+    REQUIRE( container.GetTensor("core", core) );
+    CHECK( core.layers() == 2 );
+    CHECK( core.rows() == 3 );
+    CHECK( core.cols() == 4 );
+    CHECK( core(1, 2, 3) == 23 );
+
+    MatrixXd U_in;
+    REQUIRE( container.GetMatrix("u", U_in) );
+    CHECK( U_in == U );
+
+    VectorXd w_in;
+    REQUIRE( container.GetVector("w", w_in) );
+    CHECK( w_in == w );
+
+    CHECK_FALSE( container.Has("missing") );
+    CHECK( container.VerifyPayloads() );
+    CHECK( container.VerifyPayloadsOnce() );
+    CHECK( ifstream(filename + ".verified").good() );
+  }
+  remove((filename + ".verified").c_str());
+
+  // Flip one byte of the last payload
+  {
+    fstream f(filename, ios::in | ios::out | ios::binary);
+    f.seekg(-64, ios::end);
+    char c; f.read(&c, 1);
+    c = ~c;
+    f.seekp(-64, ios::end);
+    f.write(&c, 1);
+  }
+  {
+    // Mapped payloads are only checked on request, copied ones on every read
+    ModelContainer container;
+    CHECK( container.Open(filename) );
+    VectorXd w_in;
+    CHECK_FALSE( container.GetVector("w", w_in) );
+    CHECK_FALSE( container.VerifyPayloads() );
+    CHECK_FALSE( container.VerifyPayloadsOnce() );
+    CHECK_FALSE( ifstream(filename + ".verified").good() );
+    CHECK_FALSE( container.Open(filename, true) );
+  }
+
+  // Truncated file
+  {
+    ifstream fin(filename, ios::binary);
+    string content((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+    fin.close();
+    ofstream fout(filename, ios::binary);
+    fout.write(content.data(), content.size() / 2);
+  }
+  {
+    ModelContainer container;
+    CHECK_FALSE( container.Open(filename) );
+  }
+  remove(filename.c_str());
+}
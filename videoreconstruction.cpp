@@ -37,7 +37,12 @@ int main(int argc, char *argv[]) {
   ("direct_multi_recon", "Use direct multi-recon")
   ("no_selection", "Disable selection")
   ("no_failure_detection", "Disable feature points failure detection")
-  ("no_progressive", "Diable progressive reconstruction");
+  ("no_progressive", "Diable progressive reconstruction")
+  ("keyframes", "Estimate the identity from keyframes diverse in pose and expression")
+  ("max_keyframes", po::value<int>()->default_value(16), "Maximum number of keyframes")
+  ("track", "Track the frames with a fixed identity instead of the full reconstruction")
+  ("bootstrap_frames", po::value<int>()->default_value(8), "Number of frames used to estimate the identity in tracking mode")
+  ("no_prediction", "Disable constant velocity prediction in tracking mode");
 
   po::variables_map vm;
 
@@ -72,7 +77,9 @@ int main(int argc, char *argv[]) {
   // Create reconstructor and load the common resources
   VideoReconstructor<Constraint2D> recon;
   recon.LoadModel(model_filename);
-  recon.LoadPriors(id_prior_filename, exp_prior_filename);
+  // A model container carries the priors as well
+  if(ModelContainer::IsContainerFile(model_filename)) recon.LoadPriors(model_filename);
+  else recon.LoadPriors(id_prior_filename, exp_prior_filename);
   recon.SetMesh(mesh);
   recon.SetContourIndices(contour_indices);
   recon.SetIndices(landmarks);
@@ -82,6 +89,10 @@ int main(int argc, char *argv[]) {
   recon.SetProgressiveReconState(!vm.count("no_progressive"));
   recon.SetDirectMultiRecon(vm.count("direct_multi_recon"));
   recon.SetUseInitReconResults(vm.count("use_init_res"));
+  recon.SetKeyframeSelectionState(vm.count("keyframes"));
+  recon.SetMaxKeyframes(vm["max_keyframes"].as<int>());
+  recon.SetTrackingBootstrapFrames(vm["bootstrap_frames"].as<int>());
+  recon.SetConstantVelocityPrediction(!vm.count("no_prediction"));
 
   if(vm.count("use_init_res")) {
     recon.SetInitReconResultsPath(vm["init_recon_path"].as<string>());
@@ -96,13 +107,13 @@ int main(int argc, char *argv[]) {
     fs::path pts_filename = settings_filepath.parent_path() / fs::path(p.second);
     cout << "[" << image_filename << ", " << pts_filename << "]" << endl;
 
-    auto image_points_pair = LoadImageAndPoints(image_filename.string(), pts_filename.string(), false);
-    recon.AddImagePointsPair(image_filename.string(), image_points_pair);
+    if(!recon.AddImage(image_filename.string(), pts_filename.string())) return 1;
   }
 
   {
     boost::timer::auto_cpu_timer t("Reconstruction finished in %w seconds.\n");
-    recon.Reconstruct();
+    if(vm.count("track")) recon.Track();
+    else recon.Reconstruct();
   }
 
   //return a.exec();
@@ -19,6 +19,11 @@
 #include "common.h"
 #include "constraints.h"
 #include "costfunctions_exp.h"
+#include "facetracker.h"
+#include "framesource.h"
+#include "jointidentitysolver.h"
+#include "keyframeselector.h"
+#include "meshrasterizer.h"
 #include "multilinearmodel.h"
 #include "parameters.h"
 #include "singleimagereconstructor.hpp"
@@ -86,31 +91,6 @@ namespace {
     return glm::dvec3(r, g, b);
   }
 
-  inline pair<set<int>, vector<int>> FindTrianglesIndices(const QImage& img) {
-    int w = img.width(), h = img.height();
-    set<int> S;
-    vector<int> indices_map(w*h);
-    for(int i=0, pidx = 0;i<h;++i) {
-      for(int j=0;j<w;++j, ++pidx) {
-        QRgb pix = img.pixel(j, i);
-        unsigned char r = static_cast<unsigned char>(qRed(pix));
-        unsigned char g = static_cast<unsigned char>(qGreen(pix));
-        unsigned char b = static_cast<unsigned char>(qBlue(pix));
-
-        if(r == 0 && g == 0 && b == 0) {
-          indices_map[pidx] = -1;
-          continue;
-        }
-        else {
-          int idx;
-          decode_index(r, g, b, idx);
-          S.insert(idx);
-          indices_map[pidx] = idx;
-        }
-      }
-    }
-    return make_pair(S, indices_map);
-  }
   static QImage TransferColor(const QImage& source, const QImage& target,
                               const vector<int>& valid_pixels_s,
                               const vector<int>& valid_pixels_t) {
@@ -231,22 +211,34 @@ template <typename Constraint>
 class VideoReconstructor {
 public:
   VideoReconstructor():
+    recon_context(make_shared<ReconstructionContext>()),
     enable_selection(true),
     enable_failure_detection(true),
     direct_multi_recon(false),
-    use_init_res(false) {}
-
+    use_init_res(false),
+    enable_keyframe_selection(false),
+    max_keyframes(16),
+    num_bootstrap_frames(8),
+    enable_velocity_prediction(true) {}
+
+  // The model and the priors are loaded once into the context shared by all
+  // single image reconstruction jobs
   void LoadModel(const string& filename) {
-    model = MultilinearModel(filename);
-    single_recon.LoadModel(filename);
+    recon_context->LoadModel(filename);
+    model = recon_context->model;
+    landmark_cache.Clear();
   }
   void LoadPriors(const string& filename_id, const string& filename_exp) {
-    prior.load(filename_id, filename_exp);
-    single_recon.LoadPriors(filename_id, filename_exp);
+    recon_context->LoadPriors(filename_id, filename_exp);
+    prior = recon_context->prior;
+  }
+  void LoadPriors(const string& filename) {
+    recon_context->LoadPriors(filename);
+    prior = recon_context->prior;
   }
   void SetContourIndices(const vector<vector<int>>& contour_indices_in) {
     contour_indices = contour_indices_in;
-    single_recon.SetContourIndices(contour_indices_in);
+    recon_context->SetContourIndices(contour_indices_in);
   }
   void SetMesh(const BasicMesh& mesh) {
     template_mesh = mesh;
@@ -255,20 +247,37 @@ public:
     init_indices = indices;
   }
 
-  void AddImagePointsPair(const string& filename, const pair<QImage, vector<Constraint>>& p) {
-    image_filenames.push_back(filename);
-    image_points_pairs.push_back(p);
+  // The landmarks are loaded right away, the image only when it is needed
+  bool AddImage(const string& image_filename, const string& pts_filename) {
+    if(!frames.AddFrame(image_filename, pts_filename)) return false;
+    image_filenames.push_back(image_filename);
+    return true;
   }
 
   bool Reconstruct();
 
+  // Real-time alternative to Reconstruct: the identity is estimated from the
+  // first few frames only, then every frame is fitted with a single fused
+  // pose and expression update warm started from the previous frame
+  bool Track();
+
   const Vector3d& GetRotation(int imgidx) const { return param_sets[imgidx].model.R; }
   const Vector3d& GetTranslation(int imgidx) const { return param_sets[imgidx].model.T; }
   const VectorXd& GetIdentityWeights(int imgidx) const { return param_sets[imgidx].model.Wid; }
   const VectorXd& GetExpressionWeights(int imgidx) const { return param_sets[imgidx].model.Wexp_FACS; }
-  const Tensor1& GetGeometry(int imgidx) const {
-    model.ApplyWeights(GetIdentityWeights(imgidx), GetExpressionWeights(imgidx));
-    return model.GetTM();
+  Tensor1 GetGeometry(int imgidx) const {
+    return model.EvaluateBatch(param_sets[imgidx].model.Wid, param_sets[imgidx].model.Wexp).col(0);
+  }
+  // Geometry of all images in one pass over the core, one column per image
+  MatrixXd GetGeometries() const {
+    const int num_images = param_sets.size();
+    MatrixXd Wid(param_sets.front().model.Wid.size(), num_images);
+    MatrixXd Wexp(param_sets.front().model.Wexp.size(), num_images);
+    for(int i=0;i<num_images;++i) {
+      Wid.col(i) = param_sets[i].model.Wid;
+      Wexp.col(i) = param_sets[i].model.Wexp;
+    }
+    return model.EvaluateBatch(Wid, Wexp);
   }
   const CameraParameters GetCameraParameters(int imgidx) const { return param_sets[imgidx].cam; }
   const vector<int> GetIndices(int imgidx) const { return param_sets[imgidx].indices; }
@@ -288,19 +297,25 @@ public:
 
   void SetInitReconResultsPath(const string& path) { init_recon_path = path; }
 
+  void SetKeyframeSelectionState(bool val) { enable_keyframe_selection = val; }
+  void SetMaxKeyframes(int n) { max_keyframes = n; }
+
+  void SetTrackingBootstrapFrames(int n) { num_bootstrap_frames = n; }
+  void SetConstantVelocityPrediction(bool val) { enable_velocity_prediction = val; }
+
 protected:
   void VisualizeReconstructionResult(const fs::path& folder, int i, bool scale_output=true) {
     // Visualize the reconstruction results
     #if 0
     MeshVisualizer w("reconstruction result", param_sets[i].mesh);
-    w.BindConstraints(image_points_pairs[i].second);
-    w.BindImage(image_points_pairs[i].first);
+    w.BindConstraints(frames.points(i));
+    w.BindImage(frames.image(i));
     w.BindLandmarks(init_indices);
 
     w.BindUpdatedLandmarks(param_sets[i].indices);
     w.SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
     w.SetCameraParameters(param_sets[i].cam);
-    w.resize(image_points_pairs[i].first.width(), image_points_pairs[i].first.height());
+    w.resize(frames.width(i), frames.height(i));
     w.show();
     w.paintGL();
     w.update();
@@ -310,8 +325,8 @@ protected:
 
     recon_image.save( (folder / fs::path(image_path.stem().string() + ".png")).string().c_str() );
     #else
-    int imgw = image_points_pairs[i].first.width();
-    int imgh = image_points_pairs[i].first.height();
+    int imgw = frames.width(i);
+    int imgh = frames.height(i);
     if(scale_output) {
       const int target_size = 640;
       double scale = static_cast<double>(target_size) / imgw;
@@ -323,7 +338,7 @@ protected:
     visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
     visualizer.SetRenderMode(OffscreenMeshVisualizer::MeshAndImage);
     visualizer.BindMesh(param_sets[i].mesh);
-    visualizer.BindImage(image_points_pairs[i].first);
+    visualizer.BindImage(frames.image(i));
     visualizer.SetCameraParameters(param_sets[i].cam);
     visualizer.SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
     visualizer.SetIndexEncoded(false);
@@ -335,8 +350,30 @@ protected:
     #endif
   }
 
+  void SaveReconstructionResult(const fs::path& folder, int i) {
+    ofstream fout(
+      (folder / fs::path(fs::path(image_filenames[i]).filename().string() + ".res")).string()
+    );
+    fout << param_sets[i].cam << endl;
+    fout << param_sets[i].model << endl;
+    fout << param_sets[i].stats << endl;
+    fout.close();
+  }
+
+  // Default parameters for every image
+  void InitializeParameterSets();
+
+  // Refines identity weights shared by the given images, with their poses and
+  // expressions fixed
+  void SolveJointIdentity(const vector<int>& image_set, VectorXd& Wid);
+
+  // Sets slot k of the solver to the landmarks of image i. The landmarks of
+  // the image must be in the cache already.
+  void SetJointIdentityImage(JointIdentitySolver& solver, int k, int i) const;
+
 private:
   MultilinearModel model;
+  MultilinearModelCache landmark_cache;
   MultilinearModelPrior prior;
   vector<vector<int>> contour_indices;
   vector<int> init_indices;
@@ -353,8 +390,8 @@ private:
     ReconstructionStats stats;
   };
 
-  // Input image points pairs
-  vector<pair<QImage, vector<Constraint>>> image_points_pairs;
+  // Input images and points, decoded on demand
+  FrameSource frames;
   vector<string> image_filenames;
 
   // AAM model for consistent set selection
@@ -363,8 +400,8 @@ private:
   // A set of parameters for each image
   vector<ParameterSet> param_sets;
 
-  // The worker for single image reconstruction
-  SingleImageReconstructor<Constraint> single_recon;
+  // Model data shared by the single image reconstruction jobs
+  shared_ptr<ReconstructionContext> recon_context;
 
   bool enable_selection;
   bool enable_failure_detection;
@@ -373,6 +410,14 @@ private:
   bool use_init_res;
 
   string init_recon_path;
+
+  // Keyframes instead of all frames for the identity
+  bool enable_keyframe_selection;
+  int max_keyframes;
+
+  // Tracking mode
+  int num_bootstrap_frames;
+  bool enable_velocity_prediction;
 };
 
 namespace {
@@ -388,6 +433,77 @@ namespace {
   }
 }
 
+template <typename Constraint>
+void VideoReconstructor<Constraint>::InitializeParameterSets() {
+  const int num_images = frames.size();
+  param_sets.resize(num_images);
+  for(size_t i=0;i<num_images;++i) {
+    auto& params = param_sets[i];
+    params.indices = init_indices;
+    params.mesh = template_mesh;
+
+    const int image_width = frames.width(i);
+    const int image_height = frames.height(i);
+
+    // camera parameters
+    cout << image_width << "x" << image_height << endl;
+    params.cam = CameraParameters::DefaultParameters(image_width, image_height);
+    cout << params.cam.image_size.x << ", " << params.cam.image_size.y << endl;
+
+    // model parameters
+    params.model = ModelParameters::DefaultParameters(prior.Uid, prior.Uexp);
+
+    // reconstruction parameters
+    params.recon.cons = frames.points(i);
+    params.recon.imageWidth = image_width;
+    params.recon.imageHeight = image_height;
+  }
+}
+
+template <typename Constraint>
+void VideoReconstructor<Constraint>::SolveJointIdentity(const vector<int>& image_set, VectorXd& Wid) {
+  // Pack the landmarks of all images up front, the cache is not thread safe
+  for(auto i : image_set) landmark_cache.Update(model, param_sets[i].indices);
+
+  JointIdentitySolver solver(prior.Wid_avg, prior.inv_sigma_Wid,
+                             prior.weight_Wid * image_set.size(),
+                             image_set.size());
+
+  // Add constraints from each image
+  #pragma omp parallel for schedule(dynamic, 1)
+  for(int set_i=0;set_i<image_set.size();++set_i) {
+    SetJointIdentityImage(solver, set_i, image_set[set_i]);
+  }
+
+  solver.Solve(Wid);
+}
+
+template <typename Constraint>
+void VideoReconstructor<Constraint>::SetJointIdentityImage(
+  JointIdentitySolver& solver, int k, int i) const {
+  vector<MultilinearModel> model_projected_i(param_sets[i].indices.size());
+  for(size_t j=0;j<param_sets[i].indices.size();++j) {
+    model_projected_i[j] = landmark_cache.GetModel(param_sets[i].indices[j]);
+    model_projected_i[j].ApplyWeights(param_sets[i].model.Wid, param_sets[i].model.Wexp);
+  }
+
+  glm::dmat4 Rmat_i = glm::eulerAngleYXZ(param_sets[i].model.R[0], param_sets[i].model.R[1],
+                                         param_sets[i].model.R[2]);
+  glm::dmat4 Tmat_i = glm::translate(glm::dmat4(1.0),
+                                     glm::dvec3(param_sets[i].model.T[0],
+                                                param_sets[i].model.T[1],
+                                                param_sets[i].model.T[2]));
+  glm::dmat4 Mview_i = Tmat_i * Rmat_i;
+
+  double puple_distance = glm::distance(
+    0.5 * (param_sets[i].recon.cons[28].data + param_sets[i].recon.cons[30].data),
+    0.5 * (param_sets[i].recon.cons[32].data + param_sets[i].recon.cons[34].data));
+  double weight_i = 100.0 / puple_distance;
+
+  solver.SetImage(k, model_projected_i, param_sets[i].recon.cons, Mview_i, Rmat_i,
+                  param_sets[i].cam, weight_i);
+}
+
 template <typename Constraint>
 bool VideoReconstructor<Constraint>::Reconstruct() {
   cout << "Reconstruction begins..." << endl;
@@ -469,7 +585,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
   safe_create(result_path);
   cout << "directory created ..." << endl;
 
-  const int num_images = image_points_pairs.size();
+  const int num_images = frames.size();
 
   // Initialize the parameter sets
   if(use_init_res) {
@@ -485,11 +601,11 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
       auto& params = param_sets[i];
       params.indices = to_vector(init_recon_result_i.params_model.vindices);
       params.mesh = template_mesh;
-      model.ApplyWeights(init_recon_result_i.params_model.Wid, init_recon_result_i.params_model.Wexp);
+      model.ApplyWeights(init_recon_result_i.params_model.Wid, init_recon_result_i.params_model.Wexp, MultilinearModel::KeepNone);
       params.mesh.UpdateVertices(model.GetTM());
 
-      const int image_width = image_points_pairs[i].first.width();
-      const int image_height = image_points_pairs[i].first.height();
+      const int image_width = frames.width(i);
+      const int image_height = frames.height(i);
 
       // camera parameters
       cout << image_width << "x" << image_height << endl;
@@ -500,33 +616,12 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
       params.model = init_recon_result_i.params_model;
 
       // reconstruction parameters
-      params.recon.cons = image_points_pairs[i].second;
+      params.recon.cons = frames.points(i);
       params.recon.imageWidth = image_width;
       params.recon.imageHeight = image_height;
     }
   } else {
-    param_sets.resize(num_images);
-    for(size_t i=0;i<num_images;++i) {
-      auto& params = param_sets[i];
-      params.indices = init_indices;
-      params.mesh = template_mesh;
-
-      const int image_width = image_points_pairs[i].first.width();
-      const int image_height = image_points_pairs[i].first.height();
-
-      // camera parameters
-      cout << image_width << "x" << image_height << endl;
-      params.cam = CameraParameters::DefaultParameters(image_width, image_height);
-      cout << params.cam.image_size.x << ", " << params.cam.image_size.y << endl;
-
-      // model parameters
-      params.model = ModelParameters::DefaultParameters(prior.Uid, prior.Uexp);
-
-      // reconstruction parameters
-      params.recon.cons = image_points_pairs[i].second;
-      params.recon.imageWidth = image_width;
-      params.recon.imageHeight = image_height;
-    }
+    InitializeParameterSets();
   }
 
   // Initialize AAM model
@@ -542,14 +637,13 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
 
   vector<int> inliers;
   if(enable_failure_detection) {
-    vector<QImage> images(image_points_pairs.size());
-    vector<cv::Mat> points(image_points_pairs.size());
+    vector<QImage> images(frames.size());
+    vector<cv::Mat> points(frames.size());
 
     // Collect input images and points
-    for(int i=0;i<image_points_pairs.size();++i) {
-      images[i] = image_points_pairs[i].first;
-      points[i] = constraints_to_mat(image_points_pairs[i].second,
-                                     image_points_pairs[i].first.height());
+    for(int i=0;i<frames.size();++i) {
+      images[i] = frames.image(i);
+      points[i] = constraints_to_mat(frames.points(i), frames.height(i));
     }
 
     aam.SetOutputPath(result_path.string());
@@ -567,6 +661,10 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
 
   VectorXd identity_centroid;
 
+  // Pack the landmarks once for all jobs, the context is read only from here on
+  recon_context->CacheLandmarks(init_indices);
+  landmark_cache = recon_context->landmark_cache;
+
   // Main reconstruction loop
   //  1. Use single image reconstructor to do per-image reconstruction first
   //  2. Select a consistent set of images for joint reconstruction
@@ -603,13 +701,22 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
       fs::path step_single_recon_result_path = step_result_path / fs::path("single_recon");
       safe_create(step_single_recon_result_path);
       for(int i=0;i<num_images;++i) {
+        SingleImageReconstructor<Constraint> single_recon(recon_context);
         single_recon.SetMesh(param_sets[i].mesh);
         single_recon.SetIndices(param_sets[i].indices);
         single_recon.SetImageSize(param_sets[i].recon.imageWidth, param_sets[i].recon.imageHeight);
         single_recon.SetConstraints(param_sets[i].recon.cons);
 
         single_recon.SetInitialParameters(param_sets[i].model, param_sets[i].cam);
-        if(iters_main_loop > 1) single_recon.SetIdentityPrior(identity_centroid);
+        if(iters_main_loop > 1) {
+          // From the second round on the identity comes from the joint step
+          single_recon.SetIdentityPrior(identity_centroid);
+          single_recon.SetOptimizationMode(
+            static_cast<typename SingleImageReconstructor<Constraint>::OptimizationMode>(
+              SingleImageReconstructor<Constraint>::Pose
+              | SingleImageReconstructor<Constraint>::Expression
+              | SingleImageReconstructor<Constraint>::FocalLength));
+        }
 
         // Perform reconstruction
         if(!direct_multi_recon) {
@@ -644,12 +751,14 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
       fs::path selection_result_path = step_result_path / fs::path("selection");
       safe_create(selection_result_path);
 
-      int selection_method = enable_selection?1:2;
+      int selection_method = enable_keyframe_selection?3:(enable_selection?1:2);
 
       switch(selection_method) {
         case 0: {
           const double ratios[] = {0.0, 0.4, 0.6, 0.8};
-          consistent_set = StatsUtils::FindConsistentSet(identity_weights, 0.5, ratios[iters_main_loop] * num_images, &identity_centroid);
+          // Long sequences have thousands of frames, drop the negligible kernel weights
+          consistent_set = StatsUtils::FindConsistentSet(identity_weights, 0.5, ratios[iters_main_loop] * num_images,
+                                                         &identity_centroid, 1e-8);
           assert(consistent_set.size() > 0);
           for(auto i : consistent_set) {
             VisualizeReconstructionResult(selection_result_path, i);
@@ -714,24 +823,17 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
             {
               for(int img_i=0;img_i<num_images;++img_i) {
                 const auto& mesh = param_sets[img_i].mesh;
+                const QImage input_image = frames.image(img_i);
+
+                // for each image bundle, rasterize the mesh with culling to get the visible triangles
+                MeshRasterizer rasterizer(frames.width(img_i), frames.height(img_i));
+                rasterizer.SetCameraParameters(param_sets[img_i].cam);
+                rasterizer.SetMeshRotationTranslation(param_sets[img_i].model.R, param_sets[img_i].model.T);
+                rasterizer.Rasterize(param_sets[img_i].mesh);
 
-                // for each image bundle, render the mesh to FBO with culling to get the visible triangles
-                OffscreenMeshVisualizer visualizer(image_points_pairs[img_i].first.width(),
-                                                   image_points_pairs[img_i].first.height());
-                visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
-                visualizer.SetRenderMode(OffscreenMeshVisualizer::Mesh);
-                visualizer.BindMesh(param_sets[img_i].mesh);
-                visualizer.SetCameraParameters(param_sets[img_i].cam);
-                visualizer.SetMeshRotationTranslation(param_sets[img_i].model.R, param_sets[img_i].model.T);
-                visualizer.SetIndexEncoded(true);
-                visualizer.SetEnableLighting(false);
-                QImage img = visualizer.Render();
-                //img.save("mesh.png");
-
-                // find the visible triangles from the index map
-                auto triangles_indices_pair = FindTrianglesIndices(img);
-                set<int> triangles = triangles_indices_pair.first;
-                face_indices_maps.push_back(triangles_indices_pair.second);
+                // the visible triangles and the index map
+                set<int> triangles = rasterizer.VisibleFaces();
+                face_indices_maps.push_back(rasterizer.face_indices());
                 cerr << "triangles = " << triangles.size() << endl;
 
                 // get the projection parameters
@@ -747,7 +849,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
                 // FOR DEBUGGING
                 #if 0
                 // for each visible triangle, compute the coordinates of its 3 corners
-                QImage img_vertices = img;
+                QImage img_vertices = input_image;
                 vector<vector<glm::dvec3>> triangles_projected;
                 for(auto tidx : triangles) {
                   auto face_i = mesh.face(tidx);
@@ -792,7 +894,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
                       glm::dvec3 v_img = ProjectPoint(glm::dvec3(v[0], v[1], v[2]), Mview, param_sets[img_i].cam);
 
                       // take the pixel from the input image through bilinear sampling
-                      glm::dvec3 texel = bilinear_sample(image_points_pairs[img_i].first, v_img.x, image_points_pairs[img_i].first.height()-1-v_img.y);
+                      glm::dvec3 texel = bilinear_sample(input_image, v_img.x, input_image.height()-1-v_img.y);
 
                       if(texel.r < 0 && texel.g < 0 && texel.b < 0) continue;
 
@@ -879,11 +981,15 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
 
           // Rendering the albedo to each image
           vector<QImage> albedo_images(num_images);
-          //#pragma omp parallel for
-          for(int i=0;i<num_images;++i) {
+
+          // Render a few images ahead on the render queue, so comparing the
+          // textures of image i overlaps rendering the following ones
+          OffscreenRenderQueue render_queue;
+          vector<future<OffscreenRenderQueue::RenderResult>> albedo_renders(num_images);
+          auto submit_albedo_render = [&](int i) {
             // for each image bundle, render the mesh to FBO with culling to get the visible triangles
-            OffscreenMeshVisualizer visualizer(image_points_pairs[i].first.width(),
-                                               image_points_pairs[i].first.height());
+            OffscreenMeshVisualizer visualizer(frames.width(i),
+                                               frames.height(i));
             visualizer.SetMVPMode(OffscreenMeshVisualizer::CamPerspective);
             visualizer.SetRenderMode(OffscreenMeshVisualizer::TexturedMesh);
             visualizer.BindMesh(param_sets[i].mesh);
@@ -891,15 +997,23 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
             visualizer.SetCameraParameters(param_sets[i].cam);
             visualizer.SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
             visualizer.SetFacesToRender(valid_faces_indices);
+            albedo_renders[i] = render_queue.Submit(move(visualizer));
+          };
+          const int render_lookahead = 4;
+          for(int i=0;i<min(render_lookahead, num_images);++i) submit_albedo_render(i);
+
+          for(int i=0;i<num_images;++i) {
+            if(i + render_lookahead < num_images) submit_albedo_render(i + render_lookahead);
 
             vector<float> depth_i;
-            tie(albedo_images[i],depth_i) = visualizer.RenderWithDepth();
+            tie(albedo_images[i],depth_i) = albedo_renders[i].get();
 
             auto unpack_pixel = [](QRgb pix) {
               return Vector3d(qRed(pix)/255.0, qGreen(pix)/255.0, qBlue(pix)/255.0);
             };
-            int img_w = image_points_pairs[i].first.width();
-            int img_h = image_points_pairs[i].first.height();
+            const QImage input_image = frames.image(i);
+            int img_w = frames.width(i);
+            int img_h = frames.height(i);
 
             vector<int> valid_pixels_map_i;
             for(int y=0;y<img_h;++y) {
@@ -913,7 +1027,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
               }
             }
 
-            albedo_images[i] = TransferColor(albedo_images[i], image_points_pairs[i].first,
+            albedo_images[i] = TransferColor(albedo_images[i], input_image,
                                              valid_pixels_map_i, valid_pixels_map_i);
             #if DEBUG_RECON
             albedo_images[i].save( (step_result_path / fs::path("albedo_" + std::to_string(i) + ".png")).string().c_str() );
@@ -936,7 +1050,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
                   #endif
                   valid_count++;
                   QRgb pix1 = albedo_images[i].pixel(x, y);
-                  QRgb pix2 = image_points_pairs[i].first.pixel(x, y);
+                  QRgb pix2 = input_image.pixel(x, y);
                   auto p1 = unpack_pixel(pix1);
                   auto p2 = unpack_pixel(pix2);
                   double dr = p1[0] - p2[0];
@@ -992,6 +1106,19 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
           // nothing to do, just use whatever consistent_set is
           break;
         }
+        case 3: {
+          // Keyframes that differ in pose and expression, in a single pass over
+          // the inliers instead of comparing all pairs of images
+          KeyframeSelector selector(max_keyframes);
+          for(auto i : inliers) selector.AddFrame(i, param_sets[i].model);
+
+          consistent_set = selector.keyframes();
+          std::sort(consistent_set.begin(), consistent_set.end());
+          for(auto i : consistent_set) {
+            VisualizeReconstructionResult(selection_result_path, i);
+          }
+          break;
+        }
       }
 
       // Compute the centroid of the consistent set
@@ -1038,6 +1165,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
         safe_create(joint_pre_result_path);
 
         for(auto i : consistent_set) {
+          SingleImageReconstructor<Constraint> single_recon(recon_context);
           single_recon.SetMesh(param_sets[i].mesh);
           single_recon.SetIndices(param_sets[i].indices);
           single_recon.SetImageSize(param_sets[i].recon.imageWidth, param_sets[i].recon.imageHeight);
@@ -1078,15 +1206,20 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
           fs::path joint_post_result_path = step_result_path / fs::path("joint_recon_" + to_string(iters_joint_optimization) + "_post");
           safe_create(joint_post_result_path);
 
-          ceres::Problem problem;
           VectorXd params = param_sets[0].model.Wid;
 
+#if USE_JOINT_IDENTITY_SOLVER
+          SolveJointIdentity(consistent_set, params);
+#else
+          ceres::Problem problem;
+
           // Add constraints from each image
           for(auto i : consistent_set) {
             // Create a projected model first
+            landmark_cache.Update(model, param_sets[i].indices);
             vector<MultilinearModel> model_projected_i(param_sets[i].indices.size());
             for(size_t j=0;j<param_sets[i].indices.size();++j) {
-              model_projected_i[j] = model.project(vector<int>(1, param_sets[i].indices[j]));
+              model_projected_i[j] = landmark_cache.GetModel(param_sets[i].indices[j]);
               model_projected_i[j].ApplyWeights(param_sets[i].model.Wid, param_sets[i].model.Wexp);
             }
 
@@ -1105,6 +1238,12 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
             double weight_i = 100.0 / puple_distance;
 
             // Add per-vertex constraints
+#if USE_ANALYTIC_COST_FUNCTIONS
+            ceres::CostFunction * cost_function = new IdentityCostFunction_stacked(
+              model_projected_i, param_sets[i].recon.cons, Mview_i, Rmat_i,
+              param_sets[i].cam, weight_i);
+            problem.AddResidualBlock(cost_function, NULL, params.data());
+#else
             for(size_t j=0;j<param_sets[i].indices.size();++j) {
               ceres::CostFunction * cost_function = new IdentityCostFunction_analytic(
                 model_projected_i[j], param_sets[i].recon.cons[j], params.size(), Mview_i, Rmat_i,
@@ -1112,6 +1251,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
 
               problem.AddResidualBlock(cost_function, NULL, params.data());
             }
+#endif
           }
 
           // Add prior constraint
@@ -1129,6 +1269,7 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
               "[Identity optimization] Problem solve time = %w seconds.\n");
             ceres::Solver::Options options;
             options.max_num_iterations = 3;
+            options.check_gradients = CHECK_ANALYTIC_COST_FUNCTIONS;
             options.minimizer_type = ceres::LINE_SEARCH;
             options.line_search_direction_type = ceres::LBFGS;
             DEBUG_EXPR(options.minimizer_progress_to_stdout = true;)
@@ -1136,16 +1277,19 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
             ceres::Solve(options, &problem, &summary);
             DEBUG_OUTPUT(summary.FullReport())
           }
+#endif
 
           // Update the identity weights
           for(auto& param : param_sets) {
             param.model.Wid = params;
+          }
 
-            // Also update geometry if needed
-            {
-              model.ApplyWeights(param.model.Wid, param.model.Wexp);
-              param.mesh.UpdateVertices(model.GetTM());
-              param.mesh.ComputeNormals();
+          // Also update geometry if needed
+          {
+            MatrixXd geometries = GetGeometries();
+            for(size_t i=0;i<param_sets.size();++i) {
+              param_sets[i].mesh.UpdateVertices(geometries.col(i));
+              param_sets[i].mesh.ComputeNormals();
             }
           }
 
@@ -1170,21 +1314,28 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
       }
       // Similar to joint recon, but we optimize for individual head poses
       // and expression weights
-      ceres::Problem problem;
-      VectorXd params_head_poses(num_images * 6);
-      VectorXd params_Wexp_FACS(num_images * 46);
-
-      // Initialize the parameters
-      for(int i=0;i<num_images;++i) {
-        params_head_poses.middleRows(i*6,3) = param_sets[i].model.R;
-        params_head_poses.middleRows(i*6+3,3) = param_sets[i].model.T;
-
-        params_Wexp_FACS.middleRows(i*46,46) = param_sets[i].model.Wexp_FACS.bottomRows(46);
-      }
-
-      // Add constraints from each image
-      cout << "Adding per-vertex constraints ..." << endl;
 
+      // Sliding window (fixed lag) mode: each solve covers window_size frames,
+      // after which the first window_step frames are final. The smoothness terms
+      // couple 3 consecutive frames, so the last 2 final frames enter the next
+      // window as constant parameter blocks, i.e. the old frames are conditioned
+      // on rather than marginalized. Memory and time per frame do not depend on
+      // the length of the video. A window_size of 0 solves all frames at once.
+      const int window_size_setting = temp_opt_settings.value("window_size", 0);
+      const int window_size = (window_size_setting > 0) ? min(window_size_setting, num_images)
+                                                        : num_images;
+      const int window_step = max(1, min(int(temp_opt_settings.value("window_step", window_size / 4)),
+                                         window_size));
+
+      cout << "Temporal optimization with window size " << window_size
+           << ", step " << window_step << endl;
+
+      // Head poses and expression weights of the frames in the current window,
+      // preceded by the final frames the smoothness terms use. Finished frames
+      // are written out and release their meshes, so only the buffers of one
+      // window and the parameters of each frame are kept.
+      VectorXd params_head_poses((window_size + 2) * 6);
+      VectorXd params_Wexp_FACS((window_size + 2) * 46);
 
       struct ExpressionPoseCostFunction {
         ExpressionPoseCostFunction(
@@ -1248,45 +1399,6 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
         int idx;
       };
 
-      for(int i=0;i<num_images;++i) {
-        // Create a projected model
-        vector<MultilinearModel> model_projected_i(param_sets[i].indices.size());
-        for(size_t j=0;j<param_sets[i].indices.size();++j) {
-          model_projected_i[j] = model.project(vector<int>(1, param_sets[i].indices[j]));
-          model_projected_i[j].ApplyWeights(param_sets[i].model.Wid, param_sets[i].model.Wexp);
-        }
-
-        double puple_distance = glm::distance(
-          0.5 * (param_sets[i].recon.cons[28].data + param_sets[i].recon.cons[30].data),
-          0.5 * (param_sets[i].recon.cons[32].data + param_sets[i].recon.cons[34].data));
-        double weight_i = double(temp_opt_settings["w_feat"]) / puple_distance;
-
-        // Add per-vertex constraints
-        for(size_t j=0;j<param_sets[i].indices.size();++j) {
-          ceres::DynamicNumericDiffCostFunction<ExpressionPoseCostFunction> *cost_function =
-            new ceres::DynamicNumericDiffCostFunction<ExpressionPoseCostFunction>(
-              new ExpressionPoseCostFunction(
-                model_projected_i[j], param_sets[i].recon.cons[j],
-                param_sets[i].cam,
-                prior.Uexp,
-                weight_i,
-                0
-              )
-            );
-
-          cost_function->AddParameterBlock(6);
-          cost_function->AddParameterBlock(46);
-          cost_function->SetNumResiduals(1);
-
-          problem.AddResidualBlock(cost_function, NULL,
-            vector<double*>{params_head_poses.data() + i*6,
-                            params_Wexp_FACS.data() + i*46});
-        }
-      }
-
-      // Add regularization for expression weights
-      cout << "Regularization for expression weights ..." << endl;
-
       struct ExpressionRegularizationCostFunction_Joint {
         ExpressionRegularizationCostFunction_Joint(const VectorXd &prior_vec,
                                              const MatrixXd &inv_cov_mat,
@@ -1340,45 +1452,6 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
         int idx;
       };
 
-      const double wexp_prior_weight = 1.0;
-      for(int i=0;i<num_images;++i) {
-        // {
-        //   // Gaussian reg
-        //   ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationCostFunction_Joint> *prior_cost_function =
-        //     new ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationCostFunction_Joint>(
-        //       new ExpressionRegularizationCostFunction_Joint(
-        //         prior.Wexp_avg,
-        //         prior.inv_sigma_Wexp,
-        //         prior.Uexp,
-        //         prior.weight_Wexp * wexp_prior_weight,
-        //         0
-        //       )
-        //     );
-        //   prior_cost_function->AddParameterBlock(46);
-        //   prior_cost_function->SetNumResiduals(1);
-        //   problem.AddResidualBlock(prior_cost_function, NULL, params_Wexp_FACS.data()+i*46);
-        // }
-
-        {
-          // L1 reg
-          const double puple_distance = glm::distance(
-            0.5 * (param_sets[i].recon.cons[28].data + param_sets[i].recon.cons[30].data),
-            0.5 * (param_sets[i].recon.cons[32].data + param_sets[i].recon.cons[34].data));
-
-          const double reg_factor = 100.0 / puple_distance;
-          ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationTerm_Joint> *reg_cost_function =
-            new ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationTerm_Joint>(
-              new ExpressionRegularizationTerm_Joint( temp_opt_settings["w_l1_reg"], 0 )
-            );
-          reg_cost_function->AddParameterBlock(46);
-          reg_cost_function->SetNumResiduals(46);
-          problem.AddResidualBlock(reg_cost_function, NULL, params_Wexp_FACS.data()+i*46);
-        }
-      }
-
-      // Add temporal coherence constraints
-      cout << "Temporal coherence for expression weights ..." << endl;
-
       struct SmoothnessCostFunction {
         SmoothnessCostFunction(double weight, int params_length)
          : weight(weight), params_length(params_length) {}
@@ -1396,25 +1469,6 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
         int params_length;
       };
 
-      // Expression coherence
-      for(int i=0;i<num_images-2;++i) {
-        ceres::DynamicNumericDiffCostFunction<SmoothnessCostFunction> *Wexp_smooth_cost_function =
-          new ceres::DynamicNumericDiffCostFunction<SmoothnessCostFunction>(
-            new SmoothnessCostFunction(temp_opt_settings["w_exp_s"], 46)
-          );
-        Wexp_smooth_cost_function->AddParameterBlock(46);
-        Wexp_smooth_cost_function->AddParameterBlock(46);
-        Wexp_smooth_cost_function->AddParameterBlock(46);
-        Wexp_smooth_cost_function->SetNumResiduals(1);
-        problem.AddResidualBlock(Wexp_smooth_cost_function, NULL,
-          vector<double*>{params_Wexp_FACS.data()+i*46,
-                          params_Wexp_FACS.data()+(i+1)*46,
-                          params_Wexp_FACS.data()+(i+2)*46});
-      }
-
-      // Pose coherence
-      cout << "Temporal coherence for poses ..." << endl;
-
       struct PoseSmoothnessCostFunction {
         PoseSmoothnessCostFunction(double weight, int params_length)
          : weight(weight), params_length(params_length) {}
@@ -1437,58 +1491,186 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
         int num_terms;
       };
 
-      for(int i=0;i<num_images-2;++i) {
-        ceres::DynamicNumericDiffCostFunction<PoseSmoothnessCostFunction> *pose_smooth_cost_function =
-          new ceres::DynamicNumericDiffCostFunction<PoseSmoothnessCostFunction>(
-            new PoseSmoothnessCostFunction(temp_opt_settings["w_pose_s"], 6)
-          );
-        pose_smooth_cost_function->AddParameterBlock(6);
-        pose_smooth_cost_function->AddParameterBlock(6);
-        pose_smooth_cost_function->AddParameterBlock(6);
-        pose_smooth_cost_function->SetNumResiduals(1);
-        problem.AddResidualBlock(pose_smooth_cost_function, NULL,
-                                 vector<double*>{
-                                   params_head_poses.data()+i*6,
-                                   params_head_poses.data()+(i+1)*6,
-                                   params_head_poses.data()+(i+2)*6
-                                 });
-      }
+      // Solves frames [begin, end), frames [fixed_begin, begin) are only used in
+      // the smoothness terms and stay constant
+      auto solve_window = [&](int fixed_begin, int begin, int end) {
+        // Slot k of the buffers holds frame fixed_begin + k
+        auto pose_block = [&](int i) { return params_head_poses.data() + (i - fixed_begin) * 6; };
+        auto wexp_block = [&](int i) { return params_Wexp_FACS.data() + (i - fixed_begin) * 46; };
+        for(int i=fixed_begin;i<end;++i) {
+          Map<Vector3d>(pose_block(i)) = param_sets[i].model.R;
+          Map<Vector3d>(pose_block(i) + 3) = param_sets[i].model.T;
+          Map<VectorXd>(wexp_block(i), 46) = param_sets[i].model.Wexp_FACS.bottomRows(46);
+        }
 
-      // for(int i=0;i<params.size()-1;++i) {
-      //   problem.SetParameterLowerBound(params.data()+1, i, 0.0);
-      //   problem.SetParameterUpperBound(params.data()+1, i, 1.0);
-      // }
+        ceres::Problem problem;
 
-      // Solve it
-      {
-        boost::timer::auto_cpu_timer timer_solve(
-          "Problem solve time = %w seconds.\n");
-        cout << "Sovling the problem ..." << endl;
-        ceres::Solver::Options options;
-        options.max_num_iterations = temp_opt_settings["max_iter"];
-        //options.minimizer_type = ceres::LINE_SEARCH;
-        //options.line_search_direction_type = ceres::LBFGS;
-        options.num_threads = 8;
-        options.num_linear_solver_threads = 8;
-        options.minimizer_progress_to_stdout = true;
-        ceres::Solver::Summary summary;
-        ceres::Solve(options, &problem, &summary);
-        cout << summary.FullReport() << endl;
-      }
+        // Add constraints from each image
+        for(int i=begin;i<end;++i) {
+          // Create a projected model
+          landmark_cache.Update(model, param_sets[i].indices);
+          vector<MultilinearModel> model_projected_i(param_sets[i].indices.size());
+          for(size_t j=0;j<param_sets[i].indices.size();++j) {
+            model_projected_i[j] = landmark_cache.GetModel(param_sets[i].indices[j]);
+            model_projected_i[j].ApplyWeights(param_sets[i].model.Wid, param_sets[i].model.Wexp);
+          }
 
-      // Update the expression weights and head poses
-      for(int i=0;i<num_images;++i) {
-        auto& param = param_sets[i];
-        param.model.Wexp_FACS.bottomRows(46) = params_Wexp_FACS.middleRows(i*46, 46);
-        param.model.R = params_head_poses.middleRows(i*6,3);
-        param.model.T = params_head_poses.middleRows(i*6+3,3);
+          double puple_distance = glm::distance(
+            0.5 * (param_sets[i].recon.cons[28].data + param_sets[i].recon.cons[30].data),
+            0.5 * (param_sets[i].recon.cons[32].data + param_sets[i].recon.cons[34].data));
+          double weight_i = double(temp_opt_settings["w_feat"]) / puple_distance;
 
-        // Also update geometry if needed
+          // Add per-vertex constraints
+          for(size_t j=0;j<param_sets[i].indices.size();++j) {
+#if USE_ANALYTIC_COST_FUNCTIONS
+            ceres::CostFunction *cost_function =
+              new ExpressionPoseCostFunction_2D_analytic(
+                model_projected_i[j], param_sets[i].recon.cons[j],
+                param_sets[i].cam, prior.Uexp, weight_i);
+#else
+            ceres::DynamicNumericDiffCostFunction<ExpressionPoseCostFunction> *cost_function =
+              new ceres::DynamicNumericDiffCostFunction<ExpressionPoseCostFunction>(
+                new ExpressionPoseCostFunction(
+                  model_projected_i[j], param_sets[i].recon.cons[j],
+                  param_sets[i].cam,
+                  prior.Uexp,
+                  weight_i,
+                  0
+                )
+              );
+
+            cost_function->AddParameterBlock(6);
+            cost_function->AddParameterBlock(46);
+            cost_function->SetNumResiduals(1);
+#endif
+
+            problem.AddResidualBlock(cost_function, NULL,
+              vector<double*>{pose_block(i),
+                              wexp_block(i)});
+          }
+        }
+
+        // Add regularization for expression weights
+        for(int i=begin;i<end;++i) {
+          // {
+          //   // Gaussian reg
+          //   ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationCostFunction_Joint> *prior_cost_function =
+          //     new ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationCostFunction_Joint>(
+          //       new ExpressionRegularizationCostFunction_Joint(
+          //         prior.Wexp_avg,
+          //         prior.inv_sigma_Wexp,
+          //         prior.Uexp,
+          //         prior.weight_Wexp,
+          //         0
+          //       )
+          //     );
+          //   prior_cost_function->AddParameterBlock(46);
+          //   prior_cost_function->SetNumResiduals(1);
+          //   problem.AddResidualBlock(prior_cost_function, NULL, wexp_block(i));
+          // }
+
+          {
+            // L1 reg
+            ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationTerm_Joint> *reg_cost_function =
+              new ceres::DynamicNumericDiffCostFunction<ExpressionRegularizationTerm_Joint>(
+                new ExpressionRegularizationTerm_Joint( temp_opt_settings["w_l1_reg"], 0 )
+              );
+            reg_cost_function->AddParameterBlock(46);
+            reg_cost_function->SetNumResiduals(46);
+            problem.AddResidualBlock(reg_cost_function, NULL, wexp_block(i));
+          }
+        }
+
+        // Add temporal coherence constraints, expression coherence first
+        for(int i=fixed_begin;i<end-2;++i) {
+          ceres::DynamicNumericDiffCostFunction<SmoothnessCostFunction> *Wexp_smooth_cost_function =
+            new ceres::DynamicNumericDiffCostFunction<SmoothnessCostFunction>(
+              new SmoothnessCostFunction(temp_opt_settings["w_exp_s"], 46)
+            );
+          Wexp_smooth_cost_function->AddParameterBlock(46);
+          Wexp_smooth_cost_function->AddParameterBlock(46);
+          Wexp_smooth_cost_function->AddParameterBlock(46);
+          Wexp_smooth_cost_function->SetNumResiduals(1);
+          problem.AddResidualBlock(Wexp_smooth_cost_function, NULL,
+            vector<double*>{wexp_block(i),
+                            wexp_block(i+1),
+                            wexp_block(i+2)});
+        }
+
+        // Pose coherence
+        for(int i=fixed_begin;i<end-2;++i) {
+          ceres::DynamicNumericDiffCostFunction<PoseSmoothnessCostFunction> *pose_smooth_cost_function =
+            new ceres::DynamicNumericDiffCostFunction<PoseSmoothnessCostFunction>(
+              new PoseSmoothnessCostFunction(temp_opt_settings["w_pose_s"], 6)
+            );
+          pose_smooth_cost_function->AddParameterBlock(6);
+          pose_smooth_cost_function->AddParameterBlock(6);
+          pose_smooth_cost_function->AddParameterBlock(6);
+          pose_smooth_cost_function->SetNumResiduals(1);
+          problem.AddResidualBlock(pose_smooth_cost_function, NULL,
+                                   vector<double*>{
+                                     pose_block(i),
+                                     pose_block(i+1),
+                                     pose_block(i+2)
+                                   });
+        }
+
+        for(int i=fixed_begin;i<begin;++i) {
+          // A final frame is only in the problem if a smoothness term uses it
+          if(problem.HasParameterBlock(pose_block(i))) {
+            problem.SetParameterBlockConstant(pose_block(i));
+            problem.SetParameterBlockConstant(wexp_block(i));
+          }
+        }
+
+        // Solve it
         {
-          model.ApplyWeights(param.model.Wid, param.model.Wexp);
-          param.mesh.UpdateVertices(model.GetTM());
-          param.mesh.ComputeNormals();
+          boost::timer::auto_cpu_timer timer_solve(
+            "Problem solve time = %w seconds.\n");
+          cout << "Sovling the problem ..." << endl;
+          ceres::Solver::Options options;
+          options.max_num_iterations = temp_opt_settings["max_iter"];
+          options.check_gradients = CHECK_ANALYTIC_COST_FUNCTIONS;
+          //options.minimizer_type = ceres::LINE_SEARCH;
+          //options.line_search_direction_type = ceres::LBFGS;
+          options.num_threads = 8;
+          options.num_linear_solver_threads = 8;
+          options.minimizer_progress_to_stdout = (end - fixed_begin == num_images);
+          ceres::Solver::Summary summary;
+          ceres::Solve(options, &problem, &summary);
+          cout << (end - fixed_begin == num_images ? summary.FullReport() : summary.BriefReport()) << endl;
+        }
+      };
+
+      for(int begin=0;begin<num_images;begin+=window_step) {
+        const int end = min(begin + window_size, num_images);
+        const int fixed_begin = max(begin - 2, 0);
+        solve_window(fixed_begin, begin, end);
+
+        // Keep the solution of the whole window, the frames that are not final
+        // yet start the next window from it
+        for(int i=begin;i<end;++i) {
+          auto& param = param_sets[i];
+          param.model.Wexp_FACS.bottomRows(46) = params_Wexp_FACS.middleRows((i - fixed_begin)*46, 46);
+          param.model.Wexp = param.model.Wexp_FACS.transpose() * prior.Uexp;
+          param.model.R = params_head_poses.middleRows((i - fixed_begin)*6, 3);
+          param.model.T = params_head_poses.middleRows((i - fixed_begin)*6+3, 3);
+        }
+
+        // Write out the frames that are final now and drop their meshes
+        const int final_end = (end == num_images) ? end : begin + window_step;
+        for(int i=begin;i<final_end;++i) {
+          param_sets[i].mesh.UpdateVertices(GetGeometry(i));
+          param_sets[i].mesh.ComputeNormals();
+        }
+        #pragma omp parallel for
+        for(int i=begin;i<final_end;++i) {
+          VisualizeReconstructionResult(result_path, i);
+          // Don't over write the init recon, write to the output place
+          SaveReconstructionResult(result_path, i);
+          param_sets[i].mesh = BasicMesh();
         }
+        if(end == num_images) break;
       }
   }
 
@@ -1517,45 +1699,172 @@ bool VideoReconstructor<Constraint>::Reconstruct() {
     fout.close();
   }
 
-  // Visualize the final reconstruction results
-  #pragma omp parallel for
+  return true;
+}
+
+template <typename Constraint>
+bool VideoReconstructor<Constraint>::Track() {
+  cout << "Tracking begins..." << endl;
+
+  const int num_images = frames.size();
+  if(num_images == 0) {
+    cerr << "No input images." << endl;
+    return false;
+  }
+
+  fs::path image_path = fs::path(image_filenames.front()).parent_path();
+  fs::path result_path = image_path / fs::path("track");
+  safe_create(result_path);
+
+  InitializeParameterSets();
+
+  recon_context->CacheLandmarks(init_indices);
+  landmark_cache = recon_context->landmark_cache;
+
+  // Bootstrap: reconstruct the first few frames individually and take the
+  // centroid of their identities as the initial identity
+  const int num_bootstrap = max(1, min(num_bootstrap_frames, num_images));
+  vector<int> bootstrap_set(num_bootstrap);
+  iota(bootstrap_set.begin(), bootstrap_set.end(), 0);
+  VectorXd identity_weights;
+  {
+    boost::timer::auto_cpu_timer t("[Tracking] Bootstrap finished in %w seconds.\n");
+
+    OptimizationParameters opt_params = OptimizationParameters::Defaults();
+    opt_params.w_prior_id = 10;
+    opt_params.w_prior_exp = 10;
+    opt_params.num_initializations = 1;
+    opt_params.perturbation_range = 0.01;
+    opt_params.errorThreshold = 0.01;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i=0;i<num_bootstrap;++i) {
+      SingleImageReconstructor<Constraint> single_recon(recon_context);
+      single_recon.SetRandomSeed(i);
+      single_recon.SetMesh(param_sets[i].mesh);
+      single_recon.SetIndices(param_sets[i].indices);
+      single_recon.SetImageSize(param_sets[i].recon.imageWidth, param_sets[i].recon.imageHeight);
+      single_recon.SetConstraints(param_sets[i].recon.cons);
+      single_recon.SetInitialParameters(param_sets[i].model, param_sets[i].cam);
+      single_recon.Reconstruct(opt_params);
+
+      param_sets[i].model = single_recon.GetModelParameters();
+      param_sets[i].indices = single_recon.GetIndices();
+      param_sets[i].cam = single_recon.GetCameraParameters();
+    }
+
+    identity_weights = VectorXd::Zero(param_sets[0].model.Wid.rows());
+    for(auto i : bootstrap_set) identity_weights += param_sets[i].model.Wid;
+    identity_weights /= num_bootstrap;
+    for(auto i : bootstrap_set) param_sets[i].model.Wid = identity_weights;
+  }
+
+  // The identity is solved jointly over a bounded set of keyframes only. A
+  // new keyframe replaces or adds one image of the solver, which is then
+  // warm started from the current identity, so a refresh costs the same no
+  // matter how long the sequence is.
+  KeyframeSelector keyframes(max_keyframes);
+  JointIdentitySolver identity_solver(prior.Wid_avg, prior.inv_sigma_Wid, prior.weight_Wid, 0);
+  auto add_keyframe = [&](int i) {
+    const int slot = keyframes.AddFrame(i, param_sets[i].model);
+    if(slot < 0) return false;
+    landmark_cache.Update(model, param_sets[i].indices);
+    if(slot == identity_solver.size()) identity_solver.Resize(slot + 1);
+    SetJointIdentityImage(identity_solver, slot, i);
+    identity_solver.SetPriorWeight(prior.weight_Wid * keyframes.size());
+    return true;
+  };
+
+  for(auto i : bootstrap_set) add_keyframe(i);
+  identity_solver.Solve(identity_weights);
+
+  // All frames share one camera, with the mean focal length of the bootstrap
+  // frames
+  double focal_length = 0;
+  for(auto i : bootstrap_set) focal_length += param_sets[i].cam.focal_length;
+  focal_length /= num_bootstrap;
+  for(auto& param : param_sets) {
+    param.cam.focal_length = focal_length;
+    param.cam.fovy = 2.0 * atan(1.0 / focal_length);
+  }
+
+  // Track all frames, the bootstrap frames included. The landmark
+  // correspondences are carried over from the previous frame once the
+  // bootstrap frames are passed. While streaming, every frame uses the
+  // identity estimated from the keyframes seen so far. The results are written
+  // once per video though, so if the identity changed, all frames are tracked
+  // again with the final one and share it.
+  FaceTracker tracker(landmark_cache, prior.Uexp, identity_weights);
+  tracker.SetConstantVelocityPrediction(enable_velocity_prediction);
+  tracker.Reset(param_sets[0].model);
+
+  // The per frame latency only counts the tracking, the identity refreshes
+  // and the final pass are timed separately
+  int num_refreshes = 0;
+  boost::timer::cpu_timer timer_track, timer_refresh;
+  timer_refresh.stop();
   for(int i=0;i<num_images;++i) {
-    // Visualize the reconstruction results
-    #if 0
-    MeshVisualizer* w = new MeshVisualizer("reconstruction result", param_sets[i].mesh);
-    w->BindConstraints(image_points_pairs[i].second);
-    w->BindImage(image_points_pairs[i].first);
-    w->BindLandmarks(init_indices);
-
-    w->BindUpdatedLandmarks(param_sets[i].indices);
-    w->SetMeshRotationTranslation(param_sets[i].model.R, param_sets[i].model.T);
-    w->SetCameraParameters(param_sets[i].cam);
-
-    int show_width = image_points_pairs[i].first.width();
-    int show_height = image_points_pairs[i].first.height();
-    double show_ratio = 640.0 / show_height;
-    w->resize(show_width * show_ratio, 640);
-    w->show();
-
-    w->paintGL();
-    QImage recon_image = w->grabFrameBuffer();
-    fs::path image_path = fs::path(image_filenames[i]);
+    auto& param = param_sets[i];
+    if(i >= num_bootstrap) {
+      param.indices = param_sets[i-1].indices;
+      param.model = param_sets[i-1].model;
+    }
+    tracker.Track(param.recon.cons, param.indices, param.cam);
+    tracker.GetParameters(param.model);
+
+    if(i >= num_bootstrap && add_keyframe(i)) {
+      timer_track.stop();
+      timer_refresh.resume();
+      identity_solver.Solve(identity_weights, 3);
+      tracker.SetIdentity(identity_weights);
+      ++num_refreshes;
+      timer_refresh.stop();
+      timer_track.resume();
+    }
+  }
+  timer_track.stop();
+  cout << "[Tracking] " << num_images << " frames tracked, "
+       << timer_track.elapsed().wall * 1e-6 / num_images << " ms per frame." << endl;
+
+  if(num_refreshes > 0) {
+    timer_refresh.resume();
+    identity_solver.Solve(identity_weights);
+    tracker.SetIdentity(identity_weights);
+    tracker.Reset(param_sets[0].model);
+    for(int i=0;i<num_images;++i) {
+      auto& param = param_sets[i];
+      tracker.Track(param.recon.cons, param.indices, param.cam);
+      tracker.GetParameters(param.model);
+    }
+    timer_refresh.stop();
+    cout << "[Tracking] " << num_refreshes << " identity refreshes and the final pass took "
+         << timer_refresh.elapsed().wall * 1e-9 << " seconds." << endl;
+  }
 
-    recon_image.save( (result_path / fs::path(image_path.stem().string() + "_recon.png")).string().c_str() );
-    #else
-    VisualizeReconstructionResult(result_path, i);
-    #endif
+  // Every frame is saved with the final identity
+  for(auto& param : param_sets) param.model.Wid = identity_weights;
 
-    // Don't over write the init recon, write to the output place
-    ofstream fout(
-      (result_path / fs::path(fs::path(image_filenames[i]).filename().string() + ".res")).string()
-    );
-    fout << param_sets[i].cam << endl;
-    fout << param_sets[i].model << endl;
-    fout << param_sets[i].stats << endl;
+  {
+    ofstream fout( (result_path / fs::path("keyframes.txt")).string() );
+    for(auto i : keyframes.keyframes()) fout << i << endl;
     fout.close();
   }
 
+  // Geometry of all frames in one pass over the core
+  {
+    MatrixXd geometries = GetGeometries();
+    for(int i=0;i<num_images;++i) {
+      param_sets[i].mesh.UpdateVertices(geometries.col(i));
+      param_sets[i].mesh.ComputeNormals();
+    }
+  }
+
+  #pragma omp parallel for
+  for(int i=0;i<num_images;++i) {
+    VisualizeReconstructionResult(result_path, i);
+    SaveReconstructionResult(result_path, i);
+  }
+
   return true;
 }
 